@@ -0,0 +1,134 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "action_buffer.hh"
+#include "level.hh"
+
+using namespace std;
+
+
+action_buffer::action_buffer() : num_frames(0) { }
+
+size_t action_buffer::size() const {
+  return this->num_frames;
+}
+
+bool action_buffer::empty() const {
+  return this->num_frames == 0;
+}
+
+void action_buffer::clear() {
+  this->entries.clear();
+  this->checkpoints.clear();
+  this->num_frames = 0;
+}
+
+void action_buffer::push_entry(uint8_t action, uint16_t length) {
+  if ((this->entries.size() % ENTRIES_PER_CHECKPOINT) == 0) {
+    this->checkpoints.emplace_back(this->num_frames);
+  }
+  this->entries.emplace_back((length << 4) | action);
+  this->num_frames += length;
+}
+
+void action_buffer::push_back(const struct player_actions& actions) {
+  uint8_t action = encode_action(actions);
+  if (!this->entries.empty() && ((this->entries.back() & 0x0F) == action) &&
+      ((this->entries.back() >> 4) < MAX_ENTRY_LENGTH)) {
+    this->entries.back() += 0x10;
+    this->num_frames++;
+  } else {
+    this->push_entry(action, 1);
+  }
+}
+
+void action_buffer::append_run(const struct player_actions& actions,
+    uint64_t count) {
+  uint8_t action = encode_action(actions);
+
+  // fill up the last entry first if it has the same action
+  if (count && !this->entries.empty() &&
+      ((this->entries.back() & 0x0F) == action)) {
+    uint64_t space = MAX_ENTRY_LENGTH - (this->entries.back() >> 4);
+    uint64_t length = min<uint64_t>(space, count);
+    this->entries.back() += length << 4;
+    this->num_frames += length;
+    count -= length;
+  }
+
+  while (count) {
+    uint16_t length = min<uint64_t>(MAX_ENTRY_LENGTH, count);
+    this->push_entry(action, length);
+    count -= length;
+  }
+}
+
+void action_buffer::truncate(size_t new_size) {
+  while (this->num_frames > new_size) {
+    uint64_t excess = this->num_frames - new_size;
+    uint64_t length = this->entries.back() >> 4;
+    if (length > excess) {
+      this->entries.back() -= excess << 4;
+      this->num_frames = new_size;
+    } else {
+      this->entries.pop_back();
+      this->num_frames -= length;
+      if ((this->entries.size() % ENTRIES_PER_CHECKPOINT) == 0) {
+        this->checkpoints.pop_back();
+      }
+    }
+  }
+}
+
+void action_buffer::find_frame(size_t frame, size_t* entry_index,
+    uint32_t* entry_offset) const {
+  if (frame >= this->num_frames) {
+    throw out_of_range("frame is beyond the end of the action buffer");
+  }
+
+  // find the last checkpoint at or before the frame, then scan its entries
+  auto it = upper_bound(this->checkpoints.begin(), this->checkpoints.end(),
+      frame) - 1;
+  size_t index = (it - this->checkpoints.begin()) * ENTRIES_PER_CHECKPOINT;
+  uint64_t start_frame = *it;
+  for (;;) {
+    uint64_t length = this->entries[index] >> 4;
+    if (frame < start_frame + length) {
+      break;
+    }
+    start_frame += length;
+    index++;
+  }
+
+  *entry_index = index;
+  *entry_offset = frame - start_frame;
+}
+
+struct player_actions action_buffer::operator[](size_t frame) const {
+  size_t entry_index;
+  uint32_t entry_offset;
+  this->find_frame(frame, &entry_index, &entry_offset);
+  return decode_action(this->entries[entry_index] & 0x0F);
+}
+
+action_buffer::const_iterator action_buffer::begin() const {
+  return const_iterator(this, 0, 0);
+}
+
+action_buffer::const_iterator action_buffer::end() const {
+  return const_iterator(this, this->entries.size(), 0);
+}
+
+action_buffer::const_iterator action_buffer::iterator_at(size_t frame) const {
+  if (frame == this->num_frames) {
+    return this->end();
+  }
+  size_t entry_index;
+  uint32_t entry_offset;
+  this->find_frame(frame, &entry_index, &entry_offset);
+  return const_iterator(this, entry_index, entry_offset);
+}
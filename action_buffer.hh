@@ -0,0 +1,124 @@
+#ifndef __ACTION_BUFFER_H
+#define __ACTION_BUFFER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+#include "level.hh"
+
+
+// the actions for a single frame packed into a nibble: drop_bomb in bit 3 and
+// the impulse in bits 0-2. this is also how actions are stored in files
+inline uint8_t encode_action(const struct player_actions& actions) {
+  return (actions.drop_bomb ? 0x08 : 0x00) | (actions.impulse & 0x07);
+}
+
+inline struct player_actions decode_action(uint8_t nibble) {
+  struct player_actions actions;
+  actions.impulse = static_cast<enum player_impulse>(nibble & 0x07);
+  actions.drop_bomb = (nibble & 0x08) ? true : false;
+  return actions;
+}
+
+
+
+// the player's actions for every frame of a game, stored as runs of identical
+// actions. each run is a 16-bit entry (length << 4) | action, so idle
+// stretches cost almost nothing and even a recording that changes actions on
+// every frame takes a quarter of the space a deque<player_actions> would.
+// appending and truncating at the end are O(1); random access is
+// O(log(frames)) via a table of the starting frame of every 64th entry, and
+// iterating is cheap.
+class action_buffer {
+public:
+  class const_iterator {
+  public:
+    const_iterator() = default;
+
+    struct player_actions operator*() const {
+      return decode_action(this->buffer->entries[this->entry_index] & 0x0F);
+    }
+    const_iterator& operator++() {
+      this->entry_offset++;
+      if (this->entry_offset == (this->buffer->entries[this->entry_index] >> 4)) {
+        this->entry_index++;
+        this->entry_offset = 0;
+      }
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator ret = *this;
+      ++(*this);
+      return ret;
+    }
+    bool operator==(const const_iterator& other) const {
+      return (this->entry_index == other.entry_index) &&
+          (this->entry_offset == other.entry_offset);
+    }
+    bool operator!=(const const_iterator& other) const {
+      return !(*this == other);
+    }
+
+  private:
+    friend class action_buffer;
+    const_iterator(const action_buffer* buffer, size_t entry_index,
+        uint32_t entry_offset) : buffer(buffer), entry_index(entry_index),
+        entry_offset(entry_offset) { }
+
+    const action_buffer* buffer;
+    size_t entry_index;
+    uint32_t entry_offset;
+  };
+
+  action_buffer();
+  ~action_buffer() = default;
+
+  size_t size() const;
+  bool empty() const;
+  void clear();
+
+  void push_back(const struct player_actions& actions);
+  void append_run(const struct player_actions& actions, uint64_t count);
+  // removes frames from the end so that new_size remain. does nothing if the
+  // buffer is already no longer than that
+  void truncate(size_t new_size);
+
+  struct player_actions operator[](size_t frame) const;
+
+  const_iterator begin() const;
+  const_iterator end() const;
+  const_iterator iterator_at(size_t frame) const;
+
+  // calls f(const player_actions&, uint64_t length) for each run of identical
+  // actions, in order. adjacent entries with the same action are merged, so
+  // each call's actions differ from the previous call's
+  template <typename F>
+  void for_each_run(F f) const {
+    size_t x = 0;
+    while (x < this->entries.size()) {
+      uint8_t action = this->entries[x] & 0x0F;
+      uint64_t length = 0;
+      for (; (x < this->entries.size()) && ((this->entries[x] & 0x0F) == action); x++) {
+        length += this->entries[x] >> 4;
+      }
+      f(decode_action(action), length);
+    }
+  }
+
+private:
+  static const uint16_t MAX_ENTRY_LENGTH = 0x0FFF;
+  static const size_t ENTRIES_PER_CHECKPOINT = 64;
+
+  void push_entry(uint8_t action, uint16_t length);
+  void find_frame(size_t frame, size_t* entry_index, uint32_t* entry_offset) const;
+
+  std::vector<uint16_t> entries;
+  // checkpoints[x] is the frame on which entries[x * ENTRIES_PER_CHECKPOINT]
+  // starts
+  std::vector<uint64_t> checkpoints;
+  uint64_t num_frames;
+};
+
+#endif // __ACTION_BUFFER_H
@@ -0,0 +1,91 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "activity.hh"
+#include "file_io.hh"
+
+using namespace std;
+
+
+static const uint64_t ACTIVITY_SIGNATURE = 0x4D42455348454154; // 'MBESHEAT'
+static const uint64_t ACTIVITY_VERSION = 0;
+
+struct activity_header {
+  uint64_t signature;
+  uint64_t version;
+  uint32_t w;
+  uint32_t h;
+  uint64_t frames;
+  uint64_t num_planes;
+};
+
+const char* name_for_activity_plane(activity_plane plane) {
+  switch (plane) {
+    case CellWrites:
+      return "writes";
+    case PlayerVisits:
+      return "player_visits";
+    case ExplosionCoverage:
+      return "explosions";
+    case ObjectFalls:
+      return "falls";
+  }
+  return "unknown";
+}
+
+activity_counters::activity_counters(uint32_t w, uint32_t h) {
+  this->reset(w, h);
+}
+
+void activity_counters::reset(uint32_t w, uint32_t h) {
+  this->w = w;
+  this->h = h;
+  this->frames = 0;
+  for (auto& plane : this->planes) {
+    plane.assign(static_cast<size_t>(w) * h, 0);
+  }
+}
+
+void activity_counters::add(const activity_counters& other) {
+  if ((other.w != this->w) || (other.h != this->h)) {
+    throw invalid_argument("activity counters are for different level sizes");
+  }
+  this->frames += other.frames;
+  for (size_t x = 0; x < NUM_ACTIVITY_PLANES; x++) {
+    for (size_t y = 0; y < this->planes[x].size(); y++) {
+      this->planes[x][y] += other.planes[x][y];
+    }
+  }
+}
+
+uint32_t activity_counters::max_count(activity_plane plane) const {
+  const auto& counts = this->planes[plane];
+  return counts.empty() ? 0 : *max_element(counts.begin(), counts.end());
+}
+
+void save_activity(const string& filename, const activity_counters& a) {
+  size_t plane_size = static_cast<size_t>(a.w) * a.h * sizeof(uint32_t);
+  string data(sizeof(activity_header) + NUM_ACTIVITY_PLANES * plane_size, '\0');
+
+  activity_header* header = reinterpret_cast<activity_header*>(&data[0]);
+  header->signature = ACTIVITY_SIGNATURE;
+  header->version = ACTIVITY_VERSION;
+  header->w = a.w;
+  header->h = a.h;
+  header->frames = a.frames;
+  header->num_planes = NUM_ACTIVITY_PLANES;
+
+  char* ptr = &data[sizeof(activity_header)];
+  for (const auto& plane : a.planes) {
+    if (!plane.empty()) {
+      memcpy(ptr, plane.data(), plane_size);
+    }
+    ptr += plane_size;
+  }
+
+  save_file_atomic(filename, data);
+}
@@ -0,0 +1,51 @@
+#ifndef __ACTIVITY_H
+#define __ACTIVITY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+
+enum activity_plane {
+  CellWrites = 0, // cells changed (every write_cell_to_undo_log call)
+  PlayerVisits, // frames the player spent in the cell
+  ExplosionCoverage, // explosions that covered the cell
+  ObjectFalls, // objects that fell into the cell
+};
+
+static const size_t NUM_ACTIVITY_PLANES = ObjectFalls + 1;
+
+const char* name_for_activity_plane(activity_plane plane);
+
+// how often things happened in each cell of a level, counted by exec_frame
+// while level_state::activity points to one of these. the counts only go up:
+// rewinding doesn't undo them, and they can be added up over many games on
+// the same level (e.g. every recording of it).
+//
+// counting costs an increment at each site that already writes to the undo
+// log, plus one per frame for the player, so it can stay on for batch
+// replays. the counters are never shared between threads; each thread that
+// simulates keeps its own and adds them up afterward.
+struct activity_counters {
+  uint32_t w;
+  uint32_t h;
+  uint64_t frames; // frames counted
+  // w * h counts per plane, in the same order as level_state::cells
+  std::vector<uint32_t> planes[NUM_ACTIVITY_PLANES];
+
+  activity_counters(uint32_t w = 0, uint32_t h = 0);
+
+  // sets every count to zero, and changes the size if needed
+  void reset(uint32_t w, uint32_t h);
+  // throws invalid_argument if the sizes differ
+  void add(const activity_counters& other);
+  uint32_t max_count(activity_plane plane) const;
+};
+
+// the file is a fixed header (see activity_header in activity.cc) followed by
+// each plane as w * h uint32s, in native byte order
+void save_activity(const std::string& filename, const activity_counters& a);
+
+#endif // __ACTIVITY_H
@@ -0,0 +1,248 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+
+#include "action_buffer.hh"
+#include "catalog.hh"
+#include "codec.hh"
+#include "file_io.hh"
+#include "level.hh"
+#include "level_completion.hh"
+#include "recording.hh"
+#include "replay.hh"
+
+using namespace std;
+
+
+// the catalog file is a header followed by fixed-size records, each of which
+// describes one recording. records are only ever appended; if loading finds a
+// damaged record (e.g. from a torn write), the file is rewritten without it.
+
+static const uint64_t CATALOG_SIGNATURE = 0x4D42455343544C47; // 'MBESCTLG'
+
+struct catalog_header {
+  uint64_t signature;
+  uint64_t record_size;
+};
+
+struct catalog_record {
+  uint64_t content_hash;
+  uint64_t source_level_hash;
+  uint32_t level_index;
+  uint32_t state;
+  uint64_t frames_executed;
+  uint64_t frames;
+  uint64_t extra_items;
+  uint64_t extra_bombs;
+  uint64_t cleared_space;
+  uint64_t attenuated_space;
+  uint64_t entropy;
+  uint64_t rewind_count;
+  uint64_t checksum; // fnv1a64 of all the preceding fields
+
+  catalog_record() = default;
+  explicit catalog_record(const catalog_entry& e) :
+      content_hash(e.content_hash), source_level_hash(e.source_level_hash),
+      level_index(e.level_index), state(e.stats.state),
+      frames_executed(e.frames_executed), frames(e.stats.frames),
+      extra_items(e.stats.extra_items), extra_bombs(e.stats.extra_bombs),
+      cleared_space(e.stats.cleared_space),
+      attenuated_space(e.stats.attenuated_space), entropy(e.stats.entropy),
+      rewind_count(e.stats.rewind_count), checksum(this->compute_checksum()) { }
+
+  uint64_t compute_checksum() const {
+    return fnv1a64(this, offsetof(catalog_record, checksum));
+  }
+
+  catalog_entry to_entry() const {
+    catalog_entry e;
+    e.content_hash = this->content_hash;
+    e.source_level_hash = this->source_level_hash;
+    e.level_index = this->level_index;
+    e.frames_executed = this->frames_executed;
+    e.stats.state = static_cast<level_completion_state>(this->state);
+    e.stats.frames = this->frames;
+    e.stats.extra_items = this->extra_items;
+    e.stats.extra_bombs = this->extra_bombs;
+    e.stats.cleared_space = this->cleared_space;
+    e.stats.attenuated_space = this->attenuated_space;
+    e.stats.entropy = this->entropy;
+    e.stats.rewind_count = this->rewind_count;
+    return e;
+  }
+};
+
+
+
+recording_catalog::recording_catalog(const string& directory) :
+    directory(directory), catalog_filename(directory + "/catalog.mbc") {
+  mkdir(this->directory.c_str(), 0755);
+  this->load();
+}
+
+void recording_catalog::load() {
+  size_t num_valid_records = 0;
+  bool needs_rewrite = false;
+  try {
+    mapped_file f(this->catalog_filename);
+    const auto* header = reinterpret_cast<const catalog_header*>(f.data());
+    if ((f.size() < sizeof(catalog_header)) ||
+        (header->signature != CATALOG_SIGNATURE) ||
+        (header->record_size != sizeof(catalog_record))) {
+      fprintf(stderr, "recording catalog %s is in an unknown format; rebuilding it\n",
+          this->catalog_filename.c_str());
+      needs_rewrite = true;
+
+    } else {
+      const auto* records = reinterpret_cast<const catalog_record*>(
+          f.data() + sizeof(catalog_header));
+      size_t num_records = (f.size() - sizeof(catalog_header)) / sizeof(catalog_record);
+      for (; num_valid_records < num_records; num_valid_records++) {
+        const catalog_record& r = records[num_valid_records];
+        if (r.checksum != r.compute_checksum()) {
+          break;
+        }
+        catalog_entry e = r.to_entry();
+        if (!this->entries.count(e.content_hash)) {
+          this->level_to_content_hashes[e.source_level_hash].emplace_back(
+              e.content_hash);
+        }
+        this->entries[e.content_hash] = e;
+      }
+      needs_rewrite = (f.size() != sizeof(catalog_header) +
+          num_valid_records * sizeof(catalog_record));
+    }
+
+  } catch (const cannot_open_file&) {
+    return;
+  }
+
+  if (needs_rewrite) {
+    catalog_header header;
+    header.signature = CATALOG_SIGNATURE;
+    header.record_size = sizeof(catalog_record);
+    string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const auto& it : this->entries) {
+      catalog_record r(it.second);
+      data.append(reinterpret_cast<const char*>(&r), sizeof(r));
+    }
+    save_file_atomic(this->catalog_filename, data);
+  }
+}
+
+void recording_catalog::append(const catalog_entry& e) {
+  fd_guard fd(open(this->catalog_filename.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644));
+  if (fd.get() < 0) {
+    throw cannot_open_file(this->catalog_filename);
+  }
+
+  string data;
+  struct stat st;
+  if ((fstat(fd.get(), &st) == 0) && (st.st_size == 0)) {
+    catalog_header header;
+    header.signature = CATALOG_SIGNATURE;
+    header.record_size = sizeof(catalog_record);
+    data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  }
+  catalog_record r(e);
+  data.append(reinterpret_cast<const char*>(&r), sizeof(r));
+
+  // like the progress journal, the checksum protects against torn writes, so
+  // we don't sync here
+  if (write(fd.get(), data.data(), data.size()) != static_cast<ssize_t>(data.size())) {
+    throw runtime_error("can\'t append to recording catalog");
+  }
+}
+
+size_t recording_catalog::size() const {
+  return this->entries.size();
+}
+
+const catalog_entry* recording_catalog::find(uint64_t content_hash) const {
+  auto it = this->entries.find(content_hash);
+  return (it == this->entries.end()) ? NULL : &it->second;
+}
+
+vector<const catalog_entry*> recording_catalog::entries_for_level(
+    uint64_t source_level_hash) const {
+  vector<const catalog_entry*> ret;
+  auto it = this->level_to_content_hashes.find(source_level_hash);
+  if (it != this->level_to_content_hashes.end()) {
+    for (uint64_t content_hash : it->second) {
+      ret.emplace_back(&this->entries.at(content_hash));
+    }
+  }
+  return ret;
+}
+
+const catalog_entry* recording_catalog::best_for_level(
+    uint64_t source_level_hash) const {
+  const catalog_entry* ret = NULL;
+  for (const catalog_entry* e : this->entries_for_level(source_level_hash)) {
+    if ((e->stats.state == Completed) &&
+        (!ret || (e->stats.frames < ret->stats.frames))) {
+      ret = e;
+    }
+  }
+  return ret;
+}
+
+string catalog_recording_filename(const string& directory,
+    uint64_t content_hash) {
+  return string_printf("%s/%016" PRIX64 ".mbr", directory.c_str(),
+      content_hash);
+}
+
+string recording_catalog::recording_filename(uint64_t content_hash) const {
+  return catalog_recording_filename(this->directory, content_hash);
+}
+
+const catalog_entry& recording_catalog::add(const action_buffer& recording,
+    const level_state& source_level, uint32_t level_index) {
+  uint64_t source_level_hash = source_level.hash();
+  uint64_t content_hash = recording_content_hash(recording, source_level_hash);
+  string filename = this->recording_filename(content_hash);
+
+  // if the recording is already cataloged, there's nothing to do unless its
+  // file has been deleted since
+  auto it = this->entries.find(content_hash);
+  if (it != this->entries.end()) {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+      save_recording(filename, recording, source_level);
+    }
+    return it->second;
+  }
+
+  replay_result result = replay_recording(source_level, recording);
+  save_recording(filename, recording, source_level);
+
+  catalog_entry e;
+  e.content_hash = content_hash;
+  e.source_level_hash = source_level_hash;
+  e.level_index = level_index;
+  e.frames_executed = result.frames_executed;
+  e.stats = result.stats;
+  return this->add(e);
+}
+
+const catalog_entry& recording_catalog::add(const catalog_entry& e) {
+  auto it = this->entries.find(e.content_hash);
+  if (it != this->entries.end()) {
+    return it->second;
+  }
+  this->append(e);
+  this->level_to_content_hashes[e.source_level_hash].emplace_back(
+      e.content_hash);
+  return this->entries.emplace(e.content_hash, e).first->second;
+}
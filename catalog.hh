@@ -0,0 +1,70 @@
+#ifndef __CATALOG_H
+#define __CATALOG_H
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "action_buffer.hh"
+#include "level.hh"
+#include "level_completion.hh"
+
+
+struct catalog_entry {
+  uint64_t content_hash; // see recording_content_hash
+  uint64_t source_level_hash;
+  uint32_t level_index; // the level's index in its pack when it was added
+  uint64_t frames_executed; // see replay_result
+  level_completion stats;
+};
+
+// an index of the recordings in a directory. recordings are stored by content
+// hash (as <directory>/<hash>.mbr), so saving the same recording twice only
+// stores it once, and the catalog file (<directory>/catalog.mbc) records the
+// outcome and stats of each one so they can be listed and searched without
+// decoding or simulating anything. the catalog is an append-only journal of
+// fixed-size checksummed records, like the progress file.
+//
+// not thread-safe; the game only uses it from its I/O thread.
+class recording_catalog {
+public:
+  explicit recording_catalog(const std::string& directory);
+  recording_catalog(const recording_catalog&) = delete;
+  recording_catalog& operator=(const recording_catalog&) = delete;
+  ~recording_catalog() = default;
+
+  size_t size() const;
+  const catalog_entry* find(uint64_t content_hash) const;
+  std::vector<const catalog_entry*> entries_for_level(
+      uint64_t source_level_hash) const;
+  // the winning recording with the fewest frames, or NULL if there is none
+  const catalog_entry* best_for_level(uint64_t source_level_hash) const;
+
+  std::string recording_filename(uint64_t content_hash) const;
+
+  // saves the recording and adds it to the catalog, unless it's already there.
+  // replays the recording to compute its stats if it's new
+  const catalog_entry& add(const action_buffer& recording,
+      const level_state& source_level, uint32_t level_index);
+  // adds an entry for a recording that the caller has already replayed and
+  // saved as recording_filename(e.content_hash), unless it's already there.
+  // for importing many recordings at once (see mbes-verify --catalog)
+  const catalog_entry& add(const catalog_entry& e);
+
+private:
+  void load();
+  void append(const catalog_entry& e);
+
+  std::string directory;
+  std::string catalog_filename;
+  std::unordered_map<uint64_t, catalog_entry> entries;
+  std::unordered_map<uint64_t, std::vector<uint64_t>> level_to_content_hashes;
+};
+
+// the name of the file a recording with this content hash is saved as
+std::string catalog_recording_filename(const std::string& directory,
+    uint64_t content_hash);
+
+#endif // __CATALOG_H
@@ -0,0 +1,236 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <stdexcept>
+#include <string>
+
+#include "codec.hh"
+
+using namespace std;
+
+
+static const int PROB_BITS = 11;
+static const uint32_t PROB_ONE = 1 << PROB_BITS;
+static const int PROB_ADAPT_SHIFT = 5;
+static const uint32_t RANGE_TOP = 1 << 24;
+
+
+
+uint64_t fnv1a64(const void* data, size_t size, uint64_t hash) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  for (size_t x = 0; x < size; x++) {
+    hash = (hash ^ bytes[x]) * 0x00000100000001B3;
+  }
+  return hash;
+}
+
+void append_varint(string& data, uint64_t v) {
+  while (v >= 0x80) {
+    data.push_back(static_cast<char>((v & 0x7F) | 0x80));
+    v >>= 7;
+  }
+  data.push_back(static_cast<char>(v));
+}
+
+uint64_t read_varint(const uint8_t*& ptr, const uint8_t* end) {
+  // fast path: if there are at least 8 bytes left, find the terminating byte
+  // of the varint with a single word operation instead of testing each byte
+  if (end - ptr >= 8) {
+    uint64_t w;
+    memcpy(&w, ptr, sizeof(w));
+    uint64_t terminators = ~w & 0x8080808080808080;
+    if (terminators) {
+      size_t num_bytes = (__builtin_ctzll(terminators) >> 3) + 1;
+      uint64_t ret = 0;
+      for (size_t x = 0; x < num_bytes; x++) {
+        ret |= ((w >> (x << 3)) & 0x7F) << (7 * x);
+      }
+      ptr += num_bytes;
+      return ret;
+    }
+  }
+
+  uint64_t ret = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (ptr == end) {
+      throw runtime_error("varint extends beyond end of data");
+    }
+    uint8_t b = *(ptr++);
+    ret |= static_cast<uint64_t>(b & 0x7F) << shift;
+    if (!(b & 0x80)) {
+      return ret;
+    }
+  }
+  throw runtime_error("varint is too long");
+}
+
+
+
+range_encoder::range_encoder() : low(0), range(0xFFFFFFFF), cache(0),
+    cache_size(1) { }
+
+void range_encoder::shift_low() {
+  if ((static_cast<uint32_t>(this->low) < 0xFF000000) || (this->low >> 32)) {
+    uint8_t carry = this->low >> 32;
+    uint8_t temp = this->cache;
+    do {
+      this->output.push_back(static_cast<char>(temp + carry));
+      temp = 0xFF;
+    } while (--this->cache_size);
+    this->cache = (this->low >> 24) & 0xFF;
+  }
+  this->cache_size++;
+  this->low = (this->low & 0x00FFFFFF) << 8;
+}
+
+void range_encoder::encode_bit(uint16_t& prob, bool bit) {
+  uint32_t bound = (this->range >> PROB_BITS) * prob;
+  if (!bit) {
+    this->range = bound;
+    prob += (PROB_ONE - prob) >> PROB_ADAPT_SHIFT;
+  } else {
+    this->low += bound;
+    this->range -= bound;
+    prob -= prob >> PROB_ADAPT_SHIFT;
+  }
+  while (this->range < RANGE_TOP) {
+    this->range <<= 8;
+    this->shift_low();
+  }
+}
+
+void range_encoder::encode_direct_bits(uint64_t value, int num_bits) {
+  for (int bit = num_bits - 1; bit >= 0; bit--) {
+    this->range >>= 1;
+    if ((value >> bit) & 1) {
+      this->low += this->range;
+    }
+    while (this->range < RANGE_TOP) {
+      this->range <<= 8;
+      this->shift_low();
+    }
+  }
+}
+
+const string& range_encoder::finish() {
+  for (size_t x = 0; x < 5; x++) {
+    this->shift_low();
+  }
+  return this->output;
+}
+
+
+
+range_decoder::range_decoder(const void* data, size_t size) :
+    data(reinterpret_cast<const uint8_t*>(data)), size(size), offset(0),
+    range(0xFFFFFFFF), code(0), did_overrun(false) {
+  // the first byte is always zero (it's the encoder's initial cache byte)
+  for (size_t x = 0; x < 5; x++) {
+    this->code = (this->code << 8) | this->next_byte();
+  }
+}
+
+uint8_t range_decoder::next_byte() {
+  if (this->offset >= this->size) {
+    this->did_overrun = true;
+    return 0;
+  }
+  return this->data[this->offset++];
+}
+
+void range_decoder::normalize() {
+  while (this->range < RANGE_TOP) {
+    this->range <<= 8;
+    this->code = (this->code << 8) | this->next_byte();
+  }
+}
+
+bool range_decoder::decode_bit(uint16_t& prob) {
+  uint32_t bound = (this->range >> PROB_BITS) * prob;
+  bool bit;
+  if (this->code < bound) {
+    this->range = bound;
+    prob += (PROB_ONE - prob) >> PROB_ADAPT_SHIFT;
+    bit = false;
+  } else {
+    this->code -= bound;
+    this->range -= bound;
+    prob -= prob >> PROB_ADAPT_SHIFT;
+    bit = true;
+  }
+  this->normalize();
+  return bit;
+}
+
+uint64_t range_decoder::decode_direct_bits(int num_bits) {
+  uint64_t ret = 0;
+  for (int bit = 0; bit < num_bits; bit++) {
+    this->range >>= 1;
+    bool b = (this->code >= this->range);
+    if (b) {
+      this->code -= this->range;
+    }
+    ret = (ret << 1) | b;
+    this->normalize();
+  }
+  return ret;
+}
+
+bool range_decoder::overran() const {
+  return this->did_overrun;
+}
+
+
+
+integer_model::integer_model() {
+  for (size_t x = 0; x < 64; x++) {
+    this->length_probs[x] = PROB_ONE / 2;
+  }
+  for (size_t x = 0; x < MODELED_LENGTH; x++) {
+    for (size_t y = 0; y < MODELED_LENGTH; y++) {
+      this->bit_probs[x][y] = PROB_ONE / 2;
+    }
+  }
+}
+
+void integer_model::encode(range_encoder& enc, uint64_t value) {
+  // code value + 1 so that zero has a leading 1 bit too. this means the
+  // largest value can't be coded, but nothing we store gets anywhere near it
+  if (value == 0xFFFFFFFFFFFFFFFF) {
+    throw invalid_argument("value is too large to encode");
+  }
+  uint64_t v = value + 1;
+  int length = 64 - __builtin_clzll(v);
+
+  for (int x = 0; x < length - 1; x++) {
+    enc.encode_bit(this->length_probs[x], true);
+  }
+  if (length < 64) {
+    enc.encode_bit(this->length_probs[length - 1], false);
+  }
+
+  if (length <= MODELED_LENGTH) {
+    for (int bit = length - 2; bit >= 0; bit--) {
+      enc.encode_bit(this->bit_probs[length - 1][bit], (v >> bit) & 1);
+    }
+  } else {
+    enc.encode_direct_bits(v, length - 1);
+  }
+}
+
+uint64_t integer_model::decode(range_decoder& dec) {
+  int length = 1;
+  while ((length < 64) && dec.decode_bit(this->length_probs[length - 1])) {
+    length++;
+  }
+
+  uint64_t v = 1;
+  if (length <= MODELED_LENGTH) {
+    for (int bit = length - 2; bit >= 0; bit--) {
+      v = (v << 1) | dec.decode_bit(this->bit_probs[length - 1][bit]);
+    }
+  } else {
+    v = (v << (length - 1)) | dec.decode_direct_bits(length - 1);
+  }
+  return v - 1;
+}
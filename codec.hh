@@ -0,0 +1,126 @@
+#ifndef __CODEC_H
+#define __CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+
+// 64-bit FNV-1a. used for checksums and content hashes in files, so it must
+// never change
+uint64_t fnv1a64(const void* data, size_t size,
+    uint64_t hash = 0xCBF29CE484222325);
+
+inline uint64_t zigzag_encode(int64_t v) {
+  return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t v) {
+  return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+// LEB128-style variable-length integers
+void append_varint(std::string& data, uint64_t v);
+// throws runtime_error if the varint runs past end
+uint64_t read_varint(const uint8_t*& ptr, const uint8_t* end);
+
+
+
+// adaptive binary range coder (the same construction LZMA uses). each bit is
+// coded against an 11-bit probability that adapts as bits are coded with it,
+// so the models below learn the statistics of the data as they go and no
+// tables need to be stored in the output.
+
+class range_encoder {
+public:
+  range_encoder();
+  ~range_encoder() = default;
+
+  void encode_bit(uint16_t& prob, bool bit);
+  void encode_direct_bits(uint64_t value, int num_bits);
+
+  // flushes the coder state and returns the encoded data. the encoder can't be
+  // used again after this
+  const std::string& finish();
+
+private:
+  void shift_low();
+
+  std::string output;
+  uint64_t low;
+  uint32_t range;
+  uint8_t cache;
+  uint64_t cache_size;
+};
+
+class range_decoder {
+public:
+  range_decoder(const void* data, size_t size);
+  ~range_decoder() = default;
+
+  bool decode_bit(uint16_t& prob);
+  uint64_t decode_direct_bits(int num_bits);
+
+  // true if the decoder has tried to read past the end of its input, which
+  // means the input was truncated or corrupt
+  bool overran() const;
+
+private:
+  uint8_t next_byte();
+  void normalize();
+
+  const uint8_t* data;
+  size_t size;
+  size_t offset;
+  uint32_t range;
+  uint32_t code;
+  bool did_overrun;
+};
+
+// codes values in [0, 2^num_bits) as a binary tree of adaptive bits
+template <int NumBits>
+struct bit_tree_model {
+  uint16_t probs[1 << NumBits];
+
+  bit_tree_model() {
+    for (size_t x = 0; x < (1 << NumBits); x++) {
+      this->probs[x] = 1024;
+    }
+  }
+
+  void encode(range_encoder& enc, uint32_t value) {
+    uint32_t index = 1;
+    for (int bit = NumBits - 1; bit >= 0; bit--) {
+      bool b = (value >> bit) & 1;
+      enc.encode_bit(this->probs[index], b);
+      index = (index << 1) | b;
+    }
+  }
+
+  uint32_t decode(range_decoder& dec) {
+    uint32_t index = 1;
+    for (int bit = 0; bit < NumBits; bit++) {
+      index = (index << 1) | dec.decode_bit(this->probs[index]);
+    }
+    return index - (1 << NumBits);
+  }
+};
+
+// codes arbitrary unsigned integers as an adaptive Elias gamma code: the bit
+// length is coded in unary with one adaptive bit per position, then the bits
+// below the leading 1 are coded adaptively for short values and directly for
+// long ones. small values cost very few bits once the model has warmed up.
+struct integer_model {
+  static const int MODELED_LENGTH = 16;
+
+  uint16_t length_probs[64];
+  uint16_t bit_probs[MODELED_LENGTH][MODELED_LENGTH];
+
+  integer_model();
+
+  void encode(range_encoder& enc, uint64_t value);
+  uint64_t decode(range_decoder& dec);
+};
+
+#endif // __CODEC_H
@@ -0,0 +1,235 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <stdexcept>
+#include <string>
+#include <phosg/Filesystem.hh>
+#include <phosg/Time.hh>
+
+#include "file_io.hh"
+
+using namespace std;
+
+
+
+mapped_file::mapped_file(const string& filename) : fd(-1), map_data(NULL),
+    map_size(0) {
+  this->fd = open(filename.c_str(), O_RDONLY);
+  if (this->fd < 0) {
+    throw cannot_open_file(filename);
+  }
+
+  try {
+    this->map_size = fstat(this->fd).st_size;
+  } catch (...) {
+    close(this->fd);
+    throw;
+  }
+
+  // mmap refuses zero-length mappings, but an empty file is still a valid
+  // (if useless) thing to open
+  if (this->map_size) {
+    this->map_data = mmap(NULL, this->map_size, PROT_READ, MAP_PRIVATE,
+        this->fd, 0);
+    if (this->map_data == MAP_FAILED) {
+      close(this->fd);
+      throw runtime_error("can\'t map file " + filename);
+    }
+  }
+}
+
+mapped_file::~mapped_file() {
+  if (this->map_data) {
+    munmap(this->map_data, this->map_size);
+  }
+  close(this->fd);
+}
+
+const uint8_t* mapped_file::data() const {
+  return reinterpret_cast<const uint8_t*>(this->map_data);
+}
+
+size_t mapped_file::size() const {
+  return this->map_size;
+}
+
+
+
+mapped_reader::mapped_reader(const void* data, size_t size) :
+    data(reinterpret_cast<const uint8_t*>(data)), size(size), offset(0) { }
+
+void mapped_reader::skip(size_t size) {
+  if (size > this->size - this->offset) {
+    throw runtime_error("unexpected end of data");
+  }
+  this->offset += size;
+}
+
+void mapped_reader::go(size_t offset) {
+  if (offset > this->size) {
+    throw runtime_error("offset is beyond end of data");
+  }
+  this->offset = offset;
+}
+
+size_t mapped_reader::where() const {
+  return this->offset;
+}
+
+size_t mapped_reader::remaining() const {
+  return this->size - this->offset;
+}
+
+
+
+fd_guard::fd_guard(int fd) : fd(fd) { }
+
+fd_guard::~fd_guard() {
+  if (this->fd >= 0) {
+    close(this->fd);
+  }
+}
+
+int fd_guard::get() const {
+  return this->fd;
+}
+
+
+
+void pread_all(int fd, void* data, size_t size, off_t offset) {
+  uint8_t* ptr = reinterpret_cast<uint8_t*>(data);
+  while (size) {
+    ssize_t bytes_read = pread(fd, ptr, size, offset);
+    if (bytes_read <= 0) {
+      throw runtime_error("can\'t read from file");
+    }
+    ptr += bytes_read;
+    size -= bytes_read;
+    offset += bytes_read;
+  }
+}
+
+void pwrite_all(int fd, const void* data, size_t size, off_t offset) {
+  const uint8_t* ptr = reinterpret_cast<const uint8_t*>(data);
+  while (size) {
+    ssize_t bytes_written = pwrite(fd, ptr, size, offset);
+    if (bytes_written <= 0) {
+      throw runtime_error("can\'t write to file");
+    }
+    ptr += bytes_written;
+    size -= bytes_written;
+    offset += bytes_written;
+  }
+}
+
+
+
+void save_file_atomic(const string& filename, const string& data) {
+  string temp_filename = filename + ".tmp";
+  {
+    auto f = fopen_unique(temp_filename.c_str(), "wb");
+    fwritex(f.get(), data.data(), data.size());
+    fflush(f.get());
+    fsync(fileno(f.get()));
+  }
+  if (rename(temp_filename.c_str(), filename.c_str())) {
+    unlink(temp_filename.c_str());
+    throw runtime_error("can\'t rename " + temp_filename + " to " + filename);
+  }
+}
+
+
+
+// without inotify, the file is checked at most this often
+static const uint64_t FILE_WATCHER_POLL_INTERVAL_USECS = 500000;
+
+file_watcher::file_watcher(const string& filename) : filename(filename),
+    fd(-1), next_check_time(0), last_dev(0), last_ino(0), last_size(0),
+    last_mtime(0) {
+  size_t slash_pos = filename.rfind('/');
+  string directory = (slash_pos == string::npos) ? "." :
+      filename.substr(0, slash_pos + 1);
+  this->basename = (slash_pos == string::npos) ? filename :
+      filename.substr(slash_pos + 1);
+
+#ifdef __linux__
+  this->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if ((this->fd >= 0) && (inotify_add_watch(this->fd, directory.c_str(),
+      IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)) {
+    close(this->fd);
+    this->fd = -1;
+  }
+#endif
+
+  // remember the file's current state, so the first poll only reports changes
+  // made after the watcher was created
+  this->poll_stat();
+}
+
+file_watcher::~file_watcher() {
+  if (this->fd >= 0) {
+    close(this->fd);
+  }
+}
+
+bool file_watcher::poll() {
+#ifdef __linux__
+  if (this->fd >= 0) {
+    bool changed = false;
+    char buffer[0x1000] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t bytes_read;
+    while ((bytes_read = read(this->fd, buffer, sizeof(buffer))) > 0) {
+      for (ssize_t offset = 0; offset < bytes_read;) {
+        const auto* event = reinterpret_cast<const struct inotify_event*>(
+            buffer + offset);
+        offset += sizeof(struct inotify_event) + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+          changed = true;
+        } else if (event->mask & IN_IGNORED) {
+          // the directory itself went away; we can still poll the file
+          close(this->fd);
+          this->fd = -1;
+          return true;
+        } else if (event->len && (this->basename == event->name)) {
+          changed = true;
+        }
+      }
+    }
+    return changed;
+  }
+#endif
+
+  uint64_t now_time = now();
+  if (now_time < this->next_check_time) {
+    return false;
+  }
+  this->next_check_time = now_time + FILE_WATCHER_POLL_INTERVAL_USECS;
+  return this->poll_stat();
+}
+
+bool file_watcher::poll_stat() {
+  struct stat st;
+  if (::stat(this->filename.c_str(), &st)) {
+    // the file is missing, probably in the middle of being replaced; report
+    // the change when it reappears
+    this->last_dev = 0;
+    this->last_ino = 0;
+    return false;
+  }
+
+  bool changed = (st.st_dev != this->last_dev) || (st.st_ino != this->last_ino) ||
+      (st.st_size != this->last_size) || (st.st_mtime != this->last_mtime);
+  this->last_dev = st.st_dev;
+  this->last_ino = st.st_ino;
+  this->last_size = st.st_size;
+  this->last_mtime = st.st_mtime;
+  return changed;
+}
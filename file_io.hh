@@ -0,0 +1,113 @@
+#ifndef __FILE_IO_H
+#define __FILE_IO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <stdexcept>
+#include <string>
+
+
+// read-only memory mapping of an entire file. throws cannot_open_file if the
+// file can't be opened, or runtime_error if it can't be mapped.
+class mapped_file {
+public:
+  explicit mapped_file(const std::string& filename);
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+  ~mapped_file();
+
+  const uint8_t* data() const;
+  size_t size() const;
+
+private:
+  int fd;
+  void* map_data;
+  size_t map_size;
+};
+
+// bounds-checked cursor over a block of memory (usually a mapped_file). all
+// reads return pointers into the underlying memory, so nothing is copied
+// until the caller decides to convert it.
+class mapped_reader {
+public:
+  mapped_reader(const void* data, size_t size);
+  ~mapped_reader() = default;
+
+  template <typename T>
+  const T* get(size_t count = 1) {
+    // count comes from the data, so check it before multiplying
+    if (count > this->remaining() / sizeof(T)) {
+      throw std::runtime_error("unexpected end of data");
+    }
+    const T* ret = reinterpret_cast<const T*>(this->data + this->offset);
+    this->skip(count * sizeof(T));
+    return ret;
+  }
+
+  void skip(size_t size);
+  void go(size_t offset);
+  size_t where() const;
+  size_t remaining() const;
+
+private:
+  const uint8_t* data;
+  size_t size;
+  size_t offset;
+};
+
+// owns a file descriptor and closes it when destroyed
+class fd_guard {
+public:
+  explicit fd_guard(int fd);
+  fd_guard(const fd_guard&) = delete;
+  fd_guard& operator=(const fd_guard&) = delete;
+  ~fd_guard();
+
+  int get() const;
+
+private:
+  int fd;
+};
+
+// positioned reads and writes that throw runtime_error unless they transfer
+// exactly the requested number of bytes
+void pread_all(int fd, void* data, size_t size, off_t offset);
+void pwrite_all(int fd, const void* data, size_t size, off_t offset);
+
+// writes the file's contents to a temporary file in the same directory, syncs
+// it, then renames it over the destination, so readers (and crashes) only ever
+// see the old contents or the new contents, never a partial write
+void save_file_atomic(const std::string& filename, const std::string& data);
+
+// notices when a file is replaced or rewritten by another program. on Linux this
+// uses inotify on the file's directory (since atomic saves replace the file, the
+// file itself can't be watched); elsewhere it periodically compares the file's
+// identity, size and modification time. changes made by this process are
+// reported too.
+class file_watcher {
+public:
+  explicit file_watcher(const std::string& filename);
+  file_watcher(const file_watcher&) = delete;
+  file_watcher& operator=(const file_watcher&) = delete;
+  ~file_watcher();
+
+  // returns true if the file may have changed since the last call. never
+  // blocks, so it can be called every frame
+  bool poll();
+
+private:
+  std::string filename;
+  std::string basename;
+  int fd; // inotify instance, or -1 if polling
+  uint64_t next_check_time;
+  dev_t last_dev;
+  ino_t last_ino;
+  off_t last_size;
+  time_t last_mtime;
+
+  bool poll_stat();
+};
+
+#endif // __FILE_IO_H
@@ -0,0 +1,123 @@
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "hint.hh"
+#include "level.hh"
+#include "parallel.hh"
+#include "solver.hh"
+
+using namespace std;
+
+
+hint_engine::hint_engine(uint64_t time_limit_usecs, uint64_t max_frames) :
+    time_limit_usecs(time_limit_usecs), max_frames(max_frames), generation(0),
+    search_running(false), should_exit(false), cancel_search(false) { }
+
+hint_engine::~hint_engine() {
+  {
+    lock_guard<mutex> g(this->lock);
+    this->should_exit = true;
+    this->cancel_search = true;
+  }
+  this->request_available.notify_one();
+  if (this->worker.joinable()) {
+    this->worker.join();
+  }
+}
+
+uint64_t hint_engine::request(const level_state& l) {
+  unique_ptr<level_state> state(new level_state(l.fork()));
+  uint64_t ret;
+  {
+    lock_guard<mutex> g(this->lock);
+    this->pending_state = move(state);
+    this->result.reset();
+    this->cancel_search = true;
+    ret = ++this->generation;
+    // started here rather than in the constructor, so an engine can be a
+    // global without starting a thread during static initialization
+    if (!this->worker.joinable()) {
+      this->worker = thread(&hint_engine::thread_routine, this);
+    }
+  }
+  this->request_available.notify_one();
+  return ret;
+}
+
+void hint_engine::cancel() {
+  lock_guard<mutex> g(this->lock);
+  this->pending_state.reset();
+  this->result.reset();
+  this->cancel_search = true;
+  this->generation++;
+}
+
+shared_ptr<const hint> hint_engine::current() const {
+  lock_guard<mutex> g(this->lock);
+  return this->result;
+}
+
+bool hint_engine::searching() const {
+  lock_guard<mutex> g(this->lock);
+  return this->search_running || this->pending_state.get();
+}
+
+void hint_engine::thread_routine() {
+  // leave a core for the frame loop. the pool's threads are kept between
+  // searches, since a new one starts whenever the player moves
+  size_t num_threads = default_thread_count();
+  thread_pool pool((num_threads > 1) ? (num_threads - 1) : 1);
+
+  for (;;) {
+    unique_ptr<level_state> start;
+    uint64_t request_generation;
+    {
+      unique_lock<mutex> g(this->lock);
+      while (!this->should_exit && !this->pending_state.get()) {
+        this->request_available.wait(g);
+      }
+      if (this->should_exit) {
+        return;
+      }
+      start = move(this->pending_state);
+      request_generation = this->generation;
+      // a request that comes in after this point cancels this search
+      this->cancel_search = false;
+      this->search_running = true;
+    }
+
+    solver_options options;
+    options.goal = solver_goal::Progress;
+    options.pool = &pool;
+    options.max_frames = this->max_frames;
+    options.time_limit_usecs = this->time_limit_usecs;
+    options.table_size = 4 * 1024 * 1024;
+    options.cancel = &this->cancel_search;
+    solver_result res = solve_level(*start, options);
+
+    shared_ptr<hint> h;
+    if (res.solved) {
+      h.reset(new hint());
+      h->generation = request_generation;
+      h->start_frame = start->frames_executed;
+      h->actions = move(res.solution);
+      level_state& l = *start;
+      for (auto it = h->actions.begin(); it != h->actions.end(); it++) {
+        l.exec_frame(*it);
+        h->player_positions.emplace_back(l.player_x, l.player_y);
+      }
+      h->wins = l.player_did_win;
+    }
+
+    lock_guard<mutex> g(this->lock);
+    this->search_running = false;
+    if (request_generation == this->generation) {
+      this->result = h;
+    }
+  }
+}
@@ -0,0 +1,77 @@
+#ifndef __HINT_H
+#define __HINT_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "action_buffer.hh"
+#include "level.hh"
+
+
+struct hint {
+  uint64_t generation; // which request this answers; see hint_engine
+  uint64_t start_frame; // frames_executed of the state it starts from
+
+  action_buffer actions;
+  // where the player is after each of the actions
+  std::vector<std::pair<int32_t, int32_t>> player_positions;
+  bool wins; // false if the hint ends by collecting an item
+};
+
+// looks for the next bit of progress (an item collected or the exit reached,
+// without dying) on background threads, for showing to a stuck player.
+//
+// the frame loop only ever does constant-time work here: request() forks the
+// state (without its undo log) and wakes the worker, and current() takes a
+// reference to the last result. searches run with solve_level on all but one
+// core (so the frame loop keeps one to itself), stop after a fixed amount of
+// time, and are cancelled as soon as a newer request comes in. the worker never
+// sees the game's own level_state.
+class hint_engine {
+public:
+  hint_engine(uint64_t time_limit_usecs = 2000000, uint64_t max_frames = 300);
+  hint_engine(const hint_engine&) = delete;
+  hint_engine& operator=(const hint_engine&) = delete;
+  // cancels any search in progress
+  ~hint_engine();
+
+  // starts looking for a hint from this state, abandoning the previous search
+  // and hint. returns the request's generation
+  uint64_t request(const level_state& l);
+  // abandons the current search and hint
+  void cancel();
+
+  // the hint for the latest request, or NULL if the search for it hasn't
+  // finished or didn't find anything
+  std::shared_ptr<const hint> current() const;
+  bool searching() const;
+
+private:
+  void thread_routine();
+
+  uint64_t time_limit_usecs;
+  uint64_t max_frames;
+
+  mutable std::mutex lock;
+  std::condition_variable request_available;
+  std::unique_ptr<level_state> pending_state; // guarded by lock
+  uint64_t generation; // guarded by lock
+  std::shared_ptr<const hint> result; // guarded by lock
+  bool search_running; // guarded by lock
+  bool should_exit; // guarded by lock
+
+  // set to abandon the search in progress. the worker clears it when it starts
+  // the next one
+  std::atomic<bool> cancel_search;
+
+  std::thread worker; // started by the first request()
+};
+
+#endif // __HINT_H
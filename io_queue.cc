@@ -0,0 +1,111 @@
+#include <stdio.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "file_io.hh"
+#include "io_queue.hh"
+
+using namespace std;
+
+
+io_queue::io_queue() : job_running(false), should_exit(false),
+    worker(&io_queue::thread_routine, this) { }
+
+io_queue::~io_queue() {
+  {
+    lock_guard<mutex> g(this->lock);
+    this->should_exit = true;
+  }
+  this->job_available.notify_all();
+  this->worker.join();
+}
+
+void io_queue::enqueue(const string& key, function<void()> job,
+    function<void()> completion) {
+  {
+    lock_guard<mutex> g(this->lock);
+    if (!key.empty()) {
+      for (auto it = this->jobs.begin(); it != this->jobs.end(); it++) {
+        if (it->key == key) {
+          this->jobs.erase(it);
+          break;
+        }
+      }
+    }
+    this->jobs.push_back({key, move(job), move(completion)});
+  }
+  this->job_available.notify_one();
+}
+
+void io_queue::write_file(const string& filename, string&& data) {
+  // std::function must be copyable, so the data can't be moved into the
+  // lambda directly
+  auto shared_data = make_shared<string>(move(data));
+  this->enqueue(filename, [filename, shared_data]() {
+    save_file_atomic(filename, *shared_data);
+  });
+}
+
+size_t io_queue::poll() {
+  vector<function<void()>> to_run;
+  {
+    lock_guard<mutex> g(this->lock);
+    to_run.swap(this->completions);
+  }
+  for (const auto& completion : to_run) {
+    completion();
+  }
+  return to_run.size();
+}
+
+void io_queue::flush() {
+  unique_lock<mutex> g(this->lock);
+  this->jobs_finished.wait(g, [this]() {
+    return this->jobs.empty() && !this->job_running;
+  });
+}
+
+void io_queue::thread_routine() {
+  unique_lock<mutex> g(this->lock);
+  for (;;) {
+    this->job_available.wait(g, [this]() {
+      return this->should_exit || !this->jobs.empty();
+    });
+    if (this->jobs.empty()) {
+      return; // should_exit is set and there's nothing left to do
+    }
+
+    job_entry e = move(this->jobs.front());
+    this->jobs.pop_front();
+    this->job_running = true;
+    g.unlock();
+
+    try {
+      e.job();
+    } catch (const exception& ex) {
+      if (e.key.empty()) {
+        fprintf(stderr, "background I/O failed: %s\n", ex.what());
+      } else {
+        fprintf(stderr, "background I/O failed (%s): %s\n", e.key.c_str(),
+            ex.what());
+      }
+    }
+
+    g.lock();
+    if (e.completion) {
+      this->completions.emplace_back(move(e.completion));
+    }
+    this->job_running = false;
+    if (this->jobs.empty()) {
+      this->jobs_finished.notify_all();
+    }
+  }
+}
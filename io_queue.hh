@@ -0,0 +1,68 @@
+#ifndef __IO_QUEUE_H
+#define __IO_QUEUE_H
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// runs file operations on a single background thread, so the frame loop never
+// waits for the filesystem. jobs run one at a time in the order they were
+// enqueued. a job may have a completion, which runs on the thread that calls
+// poll() (the main thread) after the job finishes; this is how loaded data
+// gets back to the game.
+//
+// jobs that are enqueued with the same nonempty key are coalesced: if a job is
+// still waiting to run when another with its key is enqueued, the old one is
+// dropped and the new one goes to the back of the queue. a job's key must
+// therefore describe everything it writes, so that the newer job makes the
+// older one unnecessary.
+class io_queue {
+public:
+  io_queue();
+  io_queue(const io_queue&) = delete;
+  io_queue& operator=(const io_queue&) = delete;
+  // runs all pending jobs before returning
+  ~io_queue();
+
+  // exceptions thrown by job are caught and reported on stderr; jobs that need
+  // to report errors to their completion should catch them themselves
+  void enqueue(const std::string& key, std::function<void()> job,
+      std::function<void()> completion = std::function<void()>());
+
+  // writes the data to the file with save_file_atomic. coalesced by filename
+  void write_file(const std::string& filename, std::string&& data);
+
+  // runs the completions of all finished jobs on the calling thread. returns
+  // the number of completions that were run
+  size_t poll();
+
+  // blocks until every job enqueued so far has run. doesn't run completions
+  void flush();
+
+private:
+  struct job_entry {
+    std::string key;
+    std::function<void()> job;
+    std::function<void()> completion;
+  };
+
+  void thread_routine();
+
+  std::mutex lock;
+  std::condition_variable job_available;
+  std::condition_variable jobs_finished;
+  std::deque<job_entry> jobs;
+  std::vector<std::function<void()>> completions;
+  bool job_running;
+  bool should_exit;
+  std::thread worker;
+};
+
+#endif // __IO_QUEUE_H
@@ -6,18 +6,22 @@
 
 #include <GLFW/glfw3.h>
 
+#include <algorithm>
 #include <list>
-#include <phosg/Filesystem.hh>
 #include <stdexcept>
 #include <vector>
 
+#include "activity.hh"
+#include "codec.hh"
 #include "level.hh"
 
 using namespace std;
 
 
 
-static const vector<pair<int32_t, int32_t>> offset_for_impulse({
+const vector<player_impulse> movement_impulses({Up, Down, Left, Right});
+
+const vector<pair<int32_t, int32_t>> offset_for_impulse({
     {0, 0}, {0, -1}, {0, 1}, {-1, 0}, {1, 0}});
 
 static const vector<player_impulse> left_turn_for_direction({
@@ -26,11 +30,26 @@ static const vector<player_impulse> left_turn_for_direction({
 static const vector<player_impulse> right_turn_for_direction({
     None, Right, Left, Up, Down});
 
-static const vector<player_impulse> opposite_direction_for_direction({
+const vector<player_impulse> opposite_direction_for_direction({
     None, Down, Up, Right, Left});
 
 
 
+const char* name_for_cell_type(cell_type type) {
+  static const char* names[] = {"Empty", "Circuit", "Rock", "Exit", "Player",
+      "Item", "Block", "RoundBlock", "BlueBomb", "GreenBomb", "YellowBomb",
+      "YellowBombTrigger", "RedBomb", "Explosion", "ItemDude", "BombDude",
+      "LeftPortal", "RightPortal", "UpPortal", "DownPortal", "HorizontalPortal",
+      "VerticalPortal", "Portal", "GrayBomb", "RockGenerator", "Destroyer",
+      "Deleter", "LeftJumpPortal", "RightJumpPortal", "UpJumpPortal",
+      "DownJumpPortal", "HorizontalJumpPortal", "VerticalJumpPortal",
+      "JumpPortal", "PullStone", "WhiteBomb"};
+  if ((type < 0) || (type > WhiteBomb)) {
+    return "Unknown";
+  }
+  return names[type];
+}
+
 cell_state::cell_state() : type(Empty), param(1), moved(false) { }
 
 cell_state::cell_state(cell_type type, int32_t param, bool moved) : type(type),
@@ -129,6 +148,11 @@ bool cell_state::is_portal(player_impulse dir) const {
   }
 }
 
+bool cell_state::is_any_portal() const {
+  return this->is_portal(Left) || this->is_portal(Right) ||
+         this->is_portal(Up) || this->is_portal(Down);
+}
+
 bool cell_state::is_jump_portal() const {
   return (this->type == LeftJumpPortal) || (this->type == RightJumpPortal) ||
          (this->type == UpJumpPortal) || (this->type == DownJumpPortal) ||
@@ -136,19 +160,6 @@ bool cell_state::is_jump_portal() const {
          (this->type == JumpPortal);
 }
 
-void cell_state::read(FILE* f) {
-  freadx(f, &this->type, sizeof(this->type));
-  freadx(f, &this->param, sizeof(this->param));
-  // note: we don't read `moved` since it's only transient data
-  this->moved = false;
-}
-
-void cell_state::write(FILE* f) const {
-  fwritex(f, &this->type, sizeof(this->type));
-  fwritex(f, &this->param, sizeof(this->param));
-  // note: we don't write `moved` since it's only transient data
-}
-
 
 
 explosion_info::explosion_info(uint64_t frame, int32_t x, int32_t y,
@@ -163,14 +174,6 @@ bool explosion_info::operator==(const explosion_info& other) const {
          (this->type == other.type);
 }
 
-void explosion_info::read(FILE* f) {
-  freadx(f, this, sizeof(*this));
-}
-
-void explosion_info::write(FILE* f) const {
-  fwritex(f, this, sizeof(*this));
-}
-
 
 
 level_state::undo_log_entry::undo_log_entry(entry_type type) : type(type) { }
@@ -192,7 +195,8 @@ level_state::level_state(uint32_t w, uint32_t h, int32_t player_x,
     num_items_remaining(0), num_red_bombs(0), frames_executed(0),
     rewind_count(0), player_lose_frame(0), player_lose_buffer(1), cells(w * h),
     updates_per_second(20.0f), player_will_drop_bomb(false),
-    player_did_win(false) {
+    player_did_win(false), undo_log_enabled(true), unwinnable(false),
+    unwinnable_frame(0), activity(NULL) {
 
   for (int32_t x = 0; x < this->w; x++) {
     this->at(x, 0) = cell_state(Block);
@@ -208,52 +212,69 @@ level_state::level_state(uint32_t w, uint32_t h, int32_t player_x,
 
   // frame marker for frame 0
   this->undo_log.emplace_back(0);
-}
 
-void level_state::read(FILE* f) {
-  freadx(f, &this->w, sizeof(this->w));
-  freadx(f, &this->h, sizeof(this->h));
-  freadx(f, &this->player_x, sizeof(this->player_x));
-  freadx(f, &this->player_y, sizeof(this->player_y));
-  freadx(f, &this->num_items_remaining, sizeof(this->num_items_remaining));
-  freadx(f, &this->num_red_bombs, sizeof(this->num_red_bombs));
-  freadx(f, &this->frames_executed, sizeof(this->frames_executed));
-
-  this->cells.resize(this->w * this->h);
-  for (uint64_t x = 0; x < this->w * this->h; x++) {
-    this->cells[x].read(f);
-  }
+  this->recompute_winnability();
+}
 
-  uint64_t num_explosions;
-  freadx(f, &num_explosions, sizeof(num_explosions));
-  this->pending_explosions.clear();
-  for (uint64_t x = 0; x < num_explosions; x++) {
-    this->pending_explosions.emplace_back(0, 0, 0);
-    this->pending_explosions.back().read(f);
-  }
+level_state::level_state(const level_template& t) : undo_log_enabled(true),
+    unwinnable(false), unwinnable_frame(0), activity(NULL) {
+  this->reset(t);
 }
 
-void level_state::write(FILE* f) const {
-  fwritex(f, &this->w, sizeof(this->w));
-  fwritex(f, &this->h, sizeof(this->h));
-  fwritex(f, &this->player_x, sizeof(this->player_x));
-  fwritex(f, &this->player_y, sizeof(this->player_y));
-  fwritex(f, &this->num_items_remaining, sizeof(this->num_items_remaining));
-  fwritex(f, &this->num_red_bombs, sizeof(this->num_red_bombs));
-  fwritex(f, &this->frames_executed, sizeof(this->frames_executed));
+level_state level_state::fork() const {
+  level_state ret(0, 0, -1, -1);
+  ret.w = this->w;
+  ret.h = this->h;
+  ret.player_x = this->player_x;
+  ret.player_y = this->player_y;
+  ret.num_items_remaining = this->num_items_remaining;
+  ret.num_red_bombs = this->num_red_bombs;
+  ret.frames_executed = this->frames_executed;
+  ret.rewind_count = this->rewind_count;
+  ret.player_lose_frame = this->player_lose_frame;
+  ret.player_lose_buffer = this->player_lose_buffer;
+  ret.cells = this->cells;
+  ret.pending_explosions = this->pending_explosions;
+  ret.updates_per_second = this->updates_per_second;
+  ret.player_will_drop_bomb = this->player_will_drop_bomb;
+  ret.player_did_win = this->player_did_win;
+  ret.unwinnable = this->unwinnable;
+  ret.unwinnable_frame = this->unwinnable_frame;
+  ret.winnability = this->winnability;
+  ret.changed_cells = this->changed_cells;
+  ret.set_undo_log_enabled(false);
+  return ret;
+}
 
-  for (uint64_t x = 0; x < this->w * this->h; x++) {
-    this->cells[x].write(f);
-  }
+void level_state::reset(const level_template& t) {
+  this->w = t.w;
+  this->h = t.h;
+  this->player_x = t.player_x;
+  this->player_y = t.player_y;
+  this->num_items_remaining = t.num_items_remaining;
+  this->num_red_bombs = t.num_red_bombs;
+  this->frames_executed = t.frames_executed;
+  this->rewind_count = 0;
+  this->player_lose_frame = 0;
+  this->player_lose_buffer = 1;
+  this->cells.assign(t.cells.begin(), t.cells.end());
+  this->pending_explosions.assign(t.pending_explosions.begin(),
+      t.pending_explosions.end());
+  this->updates_per_second = 20.0f;
+  this->player_will_drop_bomb = false;
+  this->player_did_win = false;
+
+  this->undo_log.clear();
+  this->undo_log.emplace_back(0);
 
-  uint64_t num_explosions = this->pending_explosions.size();
-  fwritex(f, &num_explosions, sizeof(num_explosions));
-  for (const explosion_info& e : this->pending_explosions) {
-    e.write(f);
-  }
+  this->recompute_winnability();
 }
 
 cell_state& level_state::at(int32_t x, int32_t y) {
+  // most lookups are in range, so skip the wrapping for them
+  if ((static_cast<uint32_t>(x) < this->w) && (static_cast<uint32_t>(y) < this->h)) {
+    return this->cells[y * this->w + x];
+  }
   while (x < 0) {
     x += this->w;
   }
@@ -268,6 +289,10 @@ cell_state& level_state::at(const pair<int32_t, int32_t>& pos) {
 }
 
 const cell_state& level_state::at(int32_t x, int32_t y) const {
+  // most lookups are in range, so skip the wrapping for them
+  if ((static_cast<uint32_t>(x) < this->w) && (static_cast<uint32_t>(y) < this->h)) {
+    return this->cells[y * this->w + x];
+  }
   while (x < 0) {
     x += this->w;
   }
@@ -281,7 +306,20 @@ const cell_state& level_state::at(const pair<int32_t, int32_t>& pos) const {
   return this->at(pos.first, pos.second);
 }
 
+// counts an event in a cell if this state is collecting activity counters
+static inline void count_activity(level_state& l, activity_plane plane,
+    int32_t x, int32_t y) {
+  if (l.activity) {
+    l.activity->planes[plane][&l.at(x, y) - l.cells.data()]++;
+  }
+}
+
 void level_state::write_cell_to_undo_log(int32_t x, int32_t y) {
+  this->record_cell_change(x, y);
+  count_activity(*this, CellWrites, x, y);
+  if (!this->undo_log_enabled) {
+    return;
+  }
   this->undo_log.emplace_back(x, y, this->at(x, y));
   this->undo_log.back().cell.old_state.moved = false;
 }
@@ -290,11 +328,23 @@ void level_state::write_cell_to_undo_log(const pair<int32_t, int32_t>& pos) {
   this->write_cell_to_undo_log(pos.first, pos.second);
 }
 
+void level_state::record_cell_change(int32_t x, int32_t y) {
+  winnability_tracker& wt = this->winnability;
+  const cell_state& c = this->at(x, y);
+  uint32_t index = &c - this->cells.data();
+  if (wt.cell_stamps[index] != wt.stamp) {
+    wt.cell_stamps[index] = wt.stamp;
+    wt.changed_cells.emplace_back(index, c.type);
+  }
+}
+
 void level_state::create_explosion(uint64_t frame, int32_t x, int32_t y,
     int32_t size, explosion_type type) {
   this->pending_explosions.emplace_back(frame, x, y, size, type);
-  this->undo_log.emplace_back(undo_log_entry::entry_type::CreateExplosion,
-                this->pending_explosions.back());
+  if (this->undo_log_enabled) {
+    this->undo_log.emplace_back(undo_log_entry::entry_type::CreateExplosion,
+                  this->pending_explosions.back());
+  }
 }
 
 bool level_state::player_is_alive() const {
@@ -411,7 +461,7 @@ uint64_t level_state::exec_frame(const struct player_actions& actions) {
       }
       if (this->at(x, y).type == Deleter &&
           this->at(x, y - 1).type != Empty && this->at(x, y - 1).type != Explosion) {
-        this->write_cell_to_undo_log(x, y);
+        this->write_cell_to_undo_log(x, y - 1);
         this->at(x, y - 1) = cell_state(Empty);
       }
 
@@ -446,6 +496,7 @@ uint64_t level_state::exec_frame(const struct player_actions& actions) {
           this->write_cell_to_undo_log(x, y);
           this->at(x, y + 1) = cell_state(this->at(x, y).type, Falling, true);
           this->at(x, y) = cell_state(Empty);
+          count_activity(*this, ObjectFalls, x, y + 1);
 
         // if the faller landed on a bomb, the bomb explodes immediately
         } else if (this->at(x, y + 1).is_volatile() && (this->at(x, y).param == Falling)) {
@@ -543,6 +594,7 @@ uint64_t level_state::exec_frame(const struct player_actions& actions) {
 
       for (int32_t yy = -it->size; yy <= it->size; yy++) {
         for (int32_t xx = -it->size; xx <= it->size; xx++) {
+          count_activity(*this, ExplosionCoverage, it->x + xx, it->y + yy);
           if (this->at(it->x + xx, it->y + yy).destroyable()) {
             if ((xx || yy) && this->at(it->x + xx, it->y + yy).is_volatile()) {
               explosion_type new_type = this->at(it->x + xx, it->y + yy).get_explosion_type();
@@ -565,8 +617,10 @@ uint64_t level_state::exec_frame(const struct player_actions& actions) {
           }
         }
       }
-      this->undo_log.emplace_back(undo_log_entry::entry_type::ExecuteExplosion,
-          *it);
+      if (this->undo_log_enabled) {
+        this->undo_log.emplace_back(undo_log_entry::entry_type::ExecuteExplosion,
+            *it);
+      }
       it = this->pending_explosions.erase(it);
     } else {
       it++;
@@ -589,12 +643,16 @@ uint64_t level_state::exec_frame(const struct player_actions& actions) {
       if (player_target_cell->type == Item) {
         events_occurred |= ItemCollected;
         this->num_items_remaining--;
-        this->undo_log.emplace_back(undo_log_entry::entry_type::GetItem);
+        if (this->undo_log_enabled) {
+          this->undo_log.emplace_back(undo_log_entry::entry_type::GetItem);
+        }
       }
       if (player_target_cell->type == RedBomb) {
         events_occurred |= RedBombCollected;
         this->num_red_bombs++;
-        this->undo_log.emplace_back(undo_log_entry::entry_type::GetRedBomb);
+        if (this->undo_log_enabled) {
+          this->undo_log.emplace_back(undo_log_entry::entry_type::GetRedBomb);
+        }
       }
       if ((player_target_cell->type == Exit) && (this->num_red_bombs >= 0) &&
           (this->num_items_remaining <= 0)) {
@@ -603,30 +661,11 @@ uint64_t level_state::exec_frame(const struct player_actions& actions) {
       }
 
       // if the player is moving into a portal, put them on the other side of it
-      // for jump portals, find a portal in the opposite direction along the
-      // player's movement direction
       pair<int32_t, int32_t> portal_target_pos;
       cell_state* portal_target_cell = NULL;
-
-      if (player_target_cell->is_portal(actions.impulse)) {
-        if (player_target_cell->is_jump_portal()) {
-          player_impulse opposite_dir = opposite_direction_for_direction.at(actions.impulse);
-          int32_t max_dist = ((actions.impulse == Left) || (actions.impulse == Right)) ? this->w : this->h;
-
-          for (int32_t z = 2; z < max_dist && !portal_target_cell; z++) {
-            if (this->at(this->player_x + z * forward_offset.first,
-                         this->player_y + z * forward_offset.second).is_portal(opposite_dir)) {
-              portal_target_pos.first = this->player_x + (z + 1) * forward_offset.first;
-              portal_target_pos.second = this->player_y + (z + 1) * forward_offset.second;
-              portal_target_cell = &this->at(portal_target_pos);
-            }
-          }
-
-        } else {
-          portal_target_pos.first = this->player_x + 2 * forward_offset.first;
-          portal_target_pos.second = this->player_y + 2 * forward_offset.second;
-          portal_target_cell = &this->at(portal_target_pos);
-        }
+      if (this->portal_exit_position(this->player_x, this->player_y,
+          actions.impulse, &portal_target_pos)) {
+        portal_target_cell = &this->at(portal_target_pos);
       }
 
       if (portal_target_cell && (portal_target_cell->type == Empty)) {
@@ -637,7 +676,9 @@ uint64_t level_state::exec_frame(const struct player_actions& actions) {
         if (this->player_will_drop_bomb) {
           this->player_will_drop_bomb = false;
           this->num_red_bombs--;
-          this->undo_log.emplace_back(undo_log_entry::entry_type::DropRedBomb);
+          if (this->undo_log_enabled) {
+            this->undo_log.emplace_back(undo_log_entry::entry_type::DropRedBomb);
+          }
           this->at(this->player_x, this->player_y) = cell_state(RedBomb, 1);
           events_occurred |= RedBombDropped;
         } else {
@@ -701,7 +742,9 @@ uint64_t level_state::exec_frame(const struct player_actions& actions) {
           if (this->player_will_drop_bomb) {
             this->player_will_drop_bomb = false;
             this->num_red_bombs--;
-            this->undo_log.emplace_back(undo_log_entry::entry_type::DropRedBomb);
+            if (this->undo_log_enabled) {
+              this->undo_log.emplace_back(undo_log_entry::entry_type::DropRedBomb);
+            }
             this->at(this->player_x, this->player_y) = cell_state(RedBomb, 1);
             events_occurred |= RedBombDropped;
           } else {
@@ -736,7 +779,20 @@ uint64_t level_state::exec_frame(const struct player_actions& actions) {
   }
 
   this->frames_executed++;
-  this->undo_log.emplace_back(this->frames_executed);
+  if (this->undo_log_enabled) {
+    this->undo_log.emplace_back(this->frames_executed);
+  }
+
+  if (this->activity) {
+    this->activity->frames++;
+    if (this->player_is_alive()) {
+      count_activity(*this, PlayerVisits, this->player_x, this->player_y);
+    }
+  }
+
+  if (this->update_winnability()) {
+    events_occurred |= LevelUnwinnable;
+  }
 
   return events_occurred;
 }
@@ -747,6 +803,10 @@ void level_state::rewind_frames(size_t count) {
 }
 
 void level_state::rewind_frames_until(uint64_t target_frame) {
+  if (target_frame < this->undo_log.front().frame) {
+    target_frame = this->undo_log.front().frame;
+  }
+
   while ((this->undo_log.back().type != undo_log_entry::entry_type::FrameMarker) ||
          (this->undo_log.back().frame > target_frame)) {
 
@@ -756,6 +816,7 @@ void level_state::rewind_frames_until(uint64_t target_frame) {
         break;
 
       case undo_log_entry::entry_type::Cell:
+        this->record_cell_change(e.cell.x, e.cell.y);
         this->at(e.cell.x, e.cell.y) = e.cell.old_state;
         if (e.cell.old_state.type == Player) {
           this->player_x = e.cell.x;
@@ -797,6 +858,309 @@ void level_state::rewind_frames_until(uint64_t target_frame) {
   }
 
   this->frames_executed = undo_log.back().frame;
+  this->update_winnability();
+}
+
+bool level_state::can_rewind() const {
+  return this->undo_log_enabled && this->frames_executed > this->undo_log.front().frame;
+}
+
+void level_state::clear_undo_log() {
+  this->undo_log.clear();
+  this->undo_log.emplace_back(this->frames_executed);
+}
+
+void level_state::set_undo_log_enabled(bool enabled) {
+  this->undo_log_enabled = enabled;
+  this->clear_undo_log();
+}
+
+// a level is unwinnable when the player can't get to enough of what it takes to
+// win. to tell what the player can get to, the level is split into regions:
+// groups of cells connected to each other without crossing a wall. walls are
+// blocks, destroyers and deleters (unless they're on top of a deleter, which
+// removes them); nothing can destroy or move these, and nothing but the player
+// can move through anything but an adjacent cell. the player can also jump
+// across walls with jump portals, so every portal in the same row or column as
+// one is in its region too. the player can never get out of their region, and
+// whatever's in another one can never get into it.
+//
+// the state is then unwinnable if the player's region has no exit, fewer items
+// than are left to collect, or too few red bombs to pay back the player's debt.
+// item dudes and blue bombs can explode into items in any region nearby (and
+// turn other bombs' explosions into items too), so the item check is skipped
+// while there are any.
+//
+// walls and portals only change when a white bomb explodes or a portal is
+// destroyed, so the regions are only rebuilt then; otherwise each frame just
+// moves the counts of the cells it changed from their old types to their new
+// ones.
+
+static bool is_wall(cell_type type) {
+  return (type == Block) || (type == Destroyer) || (type == Deleter);
+}
+
+// true if a cell changing between these types can change the regions
+static bool changes_regions(cell_type old_type, cell_type new_type) {
+  return (is_wall(old_type) != is_wall(new_type)) ||
+         cell_state(old_type).is_any_portal() ||
+         cell_state(new_type).is_any_portal();
+}
+
+// true if count_cell counts cells of this type
+static bool is_counted(cell_type type) {
+  return (type == Item) || (type == Exit) || (type == RedBomb) ||
+         (type == ItemDude) || (type == BlueBomb);
+}
+
+static void count_cell(winnability_tracker& wt, uint32_t index, cell_type type,
+    int32_t delta) {
+  if ((type == ItemDude) || (type == BlueBomb)) {
+    wt.num_item_sources += delta;
+  }
+  int32_t region = wt.cell_regions[index];
+  if (region < 0) {
+    return;
+  }
+  if (type == Item) {
+    wt.regions[region].items += delta;
+  } else if (type == Exit) {
+    wt.regions[region].exits += delta;
+  } else if (type == RedBomb) {
+    wt.regions[region].red_bombs += delta;
+  }
+}
+
+static bool compute_unwinnable(const level_state& l) {
+  const winnability_tracker& wt = l.winnability;
+  if (l.player_did_win || l.cells.empty() || (l.player_x < 0) ||
+      (l.player_y < 0) || !l.player_is_alive()) {
+    return false;
+  }
+
+  int32_t region = wt.cell_regions[&l.at(l.player_x, l.player_y) - l.cells.data()];
+  if (region < 0) {
+    return false;
+  }
+  const auto& counts = wt.regions[region];
+  if (counts.exits <= 0) {
+    return true;
+  }
+  if (l.num_red_bombs + counts.red_bombs < 0) {
+    return true;
+  }
+  if (l.num_items_remaining > counts.items) {
+    if (wt.num_item_sources > 0) {
+      return false;
+    }
+    for (const auto& e : l.pending_explosions) {
+      if (e.type == ItemExplosion) {
+        return false;
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+// rebuilds the regions and everything counted in them
+static void rebuild_winnability_facts(level_state& l) {
+  winnability_tracker& wt = l.winnability;
+  size_t num_cells = l.cells.size();
+  wt.cell_regions.assign(num_cells, -1);
+  wt.regions.clear();
+  wt.num_item_sources = 0;
+  wt.changed_cells.clear();
+  wt.cell_stamps.assign(num_cells, 0);
+  wt.stamp = 1;
+  wt.last_inputs_valid = false;
+
+  // flood-fills each region in turn
+  vector<pair<int32_t, int32_t>> pending;
+  int32_t region = -1;
+  auto visit = [&](int32_t x, int32_t y) {
+    const cell_state& c = l.at(x, y);
+    int32_t& cell_region = wt.cell_regions[&c - l.cells.data()];
+    if ((cell_region < 0) &&
+        (!is_wall(c.type) || (l.at(x, y + 1).type == Deleter))) {
+      cell_region = region;
+      pending.emplace_back(x, y);
+    }
+  };
+  for (int32_t y = 0; y < static_cast<int32_t>(l.h); y++) {
+    for (int32_t x = 0; x < static_cast<int32_t>(l.w); x++) {
+      region = wt.regions.size();
+      visit(x, y);
+      if (pending.empty()) {
+        continue;
+      }
+      wt.regions.emplace_back(winnability_tracker::region_counts{0, 0, 0});
+
+      while (!pending.empty()) {
+        auto pos = pending.back();
+        pending.pop_back();
+        visit(pos.first - 1, pos.second);
+        visit(pos.first + 1, pos.second);
+        visit(pos.first, pos.second - 1);
+        visit(pos.first, pos.second + 1);
+        // jump portals connect to every portal in the same row or column, in
+        // both directions, since either may be reached first
+        const cell_state& c = l.at(pos);
+        if (c.is_any_portal()) {
+          bool is_jump = c.is_jump_portal();
+          for (int32_t z = 0; z < static_cast<int32_t>(l.w); z++) {
+            const cell_state& other = l.at(z, pos.second);
+            if (other.is_any_portal() && (is_jump || other.is_jump_portal())) {
+              visit(z, pos.second);
+            }
+          }
+          for (int32_t z = 0; z < static_cast<int32_t>(l.h); z++) {
+            const cell_state& other = l.at(pos.first, z);
+            if (other.is_any_portal() && (is_jump || other.is_jump_portal())) {
+              visit(pos.first, z);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  for (size_t x = 0; x < num_cells; x++) {
+    count_cell(wt, x, l.cells[x].type, 1);
+  }
+}
+
+bool winnability_tracker::inputs::operator==(const inputs& other) const {
+  return (this->player_x == other.player_x) &&
+         (this->player_y == other.player_y) &&
+         (this->num_items_remaining == other.num_items_remaining) &&
+         (this->num_red_bombs == other.num_red_bombs) &&
+         (this->num_pending_explosions == other.num_pending_explosions) &&
+         (this->player_did_win == other.player_did_win) &&
+         (this->player_is_alive == other.player_is_alive);
+}
+
+bool level_state::update_winnability() {
+  winnability_tracker& wt = this->winnability;
+  this->changed_cells.clear();
+  bool counts_changed = false;
+  if (!wt.changed_cells.empty()) {
+    bool regions_changed = false;
+    for (const auto& it : wt.changed_cells) {
+      cell_type new_type = this->cells[it.first].type;
+      if (it.second != new_type) {
+        this->changed_cells.emplace_back(it.first);
+        counts_changed |= is_counted(it.second) || is_counted(new_type);
+        regions_changed |= changes_regions(it.second, new_type);
+      }
+    }
+
+    if (regions_changed) {
+      rebuild_winnability_facts(*this);
+    } else {
+      for (const auto& it : wt.changed_cells) {
+        count_cell(wt, it.first, it.second, -1);
+        count_cell(wt, it.first, this->cells[it.first].type, 1);
+      }
+      wt.changed_cells.clear();
+      // the next update's changes get a new stamp. if it wraps around, the old
+      // stamps could collide with the new ones, so they're all cleared
+      if (++wt.stamp == 0) {
+        wt.cell_stamps.assign(wt.cell_stamps.size(), 0);
+        wt.stamp = 1;
+      }
+    }
+  }
+
+  winnability_tracker::inputs inputs;
+  inputs.player_x = this->player_x;
+  inputs.player_y = this->player_y;
+  inputs.num_items_remaining = this->num_items_remaining;
+  inputs.num_red_bombs = this->num_red_bombs;
+  inputs.num_pending_explosions = this->pending_explosions.size();
+  inputs.player_did_win = this->player_did_win;
+  inputs.player_is_alive = !this->cells.empty() && (this->player_x >= 0) &&
+      (this->player_y >= 0) && this->player_is_alive();
+  if (!counts_changed && wt.last_inputs_valid && (inputs == wt.last_inputs)) {
+    return false;
+  }
+  wt.last_inputs = inputs;
+  wt.last_inputs_valid = true;
+
+  bool was_unwinnable = this->unwinnable;
+  this->unwinnable = compute_unwinnable(*this);
+  if (this->unwinnable && !was_unwinnable) {
+    this->unwinnable_frame = this->frames_executed;
+    return true;
+  }
+  return false;
+}
+
+void level_state::recompute_winnability() {
+  rebuild_winnability_facts(*this);
+  this->unwinnable = false;
+  this->update_winnability();
+}
+
+// level_state::hash and level_template::hash must agree, so both use this.
+// explosions are hashed in list order since they're executed in that order
+template <typename ExplosionsT>
+static uint64_t hash_level(const uint64_t (&header)[8], uint8_t flags,
+    const vector<cell_state>& cells, const ExplosionsT& pending_explosions) {
+  uint64_t ret = fnv1a64(header, sizeof(header));
+  ret = fnv1a64(&flags, sizeof(flags), ret);
+
+  for (const auto& c : cells) {
+    int32_t data[2] = {c.type, c.param};
+    ret = fnv1a64(data, sizeof(data), ret);
+  }
+
+  for (const auto& e : pending_explosions) {
+    uint64_t data[5] = {e.frame, static_cast<uint64_t>(e.x),
+        static_cast<uint64_t>(e.y), static_cast<uint64_t>(e.size),
+        static_cast<uint64_t>(e.type)};
+    ret = fnv1a64(data, sizeof(data), ret);
+  }
+  return ret;
+}
+
+uint64_t level_state::hash() const {
+  uint64_t header[8] = {this->w, this->h,
+      static_cast<uint64_t>(this->player_x),
+      static_cast<uint64_t>(this->player_y),
+      static_cast<uint64_t>(this->num_items_remaining),
+      static_cast<uint64_t>(this->num_red_bombs),
+      this->frames_executed, this->player_lose_frame};
+  uint8_t flags = (this->player_will_drop_bomb ? 1 : 0) |
+      (this->player_did_win ? 2 : 0);
+  return hash_level(header, flags, this->cells, this->pending_explosions);
+}
+
+uint64_t level_state::gameplay_hash() const {
+  uint64_t header[5] = {static_cast<uint64_t>(this->player_x),
+      static_cast<uint64_t>(this->player_y),
+      static_cast<uint64_t>(this->num_items_remaining),
+      static_cast<uint64_t>(this->num_red_bombs),
+      static_cast<uint64_t>(this->player_will_drop_bomb ? 1 : 0) |
+          (this->player_did_win ? 2 : 0)};
+  uint64_t ret = fnv1a64(header, sizeof(header));
+
+  // this is called for every state a search visits, so the cells are hashed a
+  // word at a time instead of a byte at a time like in hash()
+  for (const auto& c : this->cells) {
+    uint64_t data = (static_cast<uint64_t>(c.type) << 32) |
+        static_cast<uint32_t>((c.type == Empty) ? 0 : c.param);
+    ret = (ret ^ data) * 0x9E3779B97F4A7C15;
+    ret ^= ret >> 29;
+  }
+
+  for (const auto& e : this->pending_explosions) {
+    uint64_t data[5] = {e.frame - this->frames_executed,
+        static_cast<uint64_t>(e.x), static_cast<uint64_t>(e.y),
+        static_cast<uint64_t>(e.size), static_cast<uint64_t>(e.type)};
+    ret = fnv1a64(data, sizeof(data), ret);
+  }
+  return ret;
 }
 
 void level_state::compute_player_coordinates() {
@@ -811,37 +1175,72 @@ void level_state::compute_player_coordinates() {
   }
 }
 
+bool level_state::portal_exit_position(int32_t x, int32_t y,
+    player_impulse dir, pair<int32_t, int32_t>* exit_pos) const {
+  if (dir == None) {
+    return false;
+  }
+  const auto& offset = offset_for_impulse.at(dir);
+  const cell_state& portal = this->at(x + offset.first, y + offset.second);
+  if (!portal.is_portal(dir)) {
+    return false;
+  }
 
+  // for jump portals, find a portal in the opposite direction along the
+  // player's movement direction
+  if (portal.is_jump_portal()) {
+    player_impulse opposite_dir = opposite_direction_for_direction.at(dir);
+    int32_t max_dist = ((dir == Left) || (dir == Right)) ? this->w : this->h;
+    for (int32_t z = 2; z < max_dist; z++) {
+      if (this->at(x + z * offset.first, y + z * offset.second).is_portal(opposite_dir)) {
+        exit_pos->first = x + (z + 1) * offset.first;
+        exit_pos->second = y + (z + 1) * offset.second;
+        return true;
+      }
+    }
+    return false;
+  }
 
-vector<level_state> load_levels(const char* filename) {
-  auto f = fopen_unique(filename, "rb");
+  exit_pos->first = x + 2 * offset.first;
+  exit_pos->second = y + 2 * offset.second;
+  return true;
+}
 
-  uint64_t file_version;
-  freadx(f.get(), &file_version, sizeof(file_version));
-  if (file_version != 0) {
-    throw runtime_error("unsupported file version");
-  }
 
-  uint64_t num_levels;
-  freadx(f.get(), &num_levels, sizeof(num_levels));
 
-  vector<level_state> all_levels(num_levels);
-  for (uint64_t x = 0; x < num_levels; x++) {
-    all_levels[x].read(f.get());
-  }
+level_template::level_template(const level_state& l) : w(l.w), h(l.h),
+    player_x(l.player_x), player_y(l.player_y),
+    num_items_remaining(l.num_items_remaining), num_red_bombs(l.num_red_bombs),
+    frames_executed(l.frames_executed), cells(l.cells),
+    pending_explosions(l.pending_explosions.begin(), l.pending_explosions.end()) {
+  this->compute_hash();
+}
 
-  return all_levels;
+level_template::level_template(level_state&& l) : w(l.w), h(l.h),
+    player_x(l.player_x), player_y(l.player_y),
+    num_items_remaining(l.num_items_remaining), num_red_bombs(l.num_red_bombs),
+    frames_executed(l.frames_executed), cells(move(l.cells)),
+    pending_explosions(l.pending_explosions.begin(), l.pending_explosions.end()) {
+  this->compute_hash();
 }
 
-void save_levels(const vector<level_state>& levels, const char* filename) {
-  auto f = fopen_unique(filename, "wb");
+void level_template::compute_hash() {
+  // the same as hash() on an instantiated copy, which starts with no loss
+  // frame and both flags clear
+  uint64_t header[8] = {this->w, this->h,
+      static_cast<uint64_t>(this->player_x),
+      static_cast<uint64_t>(this->player_y),
+      static_cast<uint64_t>(this->num_items_remaining),
+      static_cast<uint64_t>(this->num_red_bombs),
+      this->frames_executed, 0};
+  this->content_hash = hash_level(header, 0, this->cells,
+      this->pending_explosions);
+}
 
-  uint64_t file_version = 0;
-  uint64_t num_levels = levels.size();
-  fwritex(f.get(), &file_version, sizeof(file_version));
-  fwritex(f.get(), &num_levels, sizeof(num_levels));
+uint64_t level_template::hash() const {
+  return this->content_hash;
+}
 
-  for (const level_state& l : levels) {
-    l.write(f.get());
-  }
+level_state level_template::instantiate() const {
+  return level_state(*this);
 }
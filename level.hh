@@ -1,3 +1,6 @@
+#ifndef __LEVEL_H
+#define __LEVEL_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
@@ -26,6 +29,12 @@ struct player_actions {
   bool drop_bomb;
 };
 
+// the impulses that move the player, in order
+extern const std::vector<player_impulse> movement_impulses;
+// indexed by player_impulse
+extern const std::vector<std::pair<int32_t, int32_t>> offset_for_impulse;
+extern const std::vector<player_impulse> opposite_direction_for_direction;
+
 enum block_fall_action {
   Resting = 0,
   Falling,
@@ -70,6 +79,8 @@ enum cell_type {
   WhiteBomb,
 };
 
+const char* name_for_cell_type(cell_type type);
+
 enum explosion_type {
   NormalExplosion = 0,
   ItemExplosion,
@@ -89,6 +100,7 @@ enum events_mask {
   Exploded         = 0x0080,
   ItemExploded     = 0x0100,
   PlayerWon        = 0x0200,
+  LevelUnwinnable  = 0x0400,
 };
 
 struct cell_state {
@@ -96,9 +108,6 @@ struct cell_state {
   int32_t param;
   bool moved;
 
-  void read(FILE*);
-  void write(FILE*) const;
-
   cell_state();
   cell_state(cell_type type, int32_t param = 0, bool moved = false);
 
@@ -113,6 +122,7 @@ struct cell_state {
   bool is_dude() const;
   explosion_type get_explosion_type() const;
   bool is_portal(player_impulse dir) const;
+  bool is_any_portal() const;
   bool is_jump_portal() const;
 };
 
@@ -127,9 +137,48 @@ struct explosion_info {
       explosion_type type = NormalExplosion);
 
   bool operator==(const explosion_info& other) const;
+};
+
+struct level_template;
+struct activity_counters;
+
+// what level_state needs to tell when it can't be won any more, kept up to
+// date from the cells that change each frame instead of by scanning the whole
+// level. see level_state::update_winnability
+struct winnability_tracker {
+  struct region_counts {
+    int32_t items;
+    int32_t exits;
+    int32_t red_bombs;
+  };
 
-  void read(FILE*);
-  void write(FILE*) const;
+  // the region each cell is in, or -1 for walls
+  std::vector<int32_t> cell_regions;
+  std::vector<region_counts> regions;
+  int32_t num_item_sources; // item dudes and blue bombs, anywhere
+
+  // (index, previous type) of the cells changed since the last update, each
+  // listed once with the type it had then. a cell is only listed if its stamp
+  // isn't the current one, so nothing has to be deduplicated afterward
+  std::vector<std::pair<uint32_t, cell_type>> changed_cells;
+  std::vector<uint32_t> cell_stamps;
+  uint32_t stamp;
+
+  // what unwinnable was last computed from besides the counts above. if none
+  // of these or the counts changed, neither did unwinnable
+  struct inputs {
+    int32_t player_x;
+    int32_t player_y;
+    int32_t num_items_remaining;
+    int32_t num_red_bombs;
+    size_t num_pending_explosions;
+    bool player_did_win;
+    bool player_is_alive;
+
+    bool operator==(const inputs& other) const;
+  };
+  inputs last_inputs;
+  bool last_inputs_valid;
 };
 
 struct level_state {
@@ -180,20 +229,50 @@ struct level_state {
     undo_log_entry(entry_type type, const explosion_info& explosion);
   };
   std::deque<undo_log_entry> undo_log;
+  // when false, frames aren't written to the undo log (and can't be rewound).
+  // simulations that never rewind turn this off to run faster
+  bool undo_log_enabled;
+
+  // true if this state provably can't be won (but not every state that can't
+  // be won is caught). unwinnable_frame is the frame it became true on; the
+  // state before that frame was not known to be unwinnable
+  bool unwinnable;
+  uint64_t unwinnable_frame;
+  winnability_tracker winnability;
+  // indexes of the cells whose types changed during the last update of the
+  // winnability facts (so the last exec_frame or rewind), each listed once.
+  // for anything else that keeps facts about the cells up to date (e.g.
+  // path_planner)
+  std::vector<uint32_t> changed_cells;
+  // if not NULL, exec_frame counts what happens in each cell here (see
+  // activity.hh). it must be the same size as the level. copies of the state
+  // point to the same counters, but forks don't count anything
+  activity_counters* activity;
 
   level_state(uint32_t w = 60, uint32_t h = 24, int32_t player_x = 1,
       int32_t player_y = 1);
+  explicit level_state(const level_template& t);
+
+  // a copy of this state for simulating ahead without disturbing it: the undo
+  // log (which can be much larger than the rest of the state) isn't copied, and
+  // the copy doesn't keep one
+  level_state fork() const;
 
-  void read(FILE*);
-  void write(FILE*) const;
+  // restarts from the template, reusing this state's memory: the cells are
+  // copied into the existing vector, so nothing is allocated if the level is
+  // the same size
+  void reset(const level_template& t);
 
   cell_state& at(int32_t x, int32_t y);
   cell_state& at(const std::pair<int32_t, int32_t>& pos);
   const cell_state& at(int32_t x, int32_t y) const;
   const cell_state& at(const std::pair<int32_t, int32_t>& pos) const;
 
+  // must be called before a cell's type changes. exec_frame does this for
+  // every cell it changes (even when the undo log is disabled)
   void write_cell_to_undo_log(int32_t x, int32_t y);
   void write_cell_to_undo_log(const std::pair<int32_t, int32_t>& pos);
+  void record_cell_change(int32_t x, int32_t y);
 
   void create_explosion(uint64_t frame, int32_t x, int32_t y, int32_t size = 1,
       explosion_type type = NormalExplosion);
@@ -207,10 +286,70 @@ struct level_state {
   size_t compute_entropy() const;
   void compute_player_coordinates();
 
+  // where a player at (x, y) moving in direction dir would come out of the
+  // portal next to them, if the cell there is empty when they get there.
+  // returns false if there's no portal they can go through that way (for a
+  // jump portal, if there's no portal facing back along the same line)
+  bool portal_exit_position(int32_t x, int32_t y, player_impulse dir,
+      std::pair<int32_t, int32_t>* exit_pos) const;
+
+  // hash of everything that affects how the game plays out from this state
+  // (but not the undo log, rewind count or speed). stored in files, so it must
+  // not change
+  uint64_t hash() const;
+  // hash of only what affects how the game plays out from this state from now
+  // on: unlike hash(), it leaves out the frame counter (explosion times are
+  // hashed relative to it), the loss frame and the attenuation of empty space.
+  // two states with the same gameplay hash behave the same way given the same
+  // actions, so searches use it to find states they've already seen
+  uint64_t gameplay_hash() const;
+
   uint64_t exec_frame(const struct player_actions& actions);
   void rewind_frames(size_t count);
   void rewind_frames_until(uint64_t target_frame);
+
+  // the undo log may not go all the way back to frame 0 (e.g. if the state was
+  // restored from a recording keyframe); these never rewind past its start
+  bool can_rewind() const;
+  void clear_undo_log();
+  // turning the undo log off discards it; turning it back on starts a new one
+  // at the current frame
+  void set_undo_log_enabled(bool enabled);
+
+  // brings unwinnable up to date with the cells changed since the last update.
+  // returns true if the state just became unwinnable. exec_frame and rewinding
+  // call this
+  bool update_winnability();
+  // rebuilds the facts update_winnability uses from scratch. call this after
+  // changing cells without write_cell_to_undo_log (e.g. in the editor, or when
+  // decoding a state)
+  void recompute_winnability();
+};
+
+// a level as it's stored in a pack: only its layout and counters, without any
+// of the runtime state (undo log, speed, etc.) that a level_state carries.
+// level packs share templates between their users as shared_ptr<const
+// level_template>, and playable states are instantiated from them.
+struct level_template {
+  uint32_t w;
+  uint32_t h;
+  int32_t player_x;
+  int32_t player_y;
+  int32_t num_items_remaining;
+  int32_t num_red_bombs;
+  uint64_t frames_executed;
+  uint64_t content_hash; // level_state::hash of an instantiated copy
+  std::vector<cell_state> cells;
+  std::vector<explosion_info> pending_explosions;
+
+  explicit level_template(const level_state& l);
+  explicit level_template(level_state&& l);
+
+  uint64_t hash() const;
+  level_state instantiate() const;
+
+private:
+  void compute_hash();
 };
 
-std::vector<level_state> load_levels(const char* filename);
-void save_levels(const std::vector<level_state>& levels, const char* filename);
+#endif // __LEVEL_H
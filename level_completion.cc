@@ -1,11 +1,16 @@
+#include <fcntl.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include <stdexcept>
 #include <string>
 #include <vector>
 #include <phosg/Filesystem.hh>
 
+#include "codec.hh"
+#include "file_io.hh"
 #include "level.hh"
 #include "level_completion.hh"
 
@@ -28,6 +33,46 @@ level_completion::level_completion(const level_completion_v2& v2) :
     attenuated_space(v2.attenuated_space), entropy(v2.entropy),
     rewind_count(0xFFFFFFFFFFFFFFFF) { }
 
+void level_completion::merge(const level_completion& other) {
+  if (other.state > this->state) {
+    this->state = other.state;
+  }
+  if (other.frames < this->frames) {
+    this->frames = other.frames;
+  }
+  if (other.extra_items > this->extra_items) {
+    this->extra_items = other.extra_items;
+  }
+  if (other.extra_bombs > this->extra_bombs) {
+    this->extra_bombs = other.extra_bombs;
+  }
+  if (other.cleared_space > this->cleared_space) {
+    this->cleared_space = other.cleared_space;
+  }
+  if (other.attenuated_space < this->attenuated_space) {
+    this->attenuated_space = other.attenuated_space;
+  }
+  if (other.entropy < this->entropy) {
+    this->entropy = other.entropy;
+  }
+  if (other.rewind_count < this->rewind_count) {
+    this->rewind_count = other.rewind_count;
+  }
+}
+
+level_completion completion_for_win(const level_state& game) {
+  level_completion lc;
+  lc.state = Completed;
+  lc.frames = game.frames_executed;
+  lc.extra_items = (game.num_items_remaining < 0) ? -game.num_items_remaining : 0;
+  lc.extra_bombs = (game.num_red_bombs > 0) ? game.num_red_bombs : 0;
+  lc.cleared_space = game.count_cells_of_type(Empty);
+  lc.attenuated_space = game.count_attenuated_space();
+  lc.entropy = game.compute_entropy();
+  lc.rewind_count = game.rewind_count;
+  return lc;
+}
+
 vector<level_completion> load_level_completion_state_v1(const string& filename) {
   try {
     auto f = fopen_unique(filename.c_str(), "rb");
@@ -47,7 +92,111 @@ vector<level_completion> load_level_completion_state_v1(const string& filename)
   }
 }
 
-vector<level_completion> load_level_completion_state(const string& filename) {
+// version 4 of the progress file is a journal: a header followed by fixed-size
+// records, each of which replaces the stats for one level. saving progress
+// appends a single record instead of rewriting the file, and records carry a
+// checksum so a record that was only partially written (e.g. because the game
+// crashed) is ignored. a partial record at the end of the file is cut off
+// before the next one is appended, so every record stays at a multiple of the
+// record size. unlike earlier versions, the record layout is explicit and has
+// no padding, so it doesn't depend on the compiler's struct layout. the
+// journal is compacted (rewritten with one record per level) when loading
+// finds that it has grown; see load_level_completion_state.
+
+static const uint64_t PROGRESS_JOURNAL_VERSION = 4;
+
+struct progress_journal_header {
+  uint64_t version;
+  uint64_t record_size;
+};
+
+struct progress_journal_record {
+  uint32_t level_index;
+  uint32_t state;
+  uint64_t frames;
+  uint64_t extra_items;
+  uint64_t extra_bombs;
+  uint64_t cleared_space;
+  uint64_t attenuated_space;
+  uint64_t entropy;
+  uint64_t rewind_count;
+  uint64_t checksum; // fnv1a64 of all the preceding fields
+
+  progress_journal_record() = default;
+  progress_journal_record(uint32_t level_index, const level_completion& lc) :
+      level_index(level_index), state(lc.state), frames(lc.frames),
+      extra_items(lc.extra_items), extra_bombs(lc.extra_bombs),
+      cleared_space(lc.cleared_space), attenuated_space(lc.attenuated_space),
+      entropy(lc.entropy), rewind_count(lc.rewind_count),
+      checksum(this->compute_checksum()) { }
+
+  uint64_t compute_checksum() const {
+    return fnv1a64(this, offsetof(progress_journal_record, checksum));
+  }
+};
+
+static vector<level_completion> load_level_completion_journal(
+    const string& data, bool* needs_compaction) {
+  const progress_journal_header* header =
+      reinterpret_cast<const progress_journal_header*>(data.data());
+  if (data.size() < sizeof(progress_journal_header)) {
+    throw runtime_error("level completion state journal is truncated");
+  }
+  // a different record size probably means a newer build wrote the journal,
+  // so it must not be rewritten in this build's format
+  if (header->record_size != sizeof(progress_journal_record)) {
+    throw runtime_error("level completion state journal has an unknown record size");
+  }
+
+  const progress_journal_record* records =
+      reinterpret_cast<const progress_journal_record*>(data.data() + sizeof(*header));
+  size_t num_records = (data.size() - sizeof(*header)) / sizeof(progress_journal_record);
+
+  vector<level_completion> ret;
+  size_t num_valid_records = 0;
+  for (size_t x = 0; x < num_records; x++) {
+    // a damaged record only loses that one update; the records after it are
+    // still aligned, so they can be used
+    const progress_journal_record& r = records[x];
+    if (r.checksum != r.compute_checksum()) {
+      continue;
+    }
+    num_valid_records++;
+    if (r.level_index >= ret.size()) {
+      ret.resize(r.level_index + 1);
+    }
+    level_completion& lc = ret[r.level_index];
+    lc.state = static_cast<level_completion_state>(r.state);
+    lc.frames = r.frames;
+    lc.extra_items = r.extra_items;
+    lc.extra_bombs = r.extra_bombs;
+    lc.cleared_space = r.cleared_space;
+    lc.attenuated_space = r.attenuated_space;
+    lc.entropy = r.entropy;
+    lc.rewind_count = r.rewind_count;
+  }
+
+  // rewrite the journal if it has damaged records, trailing garbage, or a lot
+  // of superseded records
+  if (needs_compaction) {
+    *needs_compaction = (num_valid_records < num_records) ||
+        (data.size() != sizeof(*header) + num_records * sizeof(progress_journal_record)) ||
+        (num_records > 2 * ret.size());
+  }
+
+  fprintf(stderr, "loaded %zu level completion states from %zu journal records\n",
+      ret.size(), num_valid_records);
+  return ret;
+}
+
+vector<level_completion> load_level_completion_state(const string& filename,
+    bool* needs_compaction) {
+  // until proven otherwise, the file needs to be converted to the current
+  // format before anything can be appended to it
+  if (needs_compaction) {
+    *needs_compaction = true;
+  }
+
   try {
     auto f = fopen_unique(filename.c_str(), "rb");
     size_t file_size = fstat(fileno(f.get())).st_size;
@@ -55,7 +204,11 @@ vector<level_completion> load_level_completion_state(const string& filename) {
     uint64_t version = 0;
     freadx(f.get(), &version, sizeof(version));
 
-    if (version == 2) {
+    if (version == PROGRESS_JOURNAL_VERSION) {
+      return load_level_completion_journal(load_file(filename),
+          needs_compaction);
+
+    } else if (version == 2) {
       uint64_t num = (file_size - sizeof(version)) / sizeof(level_completion_v2);
 
       fprintf(stderr, "loading %" PRIu64 " level completion states v2\n", num);
@@ -80,8 +233,8 @@ vector<level_completion> load_level_completion_state(const string& filename) {
       return ret;
 
     } else {
-      fprintf(stderr, "level completion state file is in an unknown format\n");
-      return vector<level_completion>();
+      // probably from a newer build; don't let it be overwritten
+      throw runtime_error("level completion state file is in an unknown format");
     }
 
   } catch (const cannot_open_file&) {
@@ -91,123 +244,44 @@ vector<level_completion> load_level_completion_state(const string& filename) {
 }
 
 void save_level_completion_state(const string& filename, const vector<level_completion>& lc) {
-  auto f = fopen_unique(filename.c_str(), "wb");
-
-  uint64_t version = 3;
-  fwritex(f.get(), &version, sizeof(version));
-  fwritex(f.get(), lc.data(), lc.size() * sizeof(level_completion));
-}
-
-
-
-class BitSerializer {
-public:
-  BitSerializer() : bit_offset(0) { }
-  ~BitSerializer() = default;
-
-  void write(bool v) {
-    if (!(this->bit_offset & 7)) {
-      this->serialized_data.resize(this->serialized_data.size() + 1, 0);
-    }
-
-    uint8_t* current = reinterpret_cast<uint8_t*>(
-        &this->serialized_data[this->bit_offset >> 3]);
-    if (v) {
-      *current |= (0x80 >> (this->bit_offset & 7));
-    }
-    this->bit_offset++;
-  }
-
-  void write(const void* data, size_t size) {
-    if (this->bit_offset & 7) {
-      throw invalid_argument("raw data write not on byte boundary");
-    }
-    this->serialized_data.append(reinterpret_cast<const char*>(data), size);
-    this->bit_offset += (size << 3);
-  }
-
-  const string& data() {
-    return this->serialized_data;
-  }
-
-private:
-  string serialized_data;
-  size_t bit_offset;
-};
-
-class BitDeserializer {
-public:
-  BitDeserializer(const string& data) : serialized_data(data), bit_offset(0) { }
-  ~BitDeserializer() = default;
-
-  bool read() {
-    if ((this->bit_offset >> 3) >= this->serialized_data.size()) {
-      throw out_of_range("reached end of stream");
+  progress_journal_header header;
+  header.version = PROGRESS_JOURNAL_VERSION;
+  header.record_size = sizeof(progress_journal_record);
+
+  string data(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (size_t x = 0; x < lc.size(); x++) {
+    // levels that were never attempted have no stats worth recording
+    if (lc[x].state == NotAttempted) {
+      continue;
     }
-
-    bool ret = (this->serialized_data[this->bit_offset >> 3] & (0x80 >> (this->bit_offset & 7))) ? true : false;
-    this->bit_offset++;
-    return ret;
+    progress_journal_record r(x, lc[x]);
+    data.append(reinterpret_cast<const char*>(&r), sizeof(r));
   }
 
-  string read(size_t size) {
-    if (this->bit_offset & 7) {
-      throw invalid_argument("raw data write not on byte boundary");
-    }
-    string ret = this->serialized_data.substr(this->bit_offset >> 3, size);
-    this->bit_offset += (ret.size() << 3);
-    return ret;
-  }
-
-private:
-  string serialized_data;
-  size_t bit_offset;
-};
+  save_file_atomic(filename, data);
+}
 
-deque<struct player_actions> load_recording(const string& filename) {
-  BitDeserializer des(load_file(filename));
+void append_level_completion_state(const string& filename, size_t level_index,
+    const level_completion& lc) {
+  progress_journal_record r(level_index, lc);
 
-  string version_str = des.read(sizeof(uint32_t));
-  if (version_str != "\x45\x43\x45\x43") {
-    throw invalid_argument("incorrect version");
+  // the checksum protects against torn writes, so we don't sync here; if the
+  // record doesn't make it to disk, only this one update is lost
+  fd_guard fd(open(filename.c_str(), O_RDWR));
+  if (fd.get() < 0) {
+    throw cannot_open_file(filename);
   }
-
-  string count_str = des.read(sizeof(uint32_t));
-  if (count_str.size() != sizeof(uint32_t)) {
-    throw invalid_argument("count is missing");
+  size_t file_size = fstat(fd.get()).st_size;
+  if (file_size < sizeof(progress_journal_header)) {
+    throw runtime_error("level completion state journal is truncated");
   }
-  uint32_t count = *reinterpret_cast<const uint32_t*>(count_str.data());
 
-  deque<struct player_actions> recording;
-  for (uint32_t x = 0; x < count; x++) {
-    struct player_actions actions;
-    actions.drop_bomb = des.read();
-    uint8_t impulse = des.read() << 2;
-    impulse |= des.read() << 1;
-    impulse |= des.read();
-    actions.impulse = static_cast<enum player_impulse>(impulse);
-    recording.emplace_back(actions);
+  // if an earlier append was cut short, write over the partial record instead
+  // of after it, so it doesn't shift this record and every later one
+  size_t offset = file_size - (file_size - sizeof(progress_journal_header)) %
+      sizeof(progress_journal_record);
+  if ((offset != file_size) && ftruncate(fd.get(), offset)) {
+    throw runtime_error("can\'t truncate level completion state journal");
   }
-
-  return recording;
-}
-
-void save_recording(const string& filename, const deque<struct player_actions>& recording) {
-  BitSerializer ser;
-
-  uint32_t version = 0x43454345;
-  ser.write(&version, sizeof(version));
-
-  uint32_t count = recording.size();
-  ser.write(&count, sizeof(count));
-
-  for (const auto& actions : recording) {
-    ser.write(actions.drop_bomb);
-    uint8_t impulse = actions.impulse;
-    ser.write((impulse >> 2) & 1);
-    ser.write((impulse >> 1) & 1);
-    ser.write(impulse & 1);
-  }
-
-  save_file(filename, ser.data());
+  pwrite_all(fd.get(), &r, sizeof(r), offset);
 }
@@ -1,3 +1,6 @@
+#ifndef __LEVEL_COMPLETION_H
+#define __LEVEL_COMPLETION_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
@@ -8,8 +11,11 @@
 #include <deque>
 #include <list>
 #include <stdexcept>
+#include <string>
 #include <vector>
 
+#include "level.hh"
+
 
 enum level_completion_state {
   // these are saved in a file, so don't change the values of existing entries
@@ -50,15 +56,29 @@ struct level_completion {
   level_completion();
   level_completion(const level_completion_v1& v1);
   level_completion(const level_completion_v2& v2);
+
+  // keeps the best value of each stat from this and other
+  void merge(const level_completion& other);
 };
 
+// the stats of a single game that the player won
+level_completion completion_for_win(const level_state& game);
+
 std::vector<level_completion> load_level_completion_state_v1(
     const std::string& filename);
+// if needs_compaction is given, it's set to true if the file should be
+// rewritten with save_level_completion_state before anything is appended to it
+// (because it's in an old format, or it's damaged, or it has grown too large).
+// throws runtime_error if the file exists but can't be read (e.g. it's in a
+// format from a newer build); callers shouldn't write to it in that case
 std::vector<level_completion> load_level_completion_state(
-    const std::string& filename);
+    const std::string& filename, bool* needs_compaction = NULL);
+// writes the entire state, atomically replacing the existing file
 void save_level_completion_state(const std::string& filename,
     const std::vector<level_completion>& lc);
+// records the new state of a single level by appending it to the file. the file
+// must have been written by save_level_completion_state first
+void append_level_completion_state(const std::string& filename,
+    size_t level_index, const level_completion& lc);
 
-std::deque<struct player_actions> load_recording(const std::string& filename);
-void save_recording(const std::string& filename,
-    const std::deque<struct player_actions>& recording);
+#endif // __LEVEL_COMPLETION_H
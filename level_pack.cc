@@ -0,0 +1,716 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+
+#include "codec.hh"
+#include "file_io.hh"
+#include "level.hh"
+#include "level_pack.hh"
+
+using namespace std;
+
+
+// version 0 level pack format (read-only; we no longer write it):
+//   uint64_t file_version (0)
+//   uint64_t num_levels
+//   for each level:
+//     level_header_v0
+//     packed_cell[w * h]
+//     uint64_t num_explosions
+//     explosion_info[num_explosions]
+//
+// version 1 level pack format:
+//   uint64_t file_version (1)
+//   uint64_t directory_offset
+//   compressed level data (see compress_level)
+//   at directory_offset:
+//     uint64_t num_levels
+//     level_directory_entry_v1[num_levels]
+//
+// each level in a version 1 file can be located and decoded by itself using
+// only the directory.
+//
+// version 1 files are also updated in place when a single level changes (see
+// save_level): the new level data and a new copy of the directory are appended
+// to the end of the file, then the directory_offset in the header is
+// overwritten to point to the new directory. until that last 8-byte write
+// happens, the old directory is still the valid one, so a crash at any point
+// leaves the pack either entirely old or entirely new. superseded level data
+// and directories stay in the file as garbage until compact_levels removes
+// them.
+
+struct level_header_v0 {
+  uint32_t w;
+  uint32_t h;
+  int32_t player_x;
+  int32_t player_y;
+  int32_t num_items_remaining;
+  int32_t num_red_bombs;
+  uint64_t frames_executed;
+};
+
+struct packed_cell {
+  int32_t type;
+  int32_t param;
+};
+
+struct level_directory_entry_v1 {
+  uint64_t offset;
+  uint64_t checksum; // fnv1a64 of the compressed level data
+  uint32_t size;
+  uint32_t w;
+  uint32_t h;
+  int32_t num_items_remaining;
+};
+
+struct level_pack_header_v1 {
+  uint64_t file_version;
+  uint64_t directory_offset;
+};
+
+// levels can wrap around, so nothing stops them from being large, but nothing
+// this big can be a real level; refuse to allocate it
+static const size_t MAX_LEVEL_CELLS = 0x1000000;
+
+static void decode_cells(level_state& l, const packed_cell* cells) {
+  size_t num_cells = l.cells.size();
+  cell_state* dest = l.cells.data();
+  for (size_t x = 0; x < num_cells; x++) {
+    if ((cells[x].type < Empty) || (cells[x].type > WhiteBomb)) {
+      throw runtime_error("level contains an invalid cell type");
+    }
+    dest[x].type = static_cast<cell_type>(cells[x].type);
+    dest[x].param = cells[x].param;
+    dest[x].moved = false;
+  }
+}
+
+static level_state decode_level_v0(const uint8_t* data, size_t size) {
+  mapped_reader r(data, size);
+  const level_header_v0* header = r.get<level_header_v0>();
+
+  level_state l(header->w, header->h, -1, -1);
+  l.player_x = header->player_x;
+  l.player_y = header->player_y;
+  l.num_items_remaining = header->num_items_remaining;
+  l.num_red_bombs = header->num_red_bombs;
+  l.frames_executed = header->frames_executed;
+
+  decode_cells(l, r.get<packed_cell>(l.cells.size()));
+
+  uint64_t num_explosions = *r.get<uint64_t>();
+  const explosion_info* explosions = r.get<explosion_info>(num_explosions);
+  l.pending_explosions.assign(explosions, explosions + num_explosions);
+
+  // the constructor tracked winnability for an empty level
+  l.recompute_winnability();
+  return l;
+}
+
+// compressed levels are coded as a single range-coder stream containing:
+//   w, h, player_x, player_y, num_items_remaining, num_red_bombs,
+//     frames_executed, num_explosions
+//   for each pending explosion: frame, x, y, size, type
+//   the cells in row-major order, as runs of identical (type, param) pairs.
+//     for each run, the type is coded in the context of the previous run's
+//     type, then the param is coded as a flag (same as the last param seen for
+//     this type) or an explicit value, then the run length.
+// levels are mostly long runs of a few types with a few distinct params, so
+// this typically needs a few hundred bytes per level.
+
+struct level_coding_models {
+  integer_model header;
+  bit_tree_model<6> types[64];
+  uint16_t same_param_probs[64];
+  int32_t last_params[64];
+  integer_model param;
+  integer_model run_length;
+
+  level_coding_models() {
+    for (size_t x = 0; x < 64; x++) {
+      this->same_param_probs[x] = 1024;
+      this->last_params[x] = 0;
+    }
+  }
+};
+
+string compress_level(const level_state& l) {
+  range_encoder enc;
+  level_coding_models m;
+
+  m.header.encode(enc, l.w);
+  m.header.encode(enc, l.h);
+  m.header.encode(enc, zigzag_encode(l.player_x));
+  m.header.encode(enc, zigzag_encode(l.player_y));
+  m.header.encode(enc, zigzag_encode(l.num_items_remaining));
+  m.header.encode(enc, zigzag_encode(l.num_red_bombs));
+  m.header.encode(enc, l.frames_executed);
+  m.header.encode(enc, l.pending_explosions.size());
+  for (const explosion_info& e : l.pending_explosions) {
+    m.header.encode(enc, e.frame);
+    m.header.encode(enc, zigzag_encode(e.x));
+    m.header.encode(enc, zigzag_encode(e.y));
+    m.header.encode(enc, zigzag_encode(e.size));
+    m.header.encode(enc, e.type);
+  }
+
+  size_t num_cells = l.cells.size();
+  uint32_t prev_type = Empty;
+  for (size_t x = 0; x < num_cells;) {
+    const cell_state& c = l.cells[x];
+    size_t run_end = x + 1;
+    for (; (run_end < num_cells) && (l.cells[run_end].type == c.type) &&
+           (l.cells[run_end].param == c.param); run_end++);
+
+    m.types[prev_type].encode(enc, c.type);
+    if (c.param == m.last_params[c.type]) {
+      enc.encode_bit(m.same_param_probs[c.type], true);
+    } else {
+      enc.encode_bit(m.same_param_probs[c.type], false);
+      m.param.encode(enc, zigzag_encode(c.param));
+      m.last_params[c.type] = c.param;
+    }
+    m.run_length.encode(enc, run_end - x - 1);
+
+    prev_type = c.type;
+    x = run_end;
+  }
+
+  return enc.finish();
+}
+
+level_state decompress_level(const void* data, size_t size) {
+  range_decoder dec(data, size);
+  level_coding_models m;
+
+  uint64_t w = m.header.decode(dec);
+  uint64_t h = m.header.decode(dec);
+  if (!w || !h || (w > MAX_LEVEL_CELLS) || (h > MAX_LEVEL_CELLS) ||
+      (w * h > MAX_LEVEL_CELLS)) {
+    throw runtime_error("compressed level has invalid dimensions");
+  }
+
+  level_state l(w, h, -1, -1);
+  l.player_x = zigzag_decode(m.header.decode(dec));
+  l.player_y = zigzag_decode(m.header.decode(dec));
+  l.num_items_remaining = zigzag_decode(m.header.decode(dec));
+  l.num_red_bombs = zigzag_decode(m.header.decode(dec));
+  l.frames_executed = m.header.decode(dec);
+  uint64_t num_explosions = m.header.decode(dec);
+  for (uint64_t x = 0; (x < num_explosions) && !dec.overran(); x++) {
+    uint64_t frame = m.header.decode(dec);
+    int32_t ex = zigzag_decode(m.header.decode(dec));
+    int32_t ey = zigzag_decode(m.header.decode(dec));
+    int32_t esize = zigzag_decode(m.header.decode(dec));
+    explosion_type etype = static_cast<explosion_type>(m.header.decode(dec));
+    l.pending_explosions.emplace_back(frame, ex, ey, esize, etype);
+  }
+
+  size_t num_cells = l.cells.size();
+  uint32_t prev_type = Empty;
+  for (size_t x = 0; x < num_cells;) {
+    uint32_t type = m.types[prev_type].decode(dec);
+    if (type > WhiteBomb) {
+      throw runtime_error("compressed level contains an invalid cell type");
+    }
+    if (!dec.decode_bit(m.same_param_probs[type])) {
+      m.last_params[type] = zigzag_decode(m.param.decode(dec));
+    }
+    uint64_t run_length = m.run_length.decode(dec) + 1;
+    if (dec.overran() || (run_length > num_cells - x)) {
+      throw runtime_error("compressed level data is corrupt");
+    }
+
+    cell_state c(static_cast<cell_type>(type), m.last_params[type]);
+    for (size_t end = x + run_length; x < end; x++) {
+      l.cells[x] = c;
+    }
+    prev_type = type;
+  }
+
+  if (dec.overran()) {
+    throw runtime_error("compressed level data is truncated");
+  }
+  l.recompute_winnability();
+  return l;
+}
+
+
+
+level_pack::level_pack() : file_version(0) { }
+
+level_pack::level_pack(const string& filename) :
+    file(new mapped_file(filename)) {
+  mapped_reader r(this->file->data(), this->file->size());
+
+  this->file_version = *r.get<uint64_t>();
+  if (this->file_version == 0) {
+    // version 0 has no directory, so walk the entire file once to find where
+    // each level starts and make sure nothing is truncated; after this,
+    // decoding a level can't run off the end
+    uint64_t num_levels = *r.get<uint64_t>();
+    for (uint64_t x = 0; x < num_levels; x++) {
+      level_entry e;
+      e.offset = r.where();
+      const level_header_v0* header = r.get<level_header_v0>();
+      if (!header->w || !header->h) {
+        throw runtime_error(string_printf("level %" PRIu64 " is empty", x));
+      }
+      r.get<packed_cell>(static_cast<size_t>(header->w) * header->h);
+      uint64_t num_explosions = *r.get<uint64_t>();
+      r.get<explosion_info>(num_explosions);
+      e.size = r.where() - e.offset;
+      e.checksum = fnv1a64(this->file->data() + e.offset, e.size);
+      e.w = header->w;
+      e.h = header->h;
+      e.num_items_remaining = header->num_items_remaining;
+      e.replaced = false;
+      this->directory.emplace_back(e);
+    }
+
+  } else if (this->file_version == 1) {
+    r.go(*r.get<uint64_t>());
+    uint64_t num_levels = *r.get<uint64_t>();
+    const level_directory_entry_v1* entries =
+        r.get<level_directory_entry_v1>(num_levels);
+    for (uint64_t x = 0; x < num_levels; x++) {
+      if ((entries[x].offset > this->file->size()) ||
+          (entries[x].size > this->file->size() - entries[x].offset)) {
+        throw runtime_error(string_printf(
+            "level %" PRIu64 " extends beyond end of file", x));
+      }
+      level_entry e;
+      e.offset = entries[x].offset;
+      e.size = entries[x].size;
+      e.checksum = entries[x].checksum;
+      e.w = entries[x].w;
+      e.h = entries[x].h;
+      e.num_items_remaining = entries[x].num_items_remaining;
+      e.replaced = false;
+      this->directory.emplace_back(e);
+    }
+
+  } else {
+    throw runtime_error("unsupported file version");
+  }
+
+  this->decoded_levels.resize(this->directory.size());
+}
+
+size_t level_pack::size() const {
+  return this->directory.size();
+}
+
+const level_template& level_pack::operator[](size_t index) const {
+  return *this->get(index);
+}
+
+shared_ptr<const level_template> level_pack::get(size_t index) const {
+  auto& t = this->decoded_levels.at(index);
+  if (!t) {
+    t = make_shared<const level_template>(this->decode(index));
+  }
+  return t;
+}
+
+level_state level_pack::decode(size_t index) const {
+  const auto& t = this->decoded_levels.at(index);
+  if (t) {
+    return t->instantiate();
+  }
+  const level_entry& e = this->directory[index];
+  const uint8_t* data = this->file->data() + e.offset;
+  if (this->file_version == 0) {
+    return decode_level_v0(data, e.size);
+  }
+  if (fnv1a64(data, e.size) != e.checksum) {
+    throw runtime_error(string_printf("level %zu is corrupt", index));
+  }
+  return decompress_level(data, e.size);
+}
+
+vector<level_state> level_pack::decode_all() const {
+  vector<level_state> ret;
+  ret.reserve(this->size());
+  for (size_t x = 0; x < this->size(); x++) {
+    ret.emplace_back(this->decode(x));
+  }
+  return ret;
+}
+
+void level_pack::replace(size_t index, const level_state& l) {
+  this->decoded_levels.at(index) = make_shared<const level_template>(l);
+  this->directory[index].replaced = true;
+}
+
+level_pack level_pack::snapshot() const {
+  level_pack ret;
+  ret.file = this->file;
+  ret.file_version = this->file_version;
+  ret.directory = this->directory;
+  ret.decoded_levels = this->decoded_levels;
+  return ret;
+}
+
+vector<int64_t> level_pack::update(level_pack&& newer) {
+  // a level whose data is byte-for-byte the same as one in this pack is that
+  // level, and any copy of it we've already decoded (or replaced) is still
+  // good. this finds most levels without decoding anything
+  bool same_encoding = (this->file_version == newer.file_version);
+  unordered_map<uint64_t, size_t> old_index_for_checksum;
+  if (same_encoding) {
+    for (size_t y = 0; y < this->size(); y++) {
+      old_index_for_checksum.emplace(this->directory[y].checksum, y);
+    }
+  }
+
+  // the rest may just be encoded differently (e.g. the pack was upgraded from
+  // version 0), so compare their decoded contents. this needs every level in
+  // this pack decoded, so it's only built if some level needs it
+  unordered_map<uint64_t, size_t> old_index_for_hash;
+  bool old_hashes_computed = false;
+
+  vector<int64_t> old_indexes(newer.size(), -1);
+  for (size_t x = 0; x < newer.size(); x++) {
+    level_entry& new_e = newer.directory[x];
+
+    // prefer the level in the same position, so duplicate levels stay put
+    int64_t y = -1;
+    if (same_encoding) {
+      if ((x < this->size()) && (this->directory[x].checksum == new_e.checksum)) {
+        y = x;
+      } else {
+        auto it = old_index_for_checksum.find(new_e.checksum);
+        if (it != old_index_for_checksum.end()) {
+          y = it->second;
+        }
+      }
+      if ((y >= 0) && (this->directory[y].size != new_e.size)) {
+        y = -1;
+      }
+      if (y >= 0) {
+        new_e.replaced = this->directory[y].replaced;
+      }
+    }
+
+    if (y < 0) {
+      auto new_t = make_shared<const level_template>(newer.decode(x));
+      if (!old_hashes_computed) {
+        for (size_t z = 0; z < this->size(); z++) {
+          old_index_for_hash.emplace(this->get(z)->hash(), z);
+        }
+        old_hashes_computed = true;
+      }
+      if ((x < this->size()) && (this->get(x)->hash() == new_t->hash())) {
+        y = x;
+      } else {
+        auto it = old_index_for_hash.find(new_t->hash());
+        if (it != old_index_for_hash.end()) {
+          y = it->second;
+        }
+      }
+      if (y < 0) {
+        newer.decoded_levels[x] = move(new_t);
+        continue;
+      }
+    }
+
+    newer.decoded_levels[x] = this->decoded_levels[y];
+    old_indexes[x] = y;
+  }
+
+  *this = move(newer);
+  return old_indexes;
+}
+
+
+
+vector<level_state> load_levels(const char* filename) {
+  return level_pack(filename).decode_all();
+}
+
+// the old file may still be mapped by a level_pack, so the save functions
+// never overwrite any level data or directory that's already in it.
+// save_levels and compact_levels write a new file and rename it over the old
+// one; save_level only appends to the file and then changes the header's
+// directory_offset, which a level_pack reads only when it's opened
+
+static uint64_t align8(uint64_t offset) {
+  return (offset + 7) & ~7ULL;
+}
+
+// serializes the directory to be appended at the given offset: the level count
+// and entries, preceded by padding so the directory starts at align8(offset)
+// and can be used directly from a mapping
+static string build_directory_v1(uint64_t offset,
+    const vector<level_directory_entry_v1>& entries) {
+  string data(align8(offset) - offset, '\0');
+  uint64_t num_levels = entries.size();
+  data.append(reinterpret_cast<const char*>(&num_levels), sizeof(num_levels));
+  data.append(reinterpret_cast<const char*>(entries.data()),
+      entries.size() * sizeof(level_directory_entry_v1));
+  return data;
+}
+
+// level data is buffered up to this size before being written
+static const size_t PACK_WRITE_BUFFER_SIZE = 0x100000;
+
+level_pack_writer::level_pack_writer(const string& filename) :
+    filename(filename), temp_filename(filename + ".tmp"),
+    fd(new fd_guard(open(this->temp_filename.c_str(),
+      O_WRONLY | O_CREAT | O_TRUNC, 0644))),
+    offset(sizeof(level_pack_header_v1)) {
+  if (this->fd->get() < 0) {
+    throw cannot_open_file(this->temp_filename);
+  }
+  // the header is written last, when the directory offset is known
+}
+
+level_pack_writer::~level_pack_writer() {
+  if (this->fd) {
+    this->fd.reset();
+    unlink(this->temp_filename.c_str());
+  }
+}
+
+size_t level_pack_writer::size() const {
+  return this->directory_entries.size() / sizeof(level_directory_entry_v1);
+}
+
+void level_pack_writer::add(const level_state& l) {
+  string compressed = compress_level(l);
+  this->add_compressed(compressed.data(), compressed.size(),
+      fnv1a64(compressed.data(), compressed.size()), l.w, l.h,
+      l.num_items_remaining);
+}
+
+void level_pack_writer::add(const level_pack& pack, size_t index) {
+  const level_pack::level_entry& e = pack.directory.at(index);
+  if ((pack.file_version != 1) || pack.decoded_levels[index]) {
+    this->add(pack.decode(index));
+    return;
+  }
+
+  const uint8_t* data = pack.file->data() + e.offset;
+  if (fnv1a64(data, e.size) != e.checksum) {
+    throw runtime_error(string_printf("level %zu is corrupt", index));
+  }
+  this->add_compressed(data, e.size, e.checksum, e.w, e.h,
+      e.num_items_remaining);
+}
+
+void level_pack_writer::add_compressed(const void* data, size_t size,
+    uint64_t checksum, uint32_t w, uint32_t h, int32_t num_items_remaining) {
+  if (!this->fd) {
+    throw logic_error("level pack is already finished");
+  }
+
+  level_directory_entry_v1 e;
+  e.offset = this->offset;
+  e.checksum = checksum;
+  e.size = size;
+  e.w = w;
+  e.h = h;
+  e.num_items_remaining = num_items_remaining;
+  this->directory_entries.append(reinterpret_cast<const char*>(&e), sizeof(e));
+
+  this->pending.append(reinterpret_cast<const char*>(data), size);
+  this->offset += size;
+  if (this->pending.size() >= PACK_WRITE_BUFFER_SIZE) {
+    this->flush_pending();
+  }
+}
+
+void level_pack_writer::flush_pending() {
+  pwrite_all(this->fd->get(), this->pending.data(), this->pending.size(),
+      this->offset - this->pending.size());
+  this->pending.clear();
+}
+
+void level_pack_writer::finish() {
+  if (!this->fd) {
+    throw logic_error("level pack is already finished");
+  }
+
+  level_pack_header_v1 header;
+  header.file_version = 1;
+  header.directory_offset = align8(this->offset);
+
+  uint64_t num_levels = this->size();
+  this->pending.append(header.directory_offset - this->offset, '\0');
+  this->pending.append(reinterpret_cast<const char*>(&num_levels),
+      sizeof(num_levels));
+  this->offset = header.directory_offset + sizeof(num_levels);
+  this->flush_pending();
+  pwrite_all(this->fd->get(), this->directory_entries.data(),
+      this->directory_entries.size(), this->offset);
+  pwrite_all(this->fd->get(), &header, sizeof(header), 0);
+  fsync(this->fd->get());
+
+  this->fd.reset();
+  if (rename(this->temp_filename.c_str(), this->filename.c_str())) {
+    unlink(this->temp_filename.c_str());
+    throw runtime_error("can\'t rename " + this->temp_filename + " to " +
+        this->filename);
+  }
+}
+
+static void save_levels_v1(size_t num_levels,
+    function<const level_state&(size_t)> get_level, const char* filename) {
+  level_pack_writer w(filename);
+  for (size_t x = 0; x < num_levels; x++) {
+    w.add(get_level(x));
+  }
+  w.finish();
+}
+
+static vector<level_directory_entry_v1> read_directory_v1(int fd,
+    const level_pack_header_v1& header, size_t file_size) {
+  uint64_t num_levels;
+  pread_all(fd, &num_levels, sizeof(num_levels), header.directory_offset);
+  if (num_levels > (file_size - header.directory_offset) / sizeof(level_directory_entry_v1)) {
+    throw runtime_error("level directory extends beyond end of file");
+  }
+  vector<level_directory_entry_v1> entries(num_levels);
+  pread_all(fd, entries.data(), entries.size() * sizeof(level_directory_entry_v1),
+      header.directory_offset + sizeof(num_levels));
+  return entries;
+}
+
+// all writes to packs from this process go through this lock, so a background
+// compaction can't lose a level that's saved while it's running
+static mutex pack_write_lock;
+
+void save_levels(const vector<level_state>& levels, const char* filename) {
+  lock_guard<mutex> g(pack_write_lock);
+  save_levels_v1(levels.size(), [&](size_t index) -> const level_state& {
+    return levels[index];
+  }, filename);
+}
+
+void save_levels(const level_pack& levels, const char* filename) {
+  lock_guard<mutex> g(pack_write_lock);
+  // levels that haven't been replaced are copied without decoding them
+  level_pack_writer w(filename);
+  for (size_t x = 0; x < levels.size(); x++) {
+    w.add(levels, x);
+  }
+  w.finish();
+}
+
+void save_level(const char* filename, size_t index, const level_state& l) {
+  lock_guard<mutex> g(pack_write_lock);
+
+  fd_guard fd(open(filename, O_RDWR));
+  if (fd.get() < 0) {
+    throw cannot_open_file(filename);
+  }
+  size_t file_size = fstat(fd.get()).st_size;
+
+  level_pack_header_v1 header;
+  pread_all(fd.get(), &header, sizeof(header), 0);
+  if (header.file_version != 1) {
+    // older packs can't be updated in place; rewrite the whole thing, which
+    // also upgrades it so the next save is cheap
+    vector<level_state> levels = load_levels(filename);
+    if (index > levels.size()) {
+      throw out_of_range("level index out of range");
+    } else if (index == levels.size()) {
+      levels.emplace_back(l);
+    } else {
+      levels[index] = l;
+    }
+    save_levels_v1(levels.size(), [&](size_t index) -> const level_state& {
+      return levels[index];
+    }, filename);
+    return;
+  }
+
+  vector<level_directory_entry_v1> entries = read_directory_v1(fd.get(),
+      header, file_size);
+  if (index > entries.size()) {
+    throw out_of_range("level index out of range");
+  } else if (index == entries.size()) {
+    entries.emplace_back();
+  }
+
+  string compressed = compress_level(l);
+  level_directory_entry_v1& e = entries[index];
+  e.offset = file_size;
+  e.checksum = fnv1a64(compressed.data(), compressed.size());
+  e.size = compressed.size();
+  e.w = l.w;
+  e.h = l.h;
+  e.num_items_remaining = l.num_items_remaining;
+
+  uint64_t new_directory_offset = align8(file_size + compressed.size());
+  compressed += build_directory_v1(file_size + compressed.size(), entries);
+
+  // the new data must be durable before the header points to it
+  pwrite_all(fd.get(), compressed.data(), compressed.size(), file_size);
+  fsync(fd.get());
+
+  header.directory_offset = new_directory_offset;
+  pwrite_all(fd.get(), &header.directory_offset, sizeof(header.directory_offset),
+      offsetof(level_pack_header_v1, directory_offset));
+  fsync(fd.get());
+}
+
+bool compact_levels(const char* filename, double min_garbage_fraction) {
+  lock_guard<mutex> g(pack_write_lock);
+
+  string data;
+  {
+    fd_guard fd(open(filename, O_RDONLY));
+    if (fd.get() < 0) {
+      throw cannot_open_file(filename);
+    }
+    size_t file_size = fstat(fd.get()).st_size;
+
+    level_pack_header_v1 header;
+    pread_all(fd.get(), &header, sizeof(header), 0);
+    if (header.file_version != 1) {
+      return false;
+    }
+    vector<level_directory_entry_v1> entries = read_directory_v1(fd.get(),
+        header, file_size);
+
+    size_t live_size = sizeof(header) + sizeof(uint64_t) +
+        entries.size() * sizeof(level_directory_entry_v1);
+    for (const auto& e : entries) {
+      live_size += e.size;
+    }
+    if (file_size - live_size < file_size * min_garbage_fraction) {
+      return false;
+    }
+
+    // the level data is copied verbatim; nothing needs to be decoded
+    data.assign(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (auto& e : entries) {
+      size_t new_offset = data.size();
+      data.resize(new_offset + e.size);
+      pread_all(fd.get(), &data[new_offset], e.size, e.offset);
+      e.offset = new_offset;
+    }
+
+    header.directory_offset = align8(data.size());
+    memcpy(&data[0], &header, sizeof(header));
+    data += build_directory_v1(data.size(), entries);
+  }
+
+  save_file_atomic(filename, data);
+  return true;
+}
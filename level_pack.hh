@@ -0,0 +1,138 @@
+#ifndef __LEVEL_PACK_H
+#define __LEVEL_PACK_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "file_io.hh"
+#include "level.hh"
+
+
+// a level pack (.mbl file) opened for reading. the file is mapped and its
+// structure is validated in a single pass when the pack is opened, but the
+// levels themselves aren't decoded until they're first used. both the original
+// uncompressed format (version 0) and the compressed format with a level
+// directory (version 1) can be read; save_levels always writes version 1.
+class level_pack {
+public:
+  level_pack();
+  explicit level_pack(const std::string& filename);
+  level_pack(const level_pack&) = delete;
+  level_pack(level_pack&&) = default;
+  level_pack& operator=(const level_pack&) = delete;
+  level_pack& operator=(level_pack&&) = default;
+  ~level_pack() = default;
+
+  size_t size() const;
+
+  // returns the decoded level, decoding it on first use. the reference is
+  // invalidated if the level is replaced or the pack is updated, but templates
+  // are immutable, so the pointer from get() can be kept (or handed to another
+  // thread) for as long as it's needed. not thread-safe; use decode() from
+  // worker threads instead
+  const level_template& operator[](size_t index) const;
+  std::shared_ptr<const level_template> get(size_t index) const;
+
+  // decodes the level without caching it. safe to call from multiple threads
+  level_state decode(size_t index) const;
+  std::vector<level_state> decode_all() const;
+
+  // replaces a level in memory only; use save_levels to write it out
+  void replace(size_t index, const level_state& l);
+
+  // a copy that shares this pack's file and decoded levels, both of which are
+  // immutable, so it's cheap to make. the copy can be used on another thread
+  // while this one is still in use (e.g. for update())
+  level_pack snapshot() const;
+
+  // switches to a newer version of this pack (e.g. after another program
+  // changed the file), keeping the already-decoded copies of levels that are
+  // also in the newer version, including ones changed in memory with
+  // replace(). levels are matched by content rather than position, so
+  // inserting or removing a level doesn't make the ones after it look changed.
+  // levels whose encoded data isn't in this pack are decoded to compare them,
+  // which can take a while, so call this on a snapshot() on a background
+  // thread. returns, for each level in the new version, its index in this
+  // version, or -1 if it's new or changed
+  std::vector<int64_t> update(level_pack&& newer);
+
+private:
+  friend class level_pack_writer;
+
+  struct level_entry {
+    size_t offset;
+    size_t size;
+    uint64_t checksum; // fnv1a64 of the level's data in the file
+    uint32_t w;
+    uint32_t h;
+    int32_t num_items_remaining;
+    bool replaced; // the level was changed with replace(), so the data is stale
+  };
+
+  std::shared_ptr<mapped_file> file;
+  uint64_t file_version;
+  std::vector<level_entry> directory;
+  mutable std::vector<std::shared_ptr<const level_template>> decoded_levels;
+};
+
+// the compressed representation of a single level used in version 1 packs.
+// only the level's layout and counters are stored, not its runtime state
+std::string compress_level(const level_state& l);
+level_state decompress_level(const void* data, size_t size);
+
+// writes a version 1 pack one level at a time. level data goes straight to a
+// temporary file and only the directory is kept in memory, so packs of any
+// size can be written without holding their levels. nothing replaces the
+// destination until finish() is called; if the writer is destroyed before
+// then, the temporary file is deleted. callers must not write the same file
+// concurrently with save_level or compact_levels.
+class level_pack_writer {
+public:
+  explicit level_pack_writer(const std::string& filename);
+  level_pack_writer(const level_pack_writer&) = delete;
+  level_pack_writer& operator=(const level_pack_writer&) = delete;
+  ~level_pack_writer();
+
+  size_t size() const;
+
+  void add(const level_state& l);
+  // copies a level from another pack. levels from version 1 packs are copied
+  // verbatim without being decoded, unless they were replaced in memory
+  void add(const level_pack& pack, size_t index);
+
+  // writes the directory and renames the file into place
+  void finish();
+
+private:
+  void add_compressed(const void* data, size_t size, uint64_t checksum,
+      uint32_t w, uint32_t h, int32_t num_items_remaining);
+  void flush_pending();
+
+  std::string filename;
+  std::string temp_filename;
+  std::unique_ptr<fd_guard> fd; // NULL once finished
+  uint64_t offset; // where the next level's data will be written
+  std::string pending; // data not yet written to the file
+  // the directory entries written so far, in their on-disk format
+  std::string directory_entries;
+};
+
+std::vector<level_state> load_levels(const char* filename);
+void save_levels(const std::vector<level_state>& levels, const char* filename);
+void save_levels(const level_pack& levels, const char* filename);
+
+// replaces a single level in a pack on disk (or appends one, if index is the
+// number of levels in the pack) by writing only that level's data and a new
+// directory. the update is atomic with respect to crashes; see level_pack.cc
+void save_level(const char* filename, size_t index, const level_state& l);
+
+// rewrites the pack without the level data left behind by save_level, if at
+// least min_garbage_fraction of the file is garbage. returns true if the pack
+// was rewritten. safe to call from a background thread while save_level or
+// save_levels are called from another thread
+bool compact_levels(const char* filename, double min_garbage_fraction = 0.5);
+
+#endif // __LEVEL_PACK_H
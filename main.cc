@@ -1,4 +1,5 @@
 #include <inttypes.h>
+#include <math.h>
 #include <pwd.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -15,8 +16,11 @@
 
 #include <GLFW/glfw3.h>
 
+#include <algorithm>
 #include <deque>
 #include <list>
+#include <memory>
+#include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
 #include <phosg/Time.hh>
 #include <phosg-audio/Sound.hh>
@@ -24,9 +28,19 @@
 #include <string>
 #include <vector>
 
+#include "action_buffer.hh"
+#include "activity.hh"
+#include "catalog.hh"
+#include "file_io.hh"
 #include "gl_text.hh"
+#include "hint.hh"
+#include "io_queue.hh"
 #include "level.hh"
 #include "level_completion.hh"
+#include "level_pack.hh"
+#include "path_planner.hh"
+#include "recording.hh"
+#include "session.hh"
 
 using namespace std;
 
@@ -419,8 +433,94 @@ static void render_level_state(const level_state& l, int window_w, int window_h,
 
 
 
+static void render_hint(const hint* h, bool searching, const level_state& l,
+    int window_w, int window_h) {
+  float aspect_ratio = (float)window_w / window_h;
+  if (!h) {
+    draw_text(-0.99, 0.97, 0.5, 0.8, 1, 1, aspect_ratio, 0.01, false,
+        searching ? "hint: thinking..." : "hint: nothing found nearby");
+    return;
+  }
+
+  // mark where the player goes, fading out along the way, with the next few
+  // steps brighter than the rest
+  glBegin(GL_QUADS);
+  for (size_t x = 0; x < h->player_positions.size(); x++) {
+    const auto& pos = h->player_positions[x];
+    float alpha = (x < 5) ? 0.7f : (0.5f - 0.3f * x / h->player_positions.size());
+    glColor4f(0.5, 0.8, 1.0, alpha);
+    float x1 = to_window(pos.first + 0.3, l.w);
+    float x2 = to_window(pos.first + 0.7, l.w);
+    float y1 = to_window(pos.second + 0.3, l.h);
+    float y2 = to_window(pos.second + 0.7, l.h);
+    glVertex3f(x1, -y1, 1);
+    glVertex3f(x2, -y1, 1);
+    glVertex3f(x2, -y2, 1);
+    glVertex3f(x1, -y2, 1);
+  }
+  glEnd();
+
+  draw_text(-0.99, 0.97, 0.5, 0.8, 1, 1, aspect_ratio, 0.01, false,
+      "hint: %zu frame%s to %s", h->actions.size(), plural(h->actions.size()),
+      h->wins ? "the exit" : "the next item");
+}
+
+static void render_path_target(const path_planner& p, const level_state& l,
+    int window_w, int window_h) {
+  if (p.active()) {
+    auto target = p.target();
+    float x1 = to_window(target.first + 0.2, l.w);
+    float x2 = to_window(target.first + 0.8, l.w);
+    float y1 = to_window(target.second + 0.2, l.h);
+    float y2 = to_window(target.second + 0.8, l.h);
+    glBegin(GL_LINE_LOOP);
+    glColor4f(1.0, 1.0, 0.5, 0.8);
+    glVertex3f(x1, -y1, 1);
+    glVertex3f(x2, -y1, 1);
+    glVertex3f(x2, -y2, 1);
+    glVertex3f(x1, -y2, 1);
+    glEnd();
+  }
+
+  draw_text(-0.99, 0.83, 1, 1, 0.5, 1, (float)window_w / window_h, 0.01,
+      false, "click to move (m: turn off)");
+}
+
+static void render_activity_overlay(const activity_counters& a,
+    activity_plane plane, int window_w, int window_h) {
+  uint32_t max_count = a.max_count(plane);
+  if (max_count) {
+    // on a log scale, so cells that only change now and then still show up
+    // next to the busiest ones
+    float scale = 0.7f / log1p(max_count);
+    glBegin(GL_QUADS);
+    for (uint32_t y = 0; y < a.h; y++) {
+      for (uint32_t x = 0; x < a.w; x++) {
+        uint32_t count = a.planes[plane][y * a.w + x];
+        if (!count) {
+          continue;
+        }
+        glColor4f(1.0, 0.3, 0.0, scale * log1p(count));
+        float x1 = to_window(x, a.w);
+        float x2 = to_window(x + 1, a.w);
+        float y1 = to_window(y, a.h);
+        float y2 = to_window(y + 1, a.h);
+        glVertex3f(x1, -y1, 1);
+        glVertex3f(x2, -y1, 1);
+        glVertex3f(x2, -y2, 1);
+        glVertex3f(x1, -y2, 1);
+      }
+    }
+    glEnd();
+  }
+
+  draw_text(-0.99, 0.76, 1, 0.5, 0.2, 1, (float)window_w / window_h, 0.01,
+      false, "activity: %s (at most %u in a cell over %llu frames; a: next)",
+      name_for_activity_plane(plane), max_count, a.frames);
+}
+
 static void render_key_commands(float aspect_ratio, bool should_play_sounds,
-    bool show_stats) {
+    bool show_stats, bool show_hints) {
   draw_text(0, -0.4, 1, 1, 1, 1, aspect_ratio, 0.01, true,
       "shift+i: how to play");
   draw_text(0, -0.5, 1, 1, 1, 1, aspect_ratio, 0.01, true,
@@ -430,6 +530,8 @@ static void render_key_commands(float aspect_ratio, bool should_play_sounds,
   draw_text(0, -0.7, 1, 1, 1, 1, aspect_ratio, 0.01, true,
       "x: %s stats", show_stats ? "hide" : "show");
   draw_text(0, -0.8, 1, 1, 1, 1, aspect_ratio, 0.01, true,
+      "h: %s hints", show_hints ? "hide" : "show");
+  draw_text(0, -0.9, 1, 1, 1, 1, aspect_ratio, 0.01, true,
       "esc: restart level / exit");
 }
 
@@ -453,7 +555,7 @@ static void render_level_stats(const level_completion& lc, float aspect_ratio) {
 static void render_paused_screen(int window_w, int window_h,
     const vector<level_completion>& completion, int level_index,
     bool player_did_win, bool player_did_lose, uint64_t frames_executed,
-    bool should_play_sounds, bool show_stats) {
+    bool should_play_sounds, bool show_stats, bool show_hints) {
 
   size_t num_completed = 0;
   for (const auto& it : completion)
@@ -498,7 +600,8 @@ static void render_paused_screen(int window_w, int window_h,
     } else {
       draw_text(0, 0.1, 1, 0.5, 0.5, 1, aspect_ratio, 0.01, true,
           "You haven\'t completed this level yet (%lu/%lu)", num_completed, completion.size());
-      render_key_commands(aspect_ratio, should_play_sounds, show_stats);
+      render_key_commands(aspect_ratio, should_play_sounds, show_stats,
+          show_hints);
     }
   }
 }
@@ -529,6 +632,7 @@ static void render_instructions_page(int window_w, int window_h, int page_num) {
     draw_text(0, -0.6,   1,   1,   1, 1, aspect_ratio, 0.01, true, "tab: toggle speed (slow/fast)");
     draw_text(0, -0.7,   1,   1,   1, 1, aspect_ratio, 0.01, true, "enter: pause");
     draw_text(0, -0.8,   1,   1,   1, 1, aspect_ratio, 0.01, true, "esc: restart level / exit");
+    draw_text(0, -0.9,   1,   1,   1, 1, aspect_ratio, 0.01, true, "shift+1-9: quick-save to slot / 1-9: quick-load from slot");
 
   } else if (page_num == 1) {
     draw_text(    0,  0.6,   1,   1,   1, 1, aspect_ratio, 0.01, true, "Some objects you might encounter:");
@@ -650,22 +754,59 @@ enum game_phase {
   Editing,
 };
 
+// how far the left and right keys skip in replays (10 seconds at normal speed)
+static const int64_t REPLAY_SEEK_FRAMES = 200;
+
 string levels_filename = "";
 string recordings_directory = "";
+string catalog_directory = "";
+// only used on the I/O thread
+unique_ptr<recording_catalog> catalog;
 string last_recording_filename = "";
-vector<level_state> initial_state;
+level_pack initial_state;
+// notices when another program changes the level pack; the new version is
+// opened and compared with a snapshot of initial_state on the I/O thread, then
+// swapped in by the frame loop
+unique_ptr<file_watcher> levels_watcher;
+shared_ptr<level_pack> reloaded_levels;
+vector<int64_t> reloaded_level_old_indexes; // see level_pack::update
+// incremented by every initial_state.replace(), so a reload that started from
+// an older snapshot can be thrown away and done again
+uint64_t initial_state_replace_count = 0;
 level_state game;
 game_phase phase = Paused;
 bool show_stats = false;
+// hints are looked for from the state the player was in when they last moved
+// (or started or rewound); these describe that state
+hint_engine hints;
+bool show_hints = false;
+bool hint_needs_request = false;
+int hint_level_index = -1;
+uint64_t hint_frame = 0;
+int32_t hint_player_x = -1, hint_player_y = -1;
+// in click-to-move mode, clicking on a cell walks the player there one step at
+// a time through recent_impulses. any arrow key takes back control
+path_planner player_path;
+bool click_to_move = false;
+// the activity overlay shows one plane of counters (see activity.hh), counted
+// only while it's visible. they add up over restarts of the same level, and
+// start over when the level changes
+activity_counters game_activity;
+int game_activity_level_index = -1;
+int activity_overlay_plane = -1; // -1 when it's off
 bool player_did_lose = false;
 bool should_reload_state = false;
 bool should_play_sounds = true;
 bool player_will_drop_bomb = false;
 deque<enum player_impulse> recent_impulses;
-deque<struct player_actions> current_recording;
+action_buffer current_recording;
+vector<recording_keyframe> current_keyframes;
 enum player_impulse current_impulse = None;
 int level_index = -1;
 int should_change_to_level = -1;
+int should_save_session_slot = -1;
+int should_load_session_slot = -1;
+int64_t should_seek_replay_frames = 0;
 int current_instructions_page = 0;
 
 int mouse_x, mouse_y;
@@ -674,6 +815,255 @@ int editor_highlight_x = 0, editor_highlight_y = 0;
 const editor_cell_definition* editor_selected_cell_type = NULL;
 bool editor_drawing = false;
 
+// all file writes (and loads requested during play) go through this queue so
+// the frame loop never waits for the filesystem. it's declared after
+// everything its jobs use, so that on exit it's destroyed (which runs the jobs
+// still waiting) before any of them are
+io_queue io;
+
+
+
+// slot -1 is the automatic save made on exit
+static string session_filename(int slot) {
+  if (slot < 0) {
+    return recordings_directory + "/autosave.mbs";
+  }
+  return string_printf("%s/slot_%d.mbs", recordings_directory.c_str(), slot);
+}
+
+struct loaded_session {
+  bool found;
+  uint64_t level_index;
+  uint64_t level_hash;
+  level_state game;
+  action_buffer recording;
+  string error; // empty if the session was loaded
+
+  loaded_session() : found(true), level_index(0), level_hash(0) { }
+};
+
+static void load_session_file(const string& filename, loaded_session& s) {
+  try {
+    load_session(filename, &s.level_index, &s.level_hash, s.game,
+        s.recording);
+  } catch (const cannot_open_file&) {
+    s.found = false;
+  } catch (const runtime_error& e) {
+    s.error = e.what();
+  }
+}
+
+static bool apply_session(const string& filename, loaded_session& s) {
+  if (!s.found) {
+    return false;
+  }
+  if (!s.error.empty()) {
+    fprintf(stderr, "can\'t load session %s: %s\n", filename.c_str(),
+        s.error.c_str());
+    return false;
+  }
+
+  // the level pack may have been edited since the session was saved. resuming
+  // on a different version of the level would credit a win (and catalog the
+  // recording) for a level the player never won in its current form
+  if ((s.level_index >= initial_state.size()) ||
+      (s.level_hash != initial_state[s.level_index].hash())) {
+    fprintf(stderr, "session %s was saved on a level that has changed since\n",
+        filename.c_str());
+    return false;
+  }
+
+  level_index = s.level_index;
+  game = move(s.game);
+  current_recording = move(s.recording);
+  current_keyframes.clear();
+  recent_impulses.clear();
+  current_impulse = None;
+  player_will_drop_bomb = false;
+  player_path.clear();
+  player_did_lose = false;
+  phase = Paused;
+  return true;
+}
+
+// used at startup, before the frame loop is running
+static bool restore_session(const string& filename) {
+  loaded_session s;
+  load_session_file(filename, s);
+  return apply_session(filename, s);
+}
+
+static void restore_session_async(const string& filename) {
+  auto s = make_shared<loaded_session>();
+  io.enqueue("", [filename, s]() {
+    load_session_file(filename, *s);
+  }, [filename, s]() {
+    apply_session(filename, *s);
+  });
+}
+
+static void save_session_async(const string& filename) {
+  auto saved_game = make_shared<level_state>(game);
+  auto saved_recording = make_shared<action_buffer>(current_recording);
+  uint64_t saved_level_index = level_index;
+  uint64_t saved_level_hash = initial_state[level_index].hash();
+  io.enqueue(filename, [filename, saved_level_index, saved_level_hash,
+      saved_game, saved_recording]() {
+    try {
+      save_session(filename, saved_level_index, saved_level_hash, *saved_game,
+          *saved_recording);
+    } catch (const runtime_error& e) {
+      fprintf(stderr, "can\'t save session: %s\n", e.what());
+    }
+  });
+}
+
+// replaces the current recording with one that was loaded from a file.
+// recordings that carry a fingerprint are rejected if they were made on a
+// different level
+static bool use_recording_for_current_level(const string& filename,
+    recording_file& r) {
+  if (!r.matches_level(initial_state[level_index])) {
+    for (size_t x = 0; x < initial_state.size(); x++) {
+      if (r.matches_level(initial_state[x])) {
+        fprintf(stderr, "recording %s was made on level %zu, not level %d\n",
+            filename.c_str(), x, level_index);
+        return false;
+      }
+    }
+    fprintf(stderr, "recording %s was made on a level that isn\'t in this pack\n",
+        filename.c_str());
+    return false;
+  }
+
+  current_recording = move(r.actions);
+  current_keyframes = move(r.keyframes);
+  return true;
+}
+
+static void load_recording_async(const string& filename) {
+  auto r = make_shared<recording_file>();
+  auto error = make_shared<string>();
+  io.enqueue("", [filename, r, error]() {
+    try {
+      *r = load_recording_file(filename);
+    } catch (const exception& e) {
+      *error = e.what();
+    }
+  }, [filename, r, error]() {
+    if (!error->empty()) {
+      fprintf(stderr, "can\'t load recording %s: %s\n", filename.c_str(),
+          error->c_str());
+    } else {
+      use_recording_for_current_level(filename, *r);
+    }
+  });
+}
+
+// saves the current recording in the catalog and returns its filename.
+// saving the same recording again doesn't write anything
+static string save_recording_async() {
+  auto recording = make_shared<action_buffer>(current_recording);
+  // the template is shared, not copied; it's immutable, so the I/O thread can
+  // use it even if the level is edited or reloaded in the meantime
+  auto source_level = initial_state.get(level_index);
+  uint32_t saved_level_index = level_index;
+  string filename = catalog_recording_filename(catalog_directory,
+      recording_content_hash(*recording, source_level->hash()));
+  io.enqueue(filename, [recording, source_level, saved_level_index]() {
+    if (!catalog) {
+      return;
+    }
+    try {
+      catalog->add(*recording, source_level->instantiate(), saved_level_index);
+    } catch (const runtime_error& e) {
+      fprintf(stderr, "can\'t save recording: %s\n", e.what());
+    }
+  });
+  return filename;
+}
+
+// replaces the current recording with the fastest winning one in the catalog
+// for the current level, if there is one
+static void load_best_recording_async() {
+  auto source_level_hash = initial_state[level_index].hash();
+  auto r = make_shared<recording_file>();
+  auto filename = make_shared<string>();
+  auto error = make_shared<string>();
+  io.enqueue("", [source_level_hash, r, filename, error]() {
+    const catalog_entry* e = catalog ? catalog->best_for_level(source_level_hash) : NULL;
+    if (!e) {
+      *error = "there are no winning recordings for this level";
+      return;
+    }
+    *filename = catalog->recording_filename(e->content_hash);
+    try {
+      *r = load_recording_file(*filename);
+    } catch (const exception& e) {
+      *error = e.what();
+    }
+  }, [r, filename, error]() {
+    if (!error->empty()) {
+      fprintf(stderr, "can\'t load best recording: %s\n", error->c_str());
+    } else if (use_recording_for_current_level(*filename, *r)) {
+      last_recording_filename = *filename;
+    }
+  });
+}
+
+// opens the current version of the level pack and works out which levels
+// changed. this is queued behind any of our own writes to the pack, so it never
+// sees them half-done
+static void reload_levels_async() {
+  string filename = levels_filename;
+  auto pack = make_shared<level_pack>(initial_state.snapshot());
+  auto old_indexes = make_shared<vector<int64_t>>();
+  uint64_t replace_count = initial_state_replace_count;
+  io.enqueue("reload:" + filename, [filename, pack, old_indexes]() {
+    level_pack newer(filename);
+    if (newer.size() == 0) {
+      throw runtime_error(filename + " contains no levels");
+    }
+    *old_indexes = pack->update(move(newer));
+  }, [pack, old_indexes, replace_count]() {
+    if (replace_count != initial_state_replace_count) {
+      reload_levels_async();
+    } else if (!old_indexes->empty()) {
+      reloaded_levels = pack;
+      reloaded_level_old_indexes = move(*old_indexes);
+    }
+  });
+}
+
+// drops the keyframes after the given frame, since the recording may differ
+// from the saved one after that point
+static void truncate_keyframes(uint64_t frame) {
+  while (!current_keyframes.empty() && (current_keyframes.back().frame > frame)) {
+    current_keyframes.pop_back();
+  }
+}
+
+
+
+// appends the level's progress to the journal. a newer record for the same
+// level supersedes an older one, so pending appends for a level are coalesced.
+// the filename is empty if the progress file couldn't be loaded
+static void save_level_completion(const string& filename,
+    const vector<level_completion>& completion, size_t level_index) {
+  if (filename.empty()) {
+    return;
+  }
+  level_completion lc = completion[level_index];
+  io.enqueue(string_printf("%s:%zu", filename.c_str(), level_index),
+      [filename, level_index, lc]() {
+    try {
+      append_level_completion_state(filename, level_index, lc);
+    } catch (const runtime_error& e) {
+      fprintf(stderr, "can\'t save level completion state: %s\n", e.what());
+    }
+  });
+}
+
 
 
 static void glfw_key_cb(GLFWwindow* window, int key, int scancode,
@@ -704,6 +1094,14 @@ static void glfw_key_cb(GLFWwindow* window, int key, int scancode,
           current_instructions_page++;
         return;
       }
+    } else if (phase == Replaying) {
+      if (key == GLFW_KEY_LEFT) {
+        should_seek_replay_frames -= REPLAY_SEEK_FRAMES;
+        return;
+      } else if (key == GLFW_KEY_RIGHT) {
+        should_seek_replay_frames += REPLAY_SEEK_FRAMES;
+        return;
+      }
     } else if (phase == Editing) {
       if ((key == GLFW_KEY_UP) && (mods & GLFW_MOD_SHIFT)) {
         game.num_items_remaining++;
@@ -738,19 +1136,39 @@ static void glfw_key_cb(GLFWwindow* window, int key, int scancode,
       game.rewind_count++;
       phase = Rewinding;
 
+    } else if ((key == GLFW_KEY_U) && (phase == Playing || phase == Paused) &&
+        game.unwinnable && game.can_rewind()) {
+      // go straight back to the last frame that wasn't known to be unwinnable
+      // (or to the start, if it was unwinnable from the beginning)
+      game.rewind_count++;
+      game.rewind_frames_until(
+          game.unwinnable_frame ? (game.unwinnable_frame - 1) : 0);
+      phase = Paused;
+      player_did_lose = false;
+
     } else if ((key == GLFW_KEY_J) && (mods & GLFW_MOD_SHIFT)) {
-      last_recording_filename = string_printf("%s/level_%zu_%" PRId64 ".mbr",
-          recordings_directory.c_str(), level_index, now());
-      save_recording(last_recording_filename, current_recording);
+      last_recording_filename = save_recording_async();
+
+    } else if ((key == GLFW_KEY_B) && (mods & GLFW_MOD_SHIFT)) {
+      load_best_recording_async();
+
+    } else if ((key >= GLFW_KEY_1) && (key <= GLFW_KEY_9) &&
+        ((phase == Playing) || (phase == Paused))) {
+      if (mods & GLFW_MOD_SHIFT) {
+        should_save_session_slot = key - GLFW_KEY_0;
+      } else {
+        should_load_session_slot = key - GLFW_KEY_0;
+      }
 
     } else if ((key == GLFW_KEY_K) && (mods & GLFW_MOD_SHIFT)) {
       if (!last_recording_filename.empty()) {
-        current_recording = load_recording(last_recording_filename);
+        load_recording_async(last_recording_filename);
       }
 
     } else if (key == GLFW_KEY_ESCAPE) {
       if (phase == Editing) {
         game.compute_player_coordinates();
+        game.recompute_winnability();
         phase = Paused;
       } else if (phase == Instructions) {
         phase = Paused;
@@ -764,10 +1182,33 @@ static void glfw_key_cb(GLFWwindow* window, int key, int scancode,
     } else if (key == GLFW_KEY_ENTER) {
       if (phase == Editing) {
         game.compute_player_coordinates();
+        game.recompute_winnability();
         if (!game.frames_executed) {
-          initial_state[level_index] = game;
+          initial_state.replace(level_index, game);
+          initial_state_replace_count++;
           // TODO: clear completion state for this level
-          save_levels(initial_state, levels_filename.c_str());
+          string filename = levels_filename;
+          int saved_level_index = level_index;
+          auto saved_level = make_shared<level_state>(game);
+          io.enqueue(string_printf("%s:%d", filename.c_str(), level_index),
+              [filename, saved_level_index, saved_level]() {
+            try {
+              save_level(filename.c_str(), saved_level_index, *saved_level);
+            } catch (const runtime_error& e) {
+              fprintf(stderr, "can\'t save level %d: %s\n", saved_level_index, e.what());
+            }
+          });
+
+          // clean up the old copies of edited levels if they're taking up too
+          // much space. this rewrites the entire pack, so it's queued after
+          // the save (and only done once if several levels are saved quickly)
+          io.enqueue("compact:" + filename, [filename]() {
+            try {
+              compact_levels(filename.c_str());
+            } catch (const runtime_error& e) {
+              fprintf(stderr, "can\'t compact %s: %s\n", filename.c_str(), e.what());
+            }
+          });
         }
         phase = Paused;
       } else if ((phase == Playing) || (phase == Replaying) || (phase == Rewinding)) {
@@ -789,25 +1230,47 @@ static void glfw_key_cb(GLFWwindow* window, int key, int scancode,
     } else if ((key == GLFW_KEY_LEFT) && ((phase == Playing) || (phase == Paused))) {
       current_impulse = Left;
       recent_impulses.emplace_back(Left);
+      player_path.clear();
       phase = Playing;
       player_did_lose = false;
     } else if ((key == GLFW_KEY_RIGHT) && ((phase == Playing) || (phase == Paused))) {
       current_impulse = Right;
       recent_impulses.emplace_back(Right);
+      player_path.clear();
       phase = Playing;
       player_did_lose = false;
     } else if ((key == GLFW_KEY_UP) && ((phase == Playing) || (phase == Paused))) {
       current_impulse = Up;
       recent_impulses.emplace_back(Up);
+      player_path.clear();
       phase = Playing;
       player_did_lose = false;
     } else if ((key == GLFW_KEY_DOWN) && ((phase == Playing) || (phase == Paused))) {
       current_impulse = Down;
       recent_impulses.emplace_back(Down);
+      player_path.clear();
       phase = Playing;
       player_did_lose = false;
     } else if ((key == GLFW_KEY_X) && ((phase == Playing) || (phase == Replaying) || (phase == Rewinding) || (phase == Paused))) {
       show_stats = !show_stats;
+    } else if ((key == GLFW_KEY_A) && (phase != Editing) && (phase != Instructions)) {
+      // cycles through the planes, then turns the overlay off
+      activity_overlay_plane++;
+      if (activity_overlay_plane >= static_cast<int>(NUM_ACTIVITY_PLANES)) {
+        activity_overlay_plane = -1;
+      }
+    } else if ((key == GLFW_KEY_M) && ((phase == Playing) || (phase == Paused))) {
+      click_to_move = !click_to_move;
+      if (!click_to_move) {
+        player_path.clear();
+      }
+    } else if ((key == GLFW_KEY_H) && ((phase == Playing) || (phase == Paused))) {
+      show_hints = !show_hints;
+      if (show_hints) {
+        hint_needs_request = true;
+      } else {
+        hints.cancel();
+      }
     } else if ((key == GLFW_KEY_SPACE) && (phase != Instructions)) {
       if (phase == Editing) {
         if (editor_palette_intensity)
@@ -839,8 +1302,17 @@ static void glfw_key_cb(GLFWwindow* window, int key, int scancode,
 
 static void glfw_mouse_button_cb(GLFWwindow* window, int button, int action,
     int mods) {
-  // non-editing phases only use the keyboard
+  // outside the editor, clicks only pick where to walk in click-to-move mode
   if (phase != Editing) {
+    if (click_to_move && (button == GLFW_MOUSE_BUTTON_LEFT) &&
+        (action == GLFW_PRESS) && ((phase == Playing) || (phase == Paused)) &&
+        game.player_is_alive() &&
+        player_path.set_target(game, editor_highlight_x, editor_highlight_y)) {
+      current_impulse = None;
+      recent_impulses.clear();
+      phase = Playing;
+      player_did_lose = false;
+    }
     return;
   }
 
@@ -902,7 +1374,7 @@ static void glfw_drop_cb(GLFWwindow* window, int count, const char** paths) {
     return;
   }
   const char* file = paths[0];
-  current_recording = load_recording(file);
+  load_recording_async(file);
 }
 
 
@@ -951,37 +1423,75 @@ int main(int argc, char* argv[]) {
   }
 
   try {
-    initial_state = load_levels(levels_filename.c_str());
+    initial_state = level_pack(levels_filename);
   } catch (const runtime_error& e) {
     fprintf(stderr, "can\'t load level index %s: %s\n", levels_filename.c_str(), e.what());
     return 1;
   }
+  levels_watcher.reset(new file_watcher(levels_filename));
 
   struct passwd *pw = getpwuid(getuid());
   recordings_directory = string(pw->pw_dir) + "/.mbes";
   string level_completion_filename = string(pw->pw_dir) + "/.mbes_progress";
-  vector<level_completion> completion = load_level_completion_state(
-      level_completion_filename);
+  bool completion_needs_compaction = false;
+  vector<level_completion> completion;
+  try {
+    completion = load_level_completion_state(level_completion_filename,
+        &completion_needs_compaction);
+  } catch (const runtime_error& e) {
+    // the file may be from a newer build, so leave it alone: progress is still
+    // tracked during this run, but isn't saved
+    fprintf(stderr, "can\'t load level completion state (progress won\'t be saved): %s\n",
+        e.what());
+    level_completion_filename.clear();
+  }
   if (completion.empty()) {
     completion = load_level_completion_state_v1(
         string(pw->pw_dir) + "/.mbes_completion");
   }
   completion.resize(initial_state.size());
 
+  // during play, progress is only ever appended to the file, so convert it to
+  // the current format (or compact it) now if needed
+  if (completion_needs_compaction && !level_completion_filename.empty()) {
+    io.enqueue(level_completion_filename, [level_completion_filename, completion]() {
+      try {
+        save_level_completion_state(level_completion_filename, completion);
+      } catch (const runtime_error& e) {
+        fprintf(stderr, "can\'t save level completion state: %s\n", e.what());
+      }
+    });
+  }
+
   // create the recordings dir if it doesn't exist
   mkdir(recordings_directory.c_str(), 0755);
 
+  catalog_directory = recordings_directory + "/recordings";
+  io.enqueue("", []() {
+    catalog.reset(new recording_catalog(catalog_directory));
+    fprintf(stderr, "loaded %zu recordings from catalog\n", catalog->size());
+  });
+
+  // if no level was given on the command line, resume the game that was in
+  // progress when we last exited, if any
+  bool resumed_session = false;
   if (level_index < 0) {
-    // start at the first non-completed level
-    for (level_index = 0; (completion[level_index].state == Completed) &&
-        (level_index < initial_state.size()); level_index++);
+    resumed_session = restore_session(session_filename(-1));
   }
 
-  if (level_index >= initial_state.size()) {
-    level_index = 0;
-  }
+  if (!resumed_session) {
+    if (level_index < 0) {
+      // start at the first non-completed level
+      for (level_index = 0; (completion[level_index].state == Completed) &&
+          (level_index < initial_state.size()); level_index++);
+    }
+
+    if (level_index >= initial_state.size()) {
+      level_index = 0;
+    }
 
-  game = initial_state[level_index];
+    game.reset(initial_state[level_index]);
+  }
   bool level_is_valid = game.validate();
 
   init_al();
@@ -1040,7 +1550,7 @@ int main(int argc, char* argv[]) {
   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
   uint64_t last_update_time = now();
-  deque<struct player_actions>::iterator replay_iterator;
+  action_buffer::const_iterator replay_iterator;
 
   while (!glfwWindowShouldClose(window)) {
 
@@ -1048,6 +1558,78 @@ int main(int argc, char* argv[]) {
     glfwGetFramebufferSize(window, &window_w, &window_h);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+    // completions can replace the game (e.g. when a session is loaded)
+    if (io.poll()) {
+      level_is_valid = game.validate();
+    }
+
+    if (levels_watcher->poll()) {
+      reload_levels_async();
+    }
+    if (reloaded_levels) {
+      initial_state = move(*reloaded_levels);
+      reloaded_levels.reset();
+      vector<int64_t> old_indexes = move(reloaded_level_old_indexes);
+      completion.resize(initial_state.size());
+      size_t num_changed = count(old_indexes.begin(), old_indexes.end(), -1);
+      if (num_changed) {
+        fprintf(stderr, "reloaded %zu new or changed levels from %s\n",
+            num_changed, levels_filename.c_str());
+      }
+
+      // the current game is left alone unless the level at its index is
+      // different now (and it's not being edited) or no longer exists.
+      // progress is kept by index, so a level that moved counts as different
+      bool current_level_removed =
+          (static_cast<size_t>(level_index) >= initial_state.size());
+      bool current_level_changed = !current_level_removed &&
+          (old_indexes[level_index] != level_index);
+      if (current_level_removed || (current_level_changed && (phase != Editing))) {
+        if (current_level_removed) {
+          level_index = initial_state.size() - 1;
+        }
+        game.reset(initial_state[level_index]);
+        level_is_valid = game.validate();
+        current_recording.clear();
+        current_keyframes.clear();
+        player_will_drop_bomb = false;
+        player_path.clear();
+        player_did_lose = false;
+        if (phase != Instructions) {
+          phase = Paused;
+        }
+      }
+    }
+
+    if (should_save_session_slot >= 0) {
+      save_session_async(session_filename(should_save_session_slot));
+      should_save_session_slot = -1;
+    }
+    if (should_load_session_slot >= 0) {
+      restore_session_async(session_filename(should_load_session_slot));
+      should_load_session_slot = -1;
+    }
+    if (should_seek_replay_frames) {
+      if (phase == Replaying) {
+        int64_t target_frame = game.frames_executed + should_seek_replay_frames;
+        if (target_frame < 0) {
+          target_frame = 0;
+        } else if (target_frame > static_cast<int64_t>(current_recording.size())) {
+          target_frame = current_recording.size();
+        }
+        try {
+          float updates_per_second = game.updates_per_second;
+          game = seek_recording(initial_state[level_index].instantiate(),
+              current_recording, current_keyframes, target_frame);
+          game.updates_per_second = updates_per_second;
+          replay_iterator = current_recording.iterator_at(target_frame);
+        } catch (const exception& e) {
+          fprintf(stderr, "can\'t seek in recording: %s\n", e.what());
+        }
+      }
+      should_seek_replay_frames = 0;
+    }
+
     if (!level_is_valid) {
       render_stripe_animation(window_w, window_h, 100, 0.0f, 0.0f, 0.0f, 0.6f,
           1.0, 0.0, 0.0, 0.3);
@@ -1086,39 +1668,16 @@ int main(int argc, char* argv[]) {
         phase = Paused;
         player_did_lose = true;
         player_will_drop_bomb = false;
-        game = initial_state[level_index];
+        player_path.clear();
+        game.reset(initial_state[level_index]);
 
       } else if (game.player_did_win) {
         phase = Paused;
         player_did_lose = false;
 
         // combine level stats
-        level_completion& c = completion[level_index];
-        c.state = Completed;
-        if (game.frames_executed < c.frames) {
-          c.frames = game.frames_executed;
-        }
-        if (-game.num_items_remaining > c.extra_items) {
-          c.extra_items = -game.num_items_remaining;
-        }
-        if (game.num_red_bombs > c.extra_bombs) {
-          c.extra_bombs = game.num_red_bombs;
-        }
-        uint64_t cleared_space = game.count_cells_of_type(Empty);
-        if (cleared_space > c.cleared_space) {
-          c.cleared_space = cleared_space;
-        }
-        uint64_t attenuated_space = game.count_attenuated_space();
-        if (attenuated_space < c.attenuated_space) {
-          c.attenuated_space = attenuated_space;
-        }
-        uint64_t entropy = game.compute_entropy();
-        if (entropy < c.entropy) {
-          c.entropy = entropy;
-        }
-        if (game.rewind_count < c.rewind_count) {
-          c.rewind_count = game.rewind_count;
-        }
+        int completed_level_index = level_index;
+        completion[level_index].merge(completion_for_win(game));
 
         int next_level_index;
         if (level_index < initial_state.size() - 1) {
@@ -1132,14 +1691,19 @@ int main(int argc, char* argv[]) {
         if (next_level_index < initial_state.size()) {
           level_index = next_level_index;
           player_will_drop_bomb = false;
+          player_path.clear();
           current_recording.clear();
-          game = initial_state[level_index];
+          current_keyframes.clear();
+          game.reset(initial_state[level_index]);
           level_is_valid = game.validate();
-          if (completion[level_index].state != Completed) {
+          if (completion[level_index].state == NotAttempted) {
             completion[level_index].state = Attempted;
+            save_level_completion(level_completion_filename, completion,
+                level_index);
           }
         }
-        save_level_completion_state(level_completion_filename.c_str(), completion);
+        save_level_completion(level_completion_filename, completion,
+            completed_level_index);
 
       } else if ((should_change_to_level >= 0) && (should_change_to_level < initial_state.size())) {
         if (phase != Replaying) {
@@ -1147,13 +1711,16 @@ int main(int argc, char* argv[]) {
         }
         if (level_index != should_change_to_level) {
           current_recording.clear();
+          current_keyframes.clear();
         }
         level_index = should_change_to_level;
         player_will_drop_bomb = false;
-        game = initial_state[level_index];
+        player_path.clear();
+        game.reset(initial_state[level_index]);
         if (completion[level_index].state == NotAttempted) {
           completion[level_index].state = Attempted;
-          save_level_completion_state(level_completion_filename.c_str(), completion);
+          save_level_completion(level_completion_filename, completion,
+              level_index);
         }
         should_change_to_level = -1;
         player_did_lose = false;
@@ -1164,9 +1731,11 @@ int main(int argc, char* argv[]) {
         uint64_t update_diff = now_time - last_update_time;
         if (update_diff >= usec_per_update) {
           if (phase == Rewinding) {
-            if (!game.frames_executed) {
+            if (!game.can_rewind()) {
               phase = Paused;
-              game.rewind_count = 0;
+              if (!game.frames_executed) {
+                game.rewind_count = 0;
+              }
             } else {
               game.rewind_frames(1);
             }
@@ -1175,6 +1744,15 @@ int main(int argc, char* argv[]) {
 
             struct player_actions actions;
             if (phase == Playing) {
+              // the path is followed one step at a time, so it can be repaired
+              // (or cancelled) after every frame
+              if (player_path.active() && recent_impulses.empty() &&
+                  (current_impulse == None)) {
+                player_impulse impulse = player_path.next_impulse(game);
+                if (impulse != None) {
+                  recent_impulses.emplace_back(impulse);
+                }
+              }
               actions.impulse = current_impulse;
               if (!recent_impulses.empty()) {
                 actions.impulse = recent_impulses.front();
@@ -1187,9 +1765,10 @@ int main(int argc, char* argv[]) {
                 actions.drop_bomb = false;
               }
               if (current_recording.size() >= game.frames_executed) {
-                current_recording.resize(game.frames_executed);
+                current_recording.truncate(game.frames_executed);
+                truncate_keyframes(game.frames_executed);
               }
-              current_recording.emplace_back(actions);
+              current_recording.push_back(actions);
 
             } else if (phase == Replaying) {
               if (game.frames_executed == 0) {
@@ -1204,7 +1783,18 @@ int main(int argc, char* argv[]) {
             }
 
             if (phase != Paused) {
+              if (activity_overlay_plane >= 0) {
+                if ((game_activity_level_index != level_index) ||
+                    (game_activity.w != game.w) || (game_activity.h != game.h)) {
+                  game_activity.reset(game.w, game.h);
+                  game_activity_level_index = level_index;
+                }
+                game.activity = &game_activity;
+              } else {
+                game.activity = NULL;
+              }
               uint64_t events = game.exec_frame(actions);
+              player_path.update(game);
               if (should_play_sounds) {
                 if (events & (RedBombCollected | ItemCollected)) {
                   get_item_sound.play();
@@ -1231,10 +1821,29 @@ int main(int argc, char* argv[]) {
         }
       }
 
+      // the search runs on other threads, so all the frame loop does is start
+      // it and look at the result. requesting a new hint cancels the old search
+      bool hints_visible = show_hints && !game.player_did_win &&
+          ((phase == Playing) || (phase == Paused));
+      if (hints_visible) {
+        bool player_moved = (game.player_x != hint_player_x) ||
+            (game.player_y != hint_player_y);
+        bool level_restarted = (level_index != hint_level_index) ||
+            (game.frames_executed < hint_frame);
+        if (hint_needs_request || player_moved || level_restarted) {
+          hints.request(game);
+          hint_needs_request = false;
+          hint_level_index = level_index;
+          hint_frame = game.frames_executed;
+          hint_player_x = game.player_x;
+          hint_player_y = game.player_y;
+        }
+      }
+
       if (!game.player_did_win) {
         const char* phase_annotation = NULL;
         if (phase == Replaying) {
-          phase_annotation = "REPLAY";
+          phase_annotation = "REPLAY (left/right: skip back/ahead)";
         } else if (phase == Rewinding) {
           phase_annotation = "REWIND";
         }
@@ -1252,9 +1861,33 @@ int main(int argc, char* argv[]) {
               1.0f, 0.0f, 0.0f, 0.1f * lose_overlay_intensity);
         }
 
+        if (hints_visible) {
+          shared_ptr<const hint> h = hints.current();
+          render_hint(h.get(), hints.searching(), game, window_w, window_h);
+        }
+
+        if ((activity_overlay_plane >= 0) &&
+            (game_activity_level_index == level_index)) {
+          render_activity_overlay(game_activity,
+              static_cast<activity_plane>(activity_overlay_plane), window_w,
+              window_h);
+        }
+
+        if (click_to_move && ((phase == Playing) || (phase == Paused))) {
+          render_path_target(player_path, game, window_w, window_h);
+        }
+
+        if (game.unwinnable && game.player_is_alive() &&
+            ((phase == Playing) || (phase == Paused))) {
+          draw_text(-0.99, 0.9, 1, 0, 0, 1, (float)window_w / window_h, 0.01,
+              false, game.can_rewind() ?
+                "this level can\'t be won any more (u: rewind to before that happened)" :
+                "this level can\'t be won any more");
+        }
+
         if (phase == Replaying) {
           draw_text(-0.99, -0.7, 1, 0, 0, 1, (float)window_w / window_h, 0.01,
-              false, "REPLAY");
+              false, "REPLAY (left/right: skip back/ahead)");
         } else if (phase == Rewinding) {
           draw_text(-0.99, -0.7, 1, 0, 0, 1, (float)window_w / window_h, 0.01,
               false, "REWIND");
@@ -1264,7 +1897,7 @@ int main(int argc, char* argv[]) {
       if (phase == Paused) {
         render_paused_screen(window_w, window_h, completion, level_index,
             game.player_did_win, player_did_lose, game.frames_executed,
-            should_play_sounds, show_stats);
+            should_play_sounds, show_stats, show_hints);
       }
     }
 
@@ -1272,8 +1905,24 @@ int main(int argc, char* argv[]) {
     glfwPollEvents();
   }
 
+  // save the game in progress so the next launch can resume it. if there's
+  // nothing worth resuming, delete any old autosave so we don't resume a stale
+  // game instead
+  string autosave_filename = session_filename(-1);
+  if (level_is_valid && (phase != Editing) && (phase != Replaying) &&
+      game.frames_executed && !game.player_did_win) {
+    save_session_async(autosave_filename);
+  } else {
+    io.enqueue(autosave_filename, [autosave_filename]() {
+      unlink(autosave_filename.c_str());
+    });
+  }
+
   glfwDestroyWindow(window);
   glfwTerminate();
 
+  // close the window first so the player doesn't have to wait for this
+  io.flush();
+
   return 0;
 }
@@ -0,0 +1,555 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+
+#include "action_buffer.hh"
+#include "codec.hh"
+#include "file_io.hh"
+#include "level.hh"
+#include "level_pack.hh"
+#include "recording.hh"
+
+using namespace std;
+
+
+// mbes-bisect: finds the first frame where a recording plays out differently
+// in two engine builds or on two versions of a level.
+//
+// the work is split so that each build only ever simulates with its own
+// engine: `mbes-bisect trace` replays a recording and writes a trace file
+// containing a checkpoint (the state's hashes and a keyframe) every N frames.
+// the driver runs trace once with each build, finds the first checkpoint
+// where the traces differ, then runs trace again with each build, starting
+// from that side's keyframe at the last matching checkpoint and with a
+// checkpoint on every frame. the first differing frame of those traces is the
+// point of divergence, and both sides' states at that frame are in the traces,
+// so the cells that differ can be listed.
+//
+// the states are compared by level_state::hash if both sides started from the
+// same level. otherwise their states differ from the first frame, so only the
+// player's state (position, items, bombs, and whether they've won or lost) is
+// compared.
+
+static const uint64_t TRACE_SIGNATURE = 0x4D42455354524345; // 'MBESTRCE'
+static const uint64_t DEFAULT_TRACE_INTERVAL = 256;
+static const size_t DEFAULT_MAX_CELLS = 100;
+
+struct trace_header {
+  uint64_t signature;
+  uint64_t source_level_hash;
+  uint64_t level_index;
+  uint64_t interval;
+  uint64_t num_checkpoints;
+};
+
+// each checkpoint in the file is one of these, followed by the keyframe data
+struct trace_checkpoint_header {
+  uint64_t frame;
+  uint64_t state_hash;
+  uint64_t player_hash;
+  uint64_t keyframe_size;
+};
+
+struct trace_checkpoint {
+  uint64_t frame;
+  uint64_t player_hash;
+  recording_keyframe keyframe; // keyframe.state_hash is the state hash
+};
+
+struct trace {
+  uint64_t source_level_hash;
+  uint64_t level_index;
+  uint64_t interval;
+  vector<trace_checkpoint> checkpoints;
+};
+
+enum class compare_mode {
+  Auto = 0,
+  State,
+  Player,
+};
+
+static void print_usage() {
+  fprintf(stderr, "\
+usage:\n\
+  mbes-bisect [options] RECORDING PACK_A [PACK_B]\n\
+    find the first frame where the recording plays out differently with the\n\
+    builds given by --build-a and --build-b, or on the level in PACK_A and\n\
+    PACK_B. options:\n\
+      --build-a=PATH, --build-b=PATH: mbes-bisect executables of the builds to\n\
+        compare (default: this one)\n\
+      --level=N: the level in PACK_A to use (default: the level the\n\
+        recording's fingerprint matches)\n\
+      --level-b=N: the level in PACK_B to use (default: the same as PACK_A)\n\
+      --interval=N: frames between checkpoints in the first pass (default %" PRIu64 ")\n\
+      --compare=state|player: compare entire states, or only the player\'s\n\
+        state (default: state if both sides start from the same level)\n\
+      --max-cells=N: list at most this many differing cells (default %zu)\n\
+      --keep-traces: don\'t delete the trace files afterward\n\
+  mbes-bisect trace [options] PACK RECORDING OUTPUT\n\
+    replay the recording and write a trace file. options:\n\
+      --level=N, --interval=N: as above\n\
+      --start-trace=FILE --start-frame=N: start from the keyframe at frame N\n\
+        in an existing trace instead of from the level\'s initial state\n\
+      --frames=N: stop after this many frames\n",
+      DEFAULT_TRACE_INTERVAL, DEFAULT_MAX_CELLS);
+}
+
+// everything about the player that decides whether the recording wins
+static uint64_t player_hash(const level_state& l) {
+  uint64_t data[6] = {static_cast<uint64_t>(l.player_x),
+      static_cast<uint64_t>(l.player_y),
+      static_cast<uint64_t>(l.num_items_remaining),
+      static_cast<uint64_t>(l.num_red_bombs), l.player_lose_frame,
+      static_cast<uint64_t>((l.player_did_win ? 2 : 0) |
+          (l.player_will_drop_bomb ? 1 : 0))};
+  return fnv1a64(data, sizeof(data));
+}
+
+static void save_trace(const string& filename, const trace& t) {
+  trace_header header;
+  header.signature = TRACE_SIGNATURE;
+  header.source_level_hash = t.source_level_hash;
+  header.level_index = t.level_index;
+  header.interval = t.interval;
+  header.num_checkpoints = t.checkpoints.size();
+  string data(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  for (const auto& c : t.checkpoints) {
+    trace_checkpoint_header ch;
+    ch.frame = c.frame;
+    ch.state_hash = c.keyframe.state_hash;
+    ch.player_hash = c.player_hash;
+    ch.keyframe_size = c.keyframe.data.size();
+    data.append(reinterpret_cast<const char*>(&ch), sizeof(ch));
+    data += c.keyframe.data;
+  }
+  save_file_atomic(filename, data);
+}
+
+static trace load_trace(const string& filename) {
+  string data = load_file(filename);
+  mapped_reader r(data.data(), data.size());
+
+  const trace_header* header = r.get<trace_header>();
+  if (header->signature != TRACE_SIGNATURE) {
+    throw runtime_error(filename + " is not a trace file");
+  }
+  trace t;
+  t.source_level_hash = header->source_level_hash;
+  t.level_index = header->level_index;
+  t.interval = header->interval;
+  for (uint64_t x = 0; x < header->num_checkpoints; x++) {
+    const trace_checkpoint_header* ch = r.get<trace_checkpoint_header>();
+    const char* keyframe_data = r.get<char>(ch->keyframe_size);
+    t.checkpoints.emplace_back();
+    trace_checkpoint& c = t.checkpoints.back();
+    c.frame = ch->frame;
+    c.player_hash = ch->player_hash;
+    c.keyframe.frame = ch->frame;
+    c.keyframe.state_hash = ch->state_hash;
+    c.keyframe.data.assign(keyframe_data, ch->keyframe_size);
+  }
+  return t;
+}
+
+static const trace_checkpoint& checkpoint_at_frame(const trace& t,
+    uint64_t frame) {
+  for (const auto& c : t.checkpoints) {
+    if (c.frame == frame) {
+      return c;
+    }
+  }
+  throw out_of_range(string_printf("trace has no checkpoint at frame %" PRIu64,
+      frame));
+}
+
+static size_t resolve_level(const level_pack& pack, const recording_file& r,
+    int64_t level_index) {
+  if (level_index >= 0) {
+    if (static_cast<size_t>(level_index) >= pack.size()) {
+      throw out_of_range("level index is beyond the end of the pack");
+    }
+    return level_index;
+  }
+  if (!r.has_fingerprint) {
+    throw runtime_error("recording has no fingerprint; use --level");
+  }
+  for (size_t x = 0; x < pack.size(); x++) {
+    if (r.matches_level(pack[x])) {
+      return x;
+    }
+  }
+  throw runtime_error("recording was made on a level that isn\'t in this pack");
+}
+
+static trace make_trace(const level_state& start_state, uint64_t start_frame,
+    const action_buffer& recording, uint64_t interval, uint64_t max_frames) {
+  trace t;
+  t.interval = interval;
+
+  uint64_t end_frame = recording.size();
+  if (max_frames && (end_frame - start_frame > max_frames)) {
+    end_frame = start_frame + max_frames;
+  }
+
+  level_state l = start_state;
+  l.set_undo_log_enabled(false);
+  auto add_checkpoint = [&](uint64_t frame) {
+    t.checkpoints.emplace_back();
+    trace_checkpoint& c = t.checkpoints.back();
+    c.frame = frame;
+    c.player_hash = player_hash(l);
+    c.keyframe.frame = frame;
+    c.keyframe.state_hash = l.hash();
+    c.keyframe.data = encode_keyframe(l);
+  };
+
+  // like replay_recording, this stops when the player wins
+  add_checkpoint(start_frame);
+  auto it = recording.iterator_at(start_frame);
+  for (uint64_t frame = start_frame; (frame < end_frame) && !l.player_did_win;) {
+    l.exec_frame(*it);
+    it++;
+    frame++;
+    if (((frame % interval) == 0) || (frame == end_frame) || l.player_did_win) {
+      add_checkpoint(frame);
+    }
+  }
+  return t;
+}
+
+static int command_trace(const vector<string>& args) {
+  int64_t level_index = -1;
+  uint64_t interval = DEFAULT_TRACE_INTERVAL;
+  string start_trace_filename;
+  uint64_t start_frame = 0;
+  uint64_t max_frames = 0;
+  vector<string> positional_args;
+  for (const string& arg : args) {
+    if (starts_with(arg, "--level=")) {
+      level_index = strtoll(arg.c_str() + 8, NULL, 10);
+    } else if (starts_with(arg, "--interval=")) {
+      interval = strtoull(arg.c_str() + 11, NULL, 10);
+    } else if (starts_with(arg, "--start-trace=")) {
+      start_trace_filename = arg.substr(14);
+    } else if (starts_with(arg, "--start-frame=")) {
+      start_frame = strtoull(arg.c_str() + 14, NULL, 10);
+    } else if (starts_with(arg, "--frames=")) {
+      max_frames = strtoull(arg.c_str() + 9, NULL, 10);
+    } else if (starts_with(arg, "--")) {
+      throw invalid_argument("unknown option: " + arg);
+    } else {
+      positional_args.emplace_back(arg);
+    }
+  }
+  if ((positional_args.size() != 3) || (interval == 0)) {
+    print_usage();
+    return 2;
+  }
+
+  level_pack pack(positional_args[0]);
+  recording_file r = load_recording_file(positional_args[1]);
+  size_t resolved_level_index = resolve_level(pack, r, level_index);
+
+  level_state start_state;
+  if (start_trace_filename.empty()) {
+    start_state.reset(pack[resolved_level_index]);
+    start_frame = 0;
+  } else {
+    trace start_trace = load_trace(start_trace_filename);
+    start_state = decode_keyframe(checkpoint_at_frame(start_trace,
+        start_frame).keyframe);
+  }
+  if (start_frame > r.actions.size()) {
+    throw out_of_range("start frame is beyond the end of the recording");
+  }
+
+  trace t = make_trace(start_state, start_frame, r.actions, interval,
+      max_frames);
+  t.source_level_hash = pack[resolved_level_index].hash();
+  t.level_index = resolved_level_index;
+  save_trace(positional_args[2], t);
+
+  fprintf(stderr, "traced frames %" PRIu64 "-%" PRIu64 " of level %zu (%zu checkpoints)\n",
+      start_frame, t.checkpoints.back().frame, resolved_level_index,
+      t.checkpoints.size());
+  return 0;
+}
+
+// runs `build trace args...` and waits for it to finish
+static void run_trace(const string& build, const vector<string>& args) {
+  vector<string> argv_strs = {build, "trace"};
+  argv_strs.insert(argv_strs.end(), args.begin(), args.end());
+  vector<char*> argv;
+  for (auto& s : argv_strs) {
+    argv.emplace_back(const_cast<char*>(s.c_str()));
+  }
+  argv.emplace_back(nullptr);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    throw runtime_error("can\'t fork");
+  }
+  if (pid == 0) {
+    execvp(argv[0], argv.data());
+    fprintf(stderr, "can\'t run %s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+  }
+
+  int status;
+  if ((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) ||
+      (WEXITSTATUS(status) != 0)) {
+    throw runtime_error(build + " trace failed");
+  }
+}
+
+// returns the index of the first checkpoint that differs. if one trace ends
+// before the other but matches it up to there, this is the index of the first
+// checkpoint only the longer one has. if the traces are the same, it's the
+// number of checkpoints
+static size_t first_difference(const trace& a, const trace& b,
+    compare_mode mode) {
+  size_t x;
+  for (x = 0; (x < a.checkpoints.size()) && (x < b.checkpoints.size()); x++) {
+    const trace_checkpoint& ca = a.checkpoints[x];
+    const trace_checkpoint& cb = b.checkpoints[x];
+    if ((ca.frame != cb.frame) ||
+        ((mode == compare_mode::State) && (ca.keyframe.state_hash != cb.keyframe.state_hash)) ||
+        ((mode == compare_mode::Player) && (ca.player_hash != cb.player_hash))) {
+      return x;
+    }
+  }
+  return x;
+}
+
+static bool has_checkpoint(const trace& t, size_t index) {
+  return index < t.checkpoints.size();
+}
+
+static void print_player(const char* side, const level_state& l) {
+  printf("  %s: player at (%d, %d), %d items remaining, %d red bombs%s%s\n",
+      side, l.player_x, l.player_y, l.num_items_remaining, l.num_red_bombs,
+      l.player_did_win ? ", won" : "",
+      l.player_is_alive() ? "" : ", dead");
+}
+
+static void print_cell_differences(const level_state& a, const level_state& b,
+    size_t max_cells) {
+  if ((a.w != b.w) || (a.h != b.h)) {
+    printf("  the levels have different dimensions (%ux%u and %ux%u)\n", a.w,
+        a.h, b.w, b.h);
+    return;
+  }
+
+  size_t num_differences = 0;
+  for (int32_t y = 0; y < static_cast<int32_t>(a.h); y++) {
+    for (int32_t x = 0; x < static_cast<int32_t>(a.w); x++) {
+      const cell_state& ca = a.at(x, y);
+      const cell_state& cb = b.at(x, y);
+      if ((ca.type == cb.type) && (ca.param == cb.param)) {
+        continue;
+      }
+      if (num_differences < max_cells) {
+        printf("  (%d, %d): %s/%d in A, %s/%d in B\n", x, y,
+            name_for_cell_type(ca.type), ca.param, name_for_cell_type(cb.type),
+            cb.param);
+      }
+      num_differences++;
+    }
+  }
+  if (num_differences > max_cells) {
+    printf("  ... and %zu more\n", num_differences - max_cells);
+  } else if (num_differences == 0) {
+    printf("  no cells differ\n");
+  }
+}
+
+static int command_bisect(const vector<string>& args, const string& self) {
+  string build_a = self, build_b = self;
+  string level_arg, level_b_arg;
+  uint64_t interval = DEFAULT_TRACE_INTERVAL;
+  compare_mode mode = compare_mode::Auto;
+  size_t max_cells = DEFAULT_MAX_CELLS;
+  bool keep_traces = false;
+  vector<string> positional_args;
+  for (const string& arg : args) {
+    if (starts_with(arg, "--build-a=")) {
+      build_a = arg.substr(10);
+    } else if (starts_with(arg, "--build-b=")) {
+      build_b = arg.substr(10);
+    } else if (starts_with(arg, "--level=")) {
+      level_arg = arg;
+    } else if (starts_with(arg, "--level-b=")) {
+      level_b_arg = "--level=" + arg.substr(10);
+    } else if (starts_with(arg, "--interval=")) {
+      interval = strtoull(arg.c_str() + 11, NULL, 10);
+    } else if (arg == "--compare=state") {
+      mode = compare_mode::State;
+    } else if (arg == "--compare=player") {
+      mode = compare_mode::Player;
+    } else if (starts_with(arg, "--max-cells=")) {
+      max_cells = strtoull(arg.c_str() + 12, NULL, 10);
+    } else if (arg == "--keep-traces") {
+      keep_traces = true;
+    } else if (starts_with(arg, "--")) {
+      throw invalid_argument("unknown option: " + arg);
+    } else {
+      positional_args.emplace_back(arg);
+    }
+  }
+  if ((positional_args.size() < 2) || (positional_args.size() > 3) ||
+      (interval == 0)) {
+    print_usage();
+    return 2;
+  }
+  const string& recording_filename = positional_args[0];
+  const string& pack_a = positional_args[1];
+  const string& pack_b = (positional_args.size() > 2) ? positional_args[2] : pack_a;
+
+  char temp_dir_template[] = "/tmp/mbes-bisect.XXXXXX";
+  if (!mkdtemp(temp_dir_template)) {
+    throw runtime_error("can\'t create temporary directory");
+  }
+  string temp_dir = temp_dir_template;
+  string trace_a_filename = temp_dir + "/a.mbt";
+  string trace_b_filename = temp_dir + "/b.mbt";
+  string fine_a_filename = temp_dir + "/a_fine.mbt";
+  string fine_b_filename = temp_dir + "/b_fine.mbt";
+  string interval_arg = string_printf("--interval=%" PRIu64, interval);
+  auto remove_traces = [&]() {
+    for (const string& filename : {trace_a_filename, trace_b_filename,
+         fine_a_filename, fine_b_filename}) {
+      unlink(filename.c_str());
+    }
+    rmdir(temp_dir.c_str());
+  };
+
+  int ret = 0;
+  try {
+    // first pass: a checkpoint every interval frames
+    vector<string> trace_args = {interval_arg, pack_a, recording_filename,
+        trace_a_filename};
+    if (!level_arg.empty()) {
+      trace_args.insert(trace_args.begin(), level_arg);
+    }
+    run_trace(build_a, trace_args);
+    trace a = load_trace(trace_a_filename);
+
+    // the same level on the other side, unless told otherwise
+    string side_b_level_arg = level_b_arg.empty() ?
+        string_printf("--level=%" PRIu64, a.level_index) : level_b_arg;
+    run_trace(build_b, {side_b_level_arg, interval_arg, pack_b,
+        recording_filename, trace_b_filename});
+    trace b = load_trace(trace_b_filename);
+
+    if (mode == compare_mode::Auto) {
+      mode = (a.source_level_hash == b.source_level_hash) ?
+          compare_mode::State : compare_mode::Player;
+    }
+    printf("comparing %s on level %" PRIu64 " (A) and level %" PRIu64 " (B)\n",
+        (mode == compare_mode::State) ? "states" : "player states",
+        a.level_index, b.level_index);
+
+    size_t index = first_difference(a, b, mode);
+    if (!has_checkpoint(a, index) && !has_checkpoint(b, index)) {
+      printf("no differences in %" PRIu64 " frames\n",
+          a.checkpoints.back().frame);
+
+    } else {
+      // second pass: every frame since the last checkpoint that matched. each
+      // side starts from its own keyframe, since with --compare=player the
+      // states can differ even though the checkpoints matched. if one side
+      // ended early, the other side's next checkpoint is where to stop
+      if (index > 0) {
+        uint64_t start_frame = a.checkpoints[index - 1].frame;
+        uint64_t end_frame = max(
+            has_checkpoint(a, index) ? a.checkpoints[index].frame : 0,
+            has_checkpoint(b, index) ? b.checkpoints[index].frame : 0);
+        string start_frame_arg = string_printf("--start-frame=%" PRIu64, start_frame);
+        string frames_arg = string_printf("--frames=%" PRIu64, end_frame - start_frame);
+        run_trace(build_a, {string_printf("--level=%" PRIu64, a.level_index),
+            "--interval=1", "--start-trace=" + trace_a_filename, start_frame_arg,
+            frames_arg, pack_a, recording_filename, fine_a_filename});
+        run_trace(build_b, {string_printf("--level=%" PRIu64, b.level_index),
+            "--interval=1", "--start-trace=" + trace_b_filename, start_frame_arg,
+            frames_arg, pack_b, recording_filename, fine_b_filename});
+        a = load_trace(fine_a_filename);
+        b = load_trace(fine_b_filename);
+        index = first_difference(a, b, mode);
+        if (!has_checkpoint(a, index) && !has_checkpoint(b, index)) {
+          throw runtime_error("the second pass found no difference; the builds may not be deterministic");
+        }
+      }
+
+      // if one side ended (e.g. because the player won) where the other didn't,
+      // the states matched up to its last checkpoint; show both sides there.
+      // the start checkpoint is always in both traces, so index > 0 here
+      bool a_ended = !has_checkpoint(a, index);
+      bool b_ended = !has_checkpoint(b, index);
+      size_t shown_index = (a_ended || b_ended) ? index - 1 : index;
+      const trace_checkpoint& ca = a.checkpoints[shown_index];
+      const trace_checkpoint& cb = b.checkpoints[shown_index];
+      if (a_ended || b_ended) {
+        printf("%s stops at frame %" PRIu64 " but %s continues\n",
+            a_ended ? "A" : "B", ca.frame, a_ended ? "B" : "A");
+      } else if (ca.frame != cb.frame) {
+        printf("A stops at frame %" PRIu64 " but B stops at frame %" PRIu64 "\n",
+            ca.frame, cb.frame);
+      } else {
+        printf("first difference is at frame %" PRIu64 "\n", ca.frame);
+      }
+      if (ca.frame > 0) {
+        recording_file r = load_recording_file(recording_filename);
+        uint64_t action_frame = min(ca.frame, cb.frame) - 1;
+        struct player_actions pa = r.actions[action_frame];
+        printf("  the action on frame %" PRIu64 " was impulse %d%s\n",
+            action_frame, pa.impulse, pa.drop_bomb ? " with bomb" : "");
+      }
+
+      level_state la = decode_keyframe(ca.keyframe);
+      level_state lb = decode_keyframe(cb.keyframe);
+      print_player("A", la);
+      print_player("B", lb);
+      print_cell_differences(la, lb, max_cells);
+      ret = 1;
+    }
+
+  } catch (...) {
+    if (!keep_traces) {
+      remove_traces();
+    }
+    throw;
+  }
+
+  if (keep_traces) {
+    fprintf(stderr, "traces are in %s\n", temp_dir.c_str());
+  } else {
+    remove_traces();
+  }
+  return ret;
+}
+
+int main(int argc, char* argv[]) {
+  vector<string> args(argv + 1, argv + argc);
+  try {
+    if (!args.empty() && (args[0] == "trace")) {
+      return command_trace(vector<string>(args.begin() + 1, args.end()));
+    }
+    return command_bisect(args, argv[0]);
+  } catch (const exception& e) {
+    fprintf(stderr, "mbes-bisect: %s\n", e.what());
+    return 2;
+  }
+}
@@ -0,0 +1,231 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <phosg/Time.hh>
+
+#include "level.hh"
+#include "level_pack.hh"
+#include "parallel.hh"
+#include "playout.hh"
+
+using namespace std;
+
+
+// mbes-difficulty: rates levels by how badly random play goes on them.
+//
+// each level gets many short playouts from its starting state, each one moving
+// the player with a random (or greedy, but still random) policy until the
+// player dies, wins, makes the level unwinnable (see level_state::unwinnable),
+// or runs out of frames (see playout.hh); on a level that's unwinnable from the
+// start, every playout is a dead end. a level where the player usually dies
+// quickly, rarely gets to an item, or often gets stuck is probably harder than
+// one where none of that happens, so the rates of these are combined into a
+// difficulty score.
+// the score is only useful for comparing levels with each other, and only
+// with the same options.
+//
+// playouts run in batches: each batch is a task for parallel_for, and each
+// playout in it starts by copying the level's starting state (which has no
+// undo log) over the same scratch state, which reuses its memory instead of
+// allocating a new one. each batch has its own random seed, and the totals are
+// sums, so the report doesn't depend on the number of threads.
+
+static const uint64_t DEFAULT_PLAYOUTS = 10000;
+static const uint64_t DEFAULT_FRAMES = 200;
+static const uint64_t PLAYOUTS_PER_BATCH = 64;
+
+static void print_usage() {
+  fprintf(stderr, "\
+usage: mbes-difficulty [options] PACK\n\
+\n\
+options:\n\
+  --csv: write the report as CSV (the default)\n\
+  --json: write the report as a JSON array\n\
+  --level=N: only rate level N (default: all of them)\n\
+  --playouts=N: play each level N times (default: %" PRIu64 ")\n\
+  --frames=N: end each playout after N frames (default: %" PRIu64 ")\n\
+  --policy=random: move in random directions, usually continuing in the same\n\
+    direction as the previous frame (the default)\n\
+  --policy=greedy: usually move toward the nearest item (or the exit, once\n\
+    there are no more items to collect), and randomly otherwise\n\
+  --seed=N: random seed (default: 1)\n\
+  --threads=N: play on N threads (default: one per core)\n",
+      DEFAULT_PLAYOUTS, DEFAULT_FRAMES);
+}
+
+struct level_report {
+  shared_ptr<const level_template> level;
+  playout_totals totals;
+
+  double rate(uint64_t count) const {
+    return this->totals.playouts ?
+        (static_cast<double>(count) / this->totals.playouts) : 0.0;
+  }
+
+  // 0 (random play almost always survives and makes progress) to 100 (it
+  // never does)
+  double difficulty(uint64_t max_frames) const {
+    double death_rate = this->rate(this->totals.crushed + this->totals.exploded);
+    double survival = this->rate(this->totals.frames_survived) / max_frames;
+    return 100 * (0.4 * death_rate +
+                  0.3 * (1.0 - this->rate(this->totals.made_progress)) +
+                  0.2 * this->rate(this->totals.dead_ends) +
+                  0.1 * (1.0 - survival));
+  }
+};
+
+static void print_csv(const vector<level_report>& reports,
+    const vector<size_t>& level_indexes, uint64_t max_frames) {
+  printf("level,w,h,items,playouts,win_rate,death_rate,crushed_rate,"
+      "exploded_rate,dead_end_rate,progress_rate,mean_items,mean_frames,"
+      "difficulty\n");
+  for (size_t x = 0; x < reports.size(); x++) {
+    const auto& r = reports[x];
+    const auto& t = r.totals;
+    printf("%zu,%" PRIu32 ",%" PRIu32 ",%" PRId32 ",%" PRIu64
+        ",%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.2f,%.1f,%.1f\n", level_indexes[x],
+        r.level->w, r.level->h, r.level->num_items_remaining, t.playouts,
+        r.rate(t.wins), r.rate(t.crushed + t.exploded), r.rate(t.crushed),
+        r.rate(t.exploded), r.rate(t.dead_ends), r.rate(t.made_progress),
+        r.rate(t.items_collected), r.rate(t.frames_survived),
+        r.difficulty(max_frames));
+  }
+}
+
+static void print_json(const vector<level_report>& reports,
+    const vector<size_t>& level_indexes, uint64_t max_frames) {
+  printf("[");
+  for (size_t x = 0; x < reports.size(); x++) {
+    const auto& r = reports[x];
+    const auto& t = r.totals;
+    printf("%s\n  {\"level\": %zu, \"w\": %" PRIu32 ", \"h\": %" PRIu32
+        ", \"items\": %" PRId32 ", \"playouts\": %" PRIu64
+        ", \"win_rate\": %.4f, \"death_rate\": %.4f, \"crushed_rate\": %.4f"
+        ", \"exploded_rate\": %.4f, \"dead_end_rate\": %.4f"
+        ", \"progress_rate\": %.4f, \"mean_items\": %.2f, \"mean_frames\": %.1f"
+        ", \"difficulty\": %.1f}", x ? "," : "", level_indexes[x], r.level->w,
+        r.level->h, r.level->num_items_remaining, t.playouts, r.rate(t.wins),
+        r.rate(t.crushed + t.exploded), r.rate(t.crushed), r.rate(t.exploded),
+        r.rate(t.dead_ends), r.rate(t.made_progress), r.rate(t.items_collected),
+        r.rate(t.frames_survived), r.difficulty(max_frames));
+  }
+  printf("\n]\n");
+}
+
+int main(int argc, char* argv[]) {
+  bool json = false;
+  int64_t only_level_index = -1;
+  uint64_t num_playouts = DEFAULT_PLAYOUTS;
+  uint64_t max_frames = DEFAULT_FRAMES;
+  playout_policy policy = playout_policy::Random;
+  uint64_t seed = 1;
+  size_t num_threads = 0;
+  vector<string> positional_args;
+  for (int x = 1; x < argc; x++) {
+    if (!strcmp(argv[x], "--csv")) {
+      json = false;
+    } else if (!strcmp(argv[x], "--json")) {
+      json = true;
+    } else if (!strncmp(argv[x], "--level=", 8)) {
+      only_level_index = strtoll(&argv[x][8], NULL, 10);
+    } else if (!strncmp(argv[x], "--playouts=", 11)) {
+      num_playouts = strtoull(&argv[x][11], NULL, 10);
+    } else if (!strncmp(argv[x], "--frames=", 9)) {
+      max_frames = strtoull(&argv[x][9], NULL, 10);
+    } else if (!strcmp(argv[x], "--policy=random")) {
+      policy = playout_policy::Random;
+    } else if (!strcmp(argv[x], "--policy=greedy")) {
+      policy = playout_policy::Greedy;
+    } else if (!strncmp(argv[x], "--seed=", 7)) {
+      seed = strtoull(&argv[x][7], NULL, 10);
+    } else if (!strncmp(argv[x], "--threads=", 10)) {
+      num_threads = strtoull(&argv[x][10], NULL, 10);
+    } else if (argv[x][0] == '-') {
+      fprintf(stderr, "unknown option: %s\n", argv[x]);
+      print_usage();
+      return 2;
+    } else {
+      positional_args.emplace_back(argv[x]);
+    }
+  }
+  if ((positional_args.size() != 1) || (num_playouts == 0) ||
+      (max_frames == 0)) {
+    print_usage();
+    return 2;
+  }
+  if (num_threads == 0) {
+    num_threads = default_thread_count();
+  }
+
+  try {
+    level_pack pack(positional_args[0]);
+    if (only_level_index >= static_cast<int64_t>(pack.size())) {
+      throw out_of_range("level index is beyond the end of the pack");
+    }
+
+    vector<size_t> level_indexes;
+    vector<level_report> reports;
+    vector<level_state> start_states;
+    for (size_t x = 0; x < pack.size(); x++) {
+      if ((only_level_index >= 0) && (static_cast<int64_t>(x) != only_level_index)) {
+        continue;
+      }
+      level_indexes.emplace_back(x);
+      reports.emplace_back();
+      reports.back().level = pack.get(x);
+      start_states.emplace_back(reports.back().level->instantiate().fork());
+    }
+
+    // every batch of every level is a separate task, so small packs still use
+    // every thread
+    uint64_t batches_per_level = (num_playouts + PLAYOUTS_PER_BATCH - 1) /
+        PLAYOUTS_PER_BATCH;
+    vector<playout_totals> batch_totals(reports.size() * batches_per_level);
+    vector<level_state> scratch(num_threads);
+    uint64_t start_time = now();
+    parallel_for(batch_totals.size(), [&](size_t index, size_t thread_index) {
+      size_t level = index / batches_per_level;
+      uint64_t batch = index % batches_per_level;
+      mt19937_64 rng(seed ^ (static_cast<uint64_t>(level_indexes[level]) << 32) ^
+          batch);
+      uint64_t count = min<uint64_t>(PLAYOUTS_PER_BATCH,
+          num_playouts - batch * PLAYOUTS_PER_BATCH);
+      level_state& l = scratch[thread_index];
+      for (uint64_t x = 0; x < count; x++) {
+        l = start_states[level];
+        run_playout(l, policy, max_frames, rng, batch_totals[index]);
+      }
+    }, num_threads);
+    double seconds = static_cast<double>(now() - start_time) / 1000000;
+
+    uint64_t total_frames = 0;
+    for (size_t x = 0; x < batch_totals.size(); x++) {
+      reports[x / batches_per_level].totals.add(batch_totals[x]);
+      total_frames += batch_totals[x].frames_executed;
+    }
+
+    if (json) {
+      print_json(reports, level_indexes, max_frames);
+    } else {
+      print_csv(reports, level_indexes, max_frames);
+    }
+
+    fprintf(stderr, "%zu levels, %" PRIu64 " playouts each, in %.1f seconds"
+        " (%.0f playouts and about %.0f frames per second)\n", reports.size(),
+        num_playouts, seconds, reports.size() * num_playouts / seconds,
+        total_frames / seconds);
+    return 0;
+
+  } catch (const exception& e) {
+    fprintf(stderr, "mbes-difficulty: %s\n", e.what());
+    return 2;
+  }
+}
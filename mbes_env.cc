@@ -0,0 +1,375 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+
+#include "level.hh"
+#include "level_pack.hh"
+#include "parallel.hh"
+
+using namespace std;
+
+
+// mbes-env: runs a batch of games without a window, for agents that learn to
+// play. a client controls it with a binary protocol over stdin and stdout (or
+// over a Unix socket, with --socket), and all the games in the batch move
+// forward one frame per step, in parallel.
+//
+// every request is a command byte followed by its arguments, and gets one
+// response starting with the same byte, or with 'e' if the request failed
+// (then a uint32 length and that many bytes of message; the connection can
+// still be used). numbers are in native byte order. the commands are:
+// - 'i': describe the batch. the response has uint32 num_envs, uint32
+//   num_levels (in the pack), and uint32 num_planes (see below).
+// - 'r' uint32 env, int32 level, uint64 seed: start the game in env over on a
+//   level. a negative level picks one at random using the seed. env can be
+//   0xFFFFFFFF to reset every env; then each one picks its own level with seed
+//   + its env number. the response has the observation for each env that was
+//   reset (just the one, or all of them in order).
+// - 's' followed by a byte for each env: run one frame in every env. the low 3
+//   bits of each byte are the player_impulse and bit 3 is drop_bomb. the
+//   response has, for each env, float reward, uint8 done and the observation.
+//   an env that's done stays as it is until it's reset.
+// - 'q': exit. closing the input does the same.
+//
+// an observation is uint32 w, uint32 h, int32 player_x, int32 player_y,
+// int32 items_remaining, int32 red_bombs and uint64 frames, followed by
+// num_planes planes of (w * h + 7) / 8 bytes each. bit n of plane t (starting
+// from the least significant bit of the first byte) is set if the cell at
+// (n % w, n / w) has cell type t.
+//
+// done is 0 while the game goes on, then 1 if the player won, 2 if they died,
+// 3 if the level is unwinnable (see level_state::unwinnable; a level that
+// already was when it was reset reports it on the first step), or 4 if the
+// game ran out of frames (--max-frames). the reward for a frame is the
+// item reward for each item collected, plus the win or loss reward if the game
+// ended that way (an unwinnable level counts as a loss), plus the step reward.
+
+static const size_t NUM_PLANES = WhiteBomb + 1;
+static const uint32_t ALL_ENVS = 0xFFFFFFFF;
+static const uint64_t DEFAULT_MAX_FRAMES = 5000;
+
+static void print_usage() {
+  fprintf(stderr, "\
+usage: mbes-env [options] PACK\n\
+\n\
+options:\n\
+  --envs=N: run N games at once (default: 1)\n\
+  --threads=N: step the games on N threads (default: one per core)\n\
+  --max-frames=N: end each game after N frames (default: %" PRIu64 "); 0 means\n\
+    no limit\n\
+  --socket=PATH: listen on a Unix socket at PATH instead of using stdin and\n\
+    stdout, and exit after the first client disconnects\n\
+  --item-reward=X: reward for each item collected (default: 1)\n\
+  --win-reward=X: reward for winning (default: 10)\n\
+  --loss-reward=X: reward for dying or making the level unwinnable\n\
+    (default: -10)\n\
+  --step-reward=X: reward for every frame (default: 0)\n\
+\n\
+see the comment at the top of mbes_env.cc for the protocol.\n",
+      DEFAULT_MAX_FRAMES);
+}
+
+enum class env_done : uint8_t {
+  Running = 0,
+  Won,
+  Died,
+  Unwinnable,
+  OutOfFrames,
+};
+
+struct reward_options {
+  float item;
+  float win;
+  float loss;
+  float step;
+};
+
+struct environment {
+  level_state state;
+  env_done done;
+
+  // the response for the last step, so stepping (which runs in parallel)
+  // doesn't have to touch the output
+  float reward;
+  string observation;
+
+  environment() : done(env_done::Running), reward(0) {
+    this->state.set_undo_log_enabled(false);
+  }
+};
+
+static void append_observation(string& out, const level_state& l) {
+  struct {
+    uint32_t w;
+    uint32_t h;
+    int32_t player_x;
+    int32_t player_y;
+    int32_t items_remaining;
+    int32_t red_bombs;
+    uint64_t frames;
+  } header = {l.w, l.h, l.player_x, l.player_y, l.num_items_remaining,
+      l.num_red_bombs, l.frames_executed};
+  out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  size_t plane_size = (l.cells.size() + 7) / 8;
+  size_t planes_offset = out.size();
+  out.resize(planes_offset + NUM_PLANES * plane_size, 0);
+  char* planes = &out[planes_offset];
+  for (size_t x = 0; x < l.cells.size(); x++) {
+    size_t type = l.cells[x].type;
+    if (type < NUM_PLANES) {
+      planes[type * plane_size + x / 8] |= (1 << (x & 7));
+    }
+  }
+}
+
+static void step_environment(environment& env, uint8_t action,
+    uint64_t max_frames, const reward_options& rewards) {
+  env.reward = 0;
+  if (env.done == env_done::Running) {
+    level_state& l = env.state;
+    player_actions actions;
+    actions.impulse = static_cast<player_impulse>(action & 7);
+    actions.drop_bomb = (action & 8) != 0;
+    if (actions.impulse > Right) {
+      actions.impulse = None;
+    }
+
+    int32_t prev_items_remaining = l.num_items_remaining;
+    l.exec_frame(actions);
+    env.reward = rewards.step +
+        rewards.item * (prev_items_remaining - l.num_items_remaining);
+    if (l.player_did_win) {
+      env.done = env_done::Won;
+      env.reward += rewards.win;
+    } else if (!l.player_is_alive()) {
+      env.done = env_done::Died;
+      env.reward += rewards.loss;
+    } else if (l.unwinnable) {
+      env.done = env_done::Unwinnable;
+      env.reward += rewards.loss;
+    } else if (max_frames && (l.frames_executed >= max_frames)) {
+      env.done = env_done::OutOfFrames;
+    }
+  }
+
+  env.observation.clear();
+  append_observation(env.observation, env.state);
+}
+
+static void reset_environment(environment& env, const level_pack& pack,
+    int32_t level_index, uint64_t seed) {
+  if (level_index < 0) {
+    mt19937_64 rng(seed);
+    level_index = rng() % pack.size();
+  } else if (static_cast<size_t>(level_index) >= pack.size()) {
+    throw out_of_range("level index is beyond the end of the pack");
+  }
+  env.state.reset(pack[level_index]);
+  env.done = env_done::Running;
+  env.reward = 0;
+}
+
+static void write_error(FILE* out, const char* message) {
+  uint32_t size = strlen(message);
+  fputc('e', out);
+  fwritex(out, &size, sizeof(size));
+  fwritex(out, message, size);
+}
+
+static void serve(FILE* in, FILE* out, level_pack& pack,
+    vector<environment>& envs, thread_pool& pool, uint64_t max_frames,
+    const reward_options& rewards) {
+  vector<uint8_t> actions(envs.size());
+  string response;
+  for (;;) {
+    int command = fgetc(in);
+    if ((command == EOF) || (command == 'q')) {
+      return;
+    }
+
+    response.clear();
+    try {
+      if (command == 'i') {
+        uint32_t info[3] = {static_cast<uint32_t>(envs.size()),
+            static_cast<uint32_t>(pack.size()),
+            static_cast<uint32_t>(NUM_PLANES)};
+        response.push_back('i');
+        response.append(reinterpret_cast<const char*>(info), sizeof(info));
+
+      } else if (command == 'r') {
+        uint32_t env_index;
+        int32_t level_index;
+        uint64_t seed;
+        freadx(in, &env_index, sizeof(env_index));
+        freadx(in, &level_index, sizeof(level_index));
+        freadx(in, &seed, sizeof(seed));
+
+        response.push_back('r');
+        if (env_index == ALL_ENVS) {
+          for (size_t x = 0; x < envs.size(); x++) {
+            reset_environment(envs[x], pack, level_index, seed + x);
+            append_observation(response, envs[x].state);
+          }
+        } else if (env_index < envs.size()) {
+          reset_environment(envs[env_index], pack, level_index, seed);
+          append_observation(response, envs[env_index].state);
+        } else {
+          throw out_of_range("env index is out of range");
+        }
+
+      } else if (command == 's') {
+        freadx(in, actions.data(), actions.size());
+        pool.parallel_for(envs.size(), [&](size_t index, size_t) {
+          step_environment(envs[index], actions[index], max_frames, rewards);
+        });
+
+        response.push_back('s');
+        for (const auto& env : envs) {
+          response.append(reinterpret_cast<const char*>(&env.reward),
+              sizeof(env.reward));
+          response.push_back(static_cast<char>(env.done));
+          response.append(env.observation);
+        }
+
+      } else {
+        // the rest of the input can't be parsed after this
+        throw invalid_argument(string_printf("unknown command: %d", command));
+      }
+
+    } catch (const invalid_argument& e) {
+      write_error(out, e.what());
+      fflush(out);
+      throw;
+    } catch (const out_of_range& e) {
+      write_error(out, e.what());
+      fflush(out);
+      continue;
+    }
+
+    fwritex(out, response.data(), response.size());
+    fflush(out);
+  }
+}
+
+// accepts one client on a Unix socket at path
+static int accept_client(const string& path) {
+  struct sockaddr_un addr;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw invalid_argument("socket path is too long");
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    throw runtime_error("can\'t create socket");
+  }
+  unlink(path.c_str());
+  if (bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) ||
+      listen(listen_fd, 1)) {
+    close(listen_fd);
+    throw runtime_error("can\'t listen on " + path);
+  }
+  fprintf(stderr, "listening on %s\n", path.c_str());
+  int fd = accept(listen_fd, NULL, NULL);
+  close(listen_fd);
+  unlink(path.c_str());
+  if (fd < 0) {
+    throw runtime_error("can\'t accept a client on " + path);
+  }
+  return fd;
+}
+
+int main(int argc, char* argv[]) {
+  size_t num_envs = 1;
+  size_t num_threads = 0;
+  uint64_t max_frames = DEFAULT_MAX_FRAMES;
+  string socket_path;
+  reward_options rewards = {1, 10, -10, 0};
+  vector<string> positional_args;
+  for (int x = 1; x < argc; x++) {
+    if (!strncmp(argv[x], "--envs=", 7)) {
+      num_envs = strtoull(&argv[x][7], NULL, 10);
+    } else if (!strncmp(argv[x], "--threads=", 10)) {
+      num_threads = strtoull(&argv[x][10], NULL, 10);
+    } else if (!strncmp(argv[x], "--max-frames=", 13)) {
+      max_frames = strtoull(&argv[x][13], NULL, 10);
+    } else if (!strncmp(argv[x], "--socket=", 9)) {
+      socket_path = &argv[x][9];
+    } else if (!strncmp(argv[x], "--item-reward=", 14)) {
+      rewards.item = strtod(&argv[x][14], NULL);
+    } else if (!strncmp(argv[x], "--win-reward=", 13)) {
+      rewards.win = strtod(&argv[x][13], NULL);
+    } else if (!strncmp(argv[x], "--loss-reward=", 14)) {
+      rewards.loss = strtod(&argv[x][14], NULL);
+    } else if (!strncmp(argv[x], "--step-reward=", 14)) {
+      rewards.step = strtod(&argv[x][14], NULL);
+    } else if (argv[x][0] == '-') {
+      fprintf(stderr, "unknown option: %s\n", argv[x]);
+      print_usage();
+      return 2;
+    } else {
+      positional_args.emplace_back(argv[x]);
+    }
+  }
+  if ((positional_args.size() != 1) || (num_envs == 0)) {
+    print_usage();
+    return 2;
+  }
+
+  try {
+    level_pack pack(positional_args[0]);
+    if (pack.size() == 0) {
+      throw runtime_error("the pack has no levels");
+    }
+
+    // every env starts on the first level, so a client can step without
+    // resetting first
+    vector<environment> envs(num_envs);
+    for (auto& env : envs) {
+      reset_environment(env, pack, 0, 0);
+    }
+    // a step only takes microseconds per env, so the threads are started once
+    // rather than for every step
+    thread_pool pool(num_threads);
+
+    if (socket_path.empty()) {
+      serve(stdin, stdout, pack, envs, pool, max_frames, rewards);
+    } else {
+      int fd = accept_client(socket_path);
+      FILE* in = fdopen(fd, "rb");
+      FILE* out = fdopen(dup(fd), "wb");
+      if (!in || !out) {
+        throw runtime_error("can\'t open the client connection");
+      }
+      try {
+        serve(in, out, pack, envs, pool, max_frames, rewards);
+      } catch (const exception&) {
+        fclose(in);
+        fclose(out);
+        throw;
+      }
+      fclose(in);
+      fclose(out);
+    }
+    return 0;
+
+  } catch (const exception& e) {
+    fprintf(stderr, "mbes-env: %s\n", e.what());
+    return 2;
+  }
+}
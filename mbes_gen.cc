@@ -0,0 +1,352 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+
+#include "action_buffer.hh"
+#include "level.hh"
+#include "level_pack.hh"
+#include "parallel.hh"
+#include "recording.hh"
+#include "replay.hh"
+#include "solver.hh"
+
+using namespace std;
+
+
+// mbes-gen: generates random levels and keeps the ones that can be won.
+//
+// each candidate is laid out from a template (how much of the level is
+// circuit, rocks, items and bombs, how many dudes, and how many walls with a
+// portal through them) and a seed, then solve_level looks for a solution
+// within a small frame and time limit. candidates that have items to collect,
+// can be won, and whose shortest solution isn't too short to be interesting
+// are written to the output pack, each with its solution as a witness
+// recording. the solver simulates on forks of the candidate, so nothing is
+// written to an undo log.
+//
+// most candidates are rejected, so they're generated and solved in batches on
+// every core, one candidate per thread (the solver's own threads would mostly
+// wait on each other for searches this small). candidate N always uses seed
+// SEED + N and the candidates are accepted in order, so the output only
+// depends on the options, not on the number of threads or how long each
+// search happened to take (unless a search hits the time limit).
+
+struct level_template_params {
+  const char* name;
+  double circuit;
+  double rock;
+  double item;
+  double bomb;
+  size_t num_dudes;
+  size_t num_portal_walls;
+};
+
+static const level_template_params BUILTIN_TEMPLATES[] = {
+  {"open",    0.20, 0.05, 0.020, 0.00, 0, 0},
+  {"mine",    0.60, 0.12, 0.015, 0.01, 0, 0},
+  {"bombs",   0.45, 0.08, 0.015, 0.04, 1, 0},
+  {"dudes",   0.35, 0.05, 0.010, 0.01, 2, 0},
+  {"portals", 0.40, 0.06, 0.015, 0.01, 0, 2},
+};
+
+static void print_usage() {
+  fprintf(stderr, "\
+usage: mbes-gen [options] OUTPUT_PACK\n\
+\n\
+writes the accepted levels to OUTPUT_PACK and the solution to each one to\n\
+OUTPUT_PACK_000.mbr, OUTPUT_PACK_001.mbr, etc. (without the .mbl).\n\
+\n\
+options:\n\
+  --count=N: accept this many levels (default: 10)\n\
+  --max-candidates=N: give up after generating this many (default: 100000)\n\
+  --seed=N: seed of the first candidate (default: 1)\n\
+  --size=WxH: level size, including the border (default: 20x12)\n\
+  --template=NAME: starting densities; one of open, mine, bombs, dudes,\n\
+    portals (default: mine)\n\
+  --circuit=F, --rock=F, --item=F, --bomb=F: override the fraction of the\n\
+    level's interior that's made of each type of cell\n\
+  --dudes=N, --portal-walls=N: override the number of dudes and walls with a\n\
+    portal in them\n\
+  --min-items=N: reject levels with fewer items to collect (default: 1)\n\
+  --min-frames=N: reject levels that can be won in fewer frames (default: 15)\n\
+  --max-frames=N: reject levels that can\'t be won in this many frames\n\
+    (default: 100)\n\
+  --seconds=N: time limit for solving each candidate (default: 2)\n\
+  --memory=N: megabytes for each solver\'s table (default: 8)\n\
+  --threads=N: solve N candidates at once (default: one per core)\n");
+}
+
+struct candidate {
+  level_state level;
+  solver_result result;
+};
+
+// lays out a level. the border is made of blocks, like the level_state
+// constructor makes it
+static level_state generate_level(const level_template_params& t, uint32_t w,
+    uint32_t h, uint64_t seed) {
+  mt19937_64 rng(seed);
+  uniform_real_distribution<double> unit(0.0, 1.0);
+  auto random_int = [&](int32_t min, int32_t max) -> int32_t {
+    return uniform_int_distribution<int32_t>(min, max)(rng);
+  };
+
+  int32_t player_x = random_int(1, w - 2);
+  int32_t player_y = random_int(1, h - 2);
+  level_state l(w, h, player_x, player_y);
+
+  // walls with a portal through them. the cells on either side of each portal
+  // are cleared so it can be used
+  for (size_t z = 0; z < t.num_portal_walls; z++) {
+    bool vertical = unit(rng) < 0.5;
+    if (vertical) {
+      int32_t x = random_int(2, w - 3);
+      int32_t portal_y = random_int(1, h - 2);
+      for (int32_t y = 1; y < static_cast<int32_t>(h) - 1; y++) {
+        l.at(x, y) = cell_state((y == portal_y) ? HorizontalPortal : Block);
+      }
+      l.at(x - 1, portal_y) = cell_state(Empty, 1);
+      l.at(x + 1, portal_y) = cell_state(Empty, 1);
+    } else {
+      int32_t y = random_int(2, h - 3);
+      int32_t portal_x = random_int(1, w - 2);
+      for (int32_t x = 1; x < static_cast<int32_t>(w) - 1; x++) {
+        l.at(x, y) = cell_state((x == portal_x) ? VerticalPortal : Block);
+      }
+      l.at(portal_x, y - 1) = cell_state(Empty, 1);
+      l.at(portal_x, y + 1) = cell_state(Empty, 1);
+    }
+  }
+  l.at(player_x, player_y) = cell_state(Player);
+
+  // everything else is filled in at random; only empty cells are filled so the
+  // walls and the player stay where they are. bombs are mostly green, so they
+  // can be pushed and dropped, with some red ones to pick up
+  for (int32_t y = 1; y < static_cast<int32_t>(h) - 1; y++) {
+    for (int32_t x = 1; x < static_cast<int32_t>(w) - 1; x++) {
+      cell_state& c = l.at(x, y);
+      if ((c.type != Empty) || ((abs(x - player_x) <= 1) && (y == player_y))) {
+        continue;
+      }
+      double r = unit(rng);
+      if ((r -= t.circuit) < 0) {
+        c = cell_state(Circuit);
+      } else if ((r -= t.rock) < 0) {
+        c = cell_state(Rock);
+      } else if ((r -= t.item) < 0) {
+        c = cell_state(Item);
+      } else if ((r -= t.bomb) < 0) {
+        c = cell_state((unit(rng) < 0.75) ? GreenBomb : RedBomb);
+      }
+    }
+  }
+
+  // the exit goes somewhere at least a third of the way across the level, so
+  // it's never right next to the player
+  int32_t min_exit_distance = (w + h) / 3;
+  for (;;) {
+    int32_t x = random_int(1, w - 2);
+    int32_t y = random_int(1, h - 2);
+    if ((abs(x - player_x) + abs(y - player_y) >= min_exit_distance) &&
+        (l.at(x, y).type != Player) && !l.at(x, y).is_portal(Left) &&
+        !l.at(x, y).is_portal(Up)) {
+      l.at(x, y) = cell_state(Exit);
+      break;
+    }
+  }
+
+  // dudes start in empty space, facing left like the editor places them
+  for (size_t z = 0; z < t.num_dudes; z++) {
+    for (size_t attempt = 0; attempt < 100; attempt++) {
+      cell_state& c = l.at(random_int(1, w - 2), random_int(1, h - 2));
+      if (c.type == Empty) {
+        c = cell_state((unit(rng) < 0.5) ? BombDude : ItemDude, Left);
+        break;
+      }
+    }
+  }
+
+  l.num_items_remaining = l.count_cells_of_type(Item);
+  l.recompute_winnability();
+  return l;
+}
+
+int main(int argc, char* argv[]) {
+  size_t count = 10;
+  size_t max_candidates = 100000;
+  uint64_t seed = 1;
+  uint32_t w = 20, h = 12;
+  int32_t min_items = 1;
+  uint64_t min_frames = 15;
+  size_t num_threads = 0;
+  double seconds = 2;
+  level_template_params t = BUILTIN_TEMPLATES[1];
+
+  solver_options options;
+  options.num_threads = 1;
+  options.max_frames = 100;
+  options.table_size = 8 * 1024 * 1024;
+
+  vector<string> positional_args;
+  vector<string> overrides;
+  for (int x = 1; x < argc; x++) {
+    if (!strncmp(argv[x], "--count=", 8)) {
+      count = strtoull(&argv[x][8], NULL, 10);
+    } else if (!strncmp(argv[x], "--max-candidates=", 17)) {
+      max_candidates = strtoull(&argv[x][17], NULL, 10);
+    } else if (!strncmp(argv[x], "--seed=", 7)) {
+      seed = strtoull(&argv[x][7], NULL, 10);
+    } else if (!strncmp(argv[x], "--size=", 7)) {
+      if ((sscanf(&argv[x][7], "%" SCNu32 "x%" SCNu32, &w, &h) != 2) ||
+          (w < 8) || (h < 8)) {
+        fprintf(stderr, "invalid size: %s\n", &argv[x][7]);
+        return 2;
+      }
+    } else if (!strncmp(argv[x], "--template=", 11)) {
+      bool found = false;
+      for (const auto& builtin : BUILTIN_TEMPLATES) {
+        if (!strcmp(builtin.name, &argv[x][11])) {
+          t = builtin;
+          found = true;
+        }
+      }
+      if (!found) {
+        fprintf(stderr, "unknown template: %s\n", &argv[x][11]);
+        return 2;
+      }
+    } else if (!strncmp(argv[x], "--circuit=", 10) ||
+        !strncmp(argv[x], "--rock=", 7) || !strncmp(argv[x], "--item=", 7) ||
+        !strncmp(argv[x], "--bomb=", 7) || !strncmp(argv[x], "--dudes=", 8) ||
+        !strncmp(argv[x], "--portal-walls=", 15)) {
+      // applied after the template, whichever order they're given in
+      overrides.emplace_back(argv[x]);
+    } else if (!strncmp(argv[x], "--min-items=", 12)) {
+      min_items = strtol(&argv[x][12], NULL, 10);
+    } else if (!strncmp(argv[x], "--min-frames=", 13)) {
+      min_frames = strtoull(&argv[x][13], NULL, 10);
+    } else if (!strncmp(argv[x], "--max-frames=", 13)) {
+      options.max_frames = strtoull(&argv[x][13], NULL, 10);
+    } else if (!strncmp(argv[x], "--seconds=", 10)) {
+      seconds = strtod(&argv[x][10], NULL);
+    } else if (!strncmp(argv[x], "--memory=", 9)) {
+      options.table_size = strtoull(&argv[x][9], NULL, 10) * 1024 * 1024;
+    } else if (!strncmp(argv[x], "--threads=", 10)) {
+      num_threads = strtoull(&argv[x][10], NULL, 10);
+    } else if (argv[x][0] == '-') {
+      fprintf(stderr, "unknown option: %s\n", argv[x]);
+      print_usage();
+      return 2;
+    } else {
+      positional_args.emplace_back(argv[x]);
+    }
+  }
+  if (positional_args.size() != 1) {
+    print_usage();
+    return 2;
+  }
+  for (const string& o : overrides) {
+    size_t eq = o.find('=');
+    string name = o.substr(2, eq - 2);
+    const char* value = o.c_str() + eq + 1;
+    if (name == "circuit") {
+      t.circuit = strtod(value, NULL);
+    } else if (name == "rock") {
+      t.rock = strtod(value, NULL);
+    } else if (name == "item") {
+      t.item = strtod(value, NULL);
+    } else if (name == "bomb") {
+      t.bomb = strtod(value, NULL);
+    } else if (name == "dudes") {
+      t.num_dudes = strtoull(value, NULL, 10);
+    } else {
+      t.num_portal_walls = strtoull(value, NULL, 10);
+    }
+  }
+  options.time_limit_usecs = seconds * 1000000;
+  if (num_threads == 0) {
+    num_threads = default_thread_count();
+  }
+
+  const string& output_filename = positional_args[0];
+  string recording_prefix = output_filename;
+  if ((recording_prefix.size() > 4) &&
+      !recording_prefix.compare(recording_prefix.size() - 4, 4, ".mbl")) {
+    recording_prefix.resize(recording_prefix.size() - 4);
+  }
+
+  try {
+    level_pack_writer writer(output_filename);
+    size_t num_unsolvable = 0, num_timed_out = 0, num_trivial = 0;
+    size_t num_too_few_items = 0;
+    uint64_t start_time = now();
+
+    // a few candidates per thread per batch, so stealing can balance out
+    // searches that end quickly against ones that run into the time limit
+    size_t batch_size = num_threads * 4;
+    size_t next_candidate = 0;
+    while ((writer.size() < count) && (next_candidate < max_candidates)) {
+      size_t batch_count = min<size_t>(batch_size, max_candidates - next_candidate);
+      vector<candidate> batch(batch_count);
+      parallel_for(batch_count, [&](size_t index, size_t) {
+        candidate& c = batch[index];
+        c.level = generate_level(t, w, h, seed + next_candidate + index);
+        if (c.level.num_items_remaining >= min_items) {
+          c.result = solve_level(c.level, options);
+        }
+      }, num_threads);
+
+      for (size_t x = 0; (x < batch_count) && (writer.size() < count); x++) {
+        const candidate& c = batch[x];
+        if (c.level.num_items_remaining < min_items) {
+          num_too_few_items++;
+          continue;
+        }
+        if (!c.result.solved) {
+          (c.result.timed_out ? num_timed_out : num_unsolvable)++;
+          continue;
+        }
+        if (c.result.solution.size() < min_frames) {
+          num_trivial++;
+          continue;
+        }
+
+        // the solver identifies states by hash, so make sure the witness
+        // really wins before keeping the level
+        if (replay_recording(c.level, c.result.solution).stats.state != Completed) {
+          throw logic_error("a solution doesn\'t win when replayed");
+        }
+        string recording_filename = string_printf("%s_%03zu.mbr",
+            recording_prefix.c_str(), writer.size());
+        save_recording(recording_filename, c.result.solution, c.level);
+        writer.add(c.level);
+
+        fprintf(stderr, "candidate %zu (seed %" PRIu64 "): accepted as level %zu,"
+            " %zu frames, %" PRId32 " items\n", next_candidate + x,
+            seed + next_candidate + x, writer.size() - 1,
+            c.result.solution.size(), c.level.num_items_remaining);
+      }
+      next_candidate += batch_count;
+    }
+    writer.finish();
+
+    fprintf(stderr, "%zu candidates in %.1f seconds: %zu accepted, %zu with too"
+        " few items, %zu unsolvable, %zu timed out, %zu too short; wrote %s\n",
+        next_candidate, static_cast<double>(now() - start_time) / 1000000,
+        writer.size(), num_too_few_items, num_unsolvable, num_timed_out,
+        num_trivial, output_filename.c_str());
+    return (writer.size() < count) ? 1 : 0;
+
+  } catch (const exception& e) {
+    fprintf(stderr, "mbes-gen: %s\n", e.what());
+    return 2;
+  }
+}
@@ -0,0 +1,286 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+
+#include "action_buffer.hh"
+#include "level.hh"
+#include "level_pack.hh"
+#include "parallel.hh"
+#include "recording.hh"
+#include "replay.hh"
+
+using namespace std;
+
+
+// mbes-optimize: shortens a winning recording without making it lose.
+//
+// two kinds of edits are tried, over and over until neither finds anything:
+// - loops are cut out. if the game is in the same state (by
+//   level_state::gameplay_hash) at two different frames, everything between
+//   them can be removed, since what happens afterward only depends on that
+//   state. this removes back-and-forth and waiting in places where nothing
+//   else is moving, without simulating anything beyond one replay.
+// - windows of frames are deleted, starting with long windows and moving on to
+//   shorter ones. each candidate is re-simulated from the nearest checkpoint
+//   of the current recording, and is kept if it still wins. the simulation
+//   stops early if the edited run reaches the same state as the original one
+//   at the corresponding frame, since it will then win the same way. the
+//   candidates are simulated in parallel, but the earliest one that works is
+//   always the one that's kept, so the result doesn't depend on the number of
+//   threads.
+//
+// every edit that's kept makes the recording shorter and still wins, so the
+// output is never longer than the input; it's replayed once more before
+// saving, to make sure.
+
+static const uint64_t CHECKPOINT_INTERVAL = 32;
+static const size_t DEFAULT_MAX_WINDOW = 64;
+static const uint64_t DEFAULT_SECONDS = 60;
+
+static void print_usage() {
+  fprintf(stderr, "\
+usage: mbes-optimize [options] PACK INPUT_RECORDING OUTPUT_RECORDING\n\
+\n\
+options:\n\
+  --level=N: the recording was made on level N (required if it has no\n\
+    fingerprint)\n\
+  --threads=N: simulate on N threads (default: one per core)\n\
+  --seconds=N: stop after about N seconds (default: %" PRIu64 ")\n\
+  --max-window=N: the longest stretch of frames to try deleting at once\n\
+    (default: %zu)\n", DEFAULT_SECONDS, DEFAULT_MAX_WINDOW);
+}
+
+// a winning recording along with what's needed to try edits on it quickly:
+// the state's gameplay hash after every frame, and the whole state every
+// CHECKPOINT_INTERVAL frames
+struct analyzed_run {
+  vector<player_actions> actions;
+  vector<uint64_t> hashes; // hashes[x] is the hash after x frames
+  vector<level_state> checkpoints;
+};
+
+// replays the actions, stopping at the win, and fills in everything else.
+// returns false if they don't win
+static bool analyze(const level_state& level,
+    const vector<player_actions>& actions, analyzed_run& run) {
+  run.actions.clear();
+  run.hashes.clear();
+  run.checkpoints.clear();
+
+  level_state l = level.fork();
+  run.hashes.emplace_back(l.gameplay_hash());
+  run.checkpoints.emplace_back(l);
+  for (const auto& a : actions) {
+    l.exec_frame(a);
+    run.actions.emplace_back(a);
+    run.hashes.emplace_back(l.gameplay_hash());
+    if (l.player_did_win) {
+      return true;
+    }
+    if ((run.actions.size() % CHECKPOINT_INTERVAL) == 0) {
+      run.checkpoints.emplace_back(l);
+    }
+  }
+  return false;
+}
+
+// removes every stretch between two frames with the same state. for each
+// state, the run continues from the last frame it appears at
+static vector<player_actions> cut_loops(const analyzed_run& run) {
+  unordered_map<uint64_t, size_t> last_frame_for_hash;
+  for (size_t x = 0; x < run.hashes.size(); x++) {
+    last_frame_for_hash[run.hashes[x]] = x;
+  }
+
+  vector<player_actions> ret;
+  for (size_t x = last_frame_for_hash.at(run.hashes[0]);
+       x < run.actions.size();
+       x = last_frame_for_hash.at(run.hashes[x + 1])) {
+    ret.emplace_back(run.actions[x]);
+  }
+  return ret;
+}
+
+// simulates the run with frames [start, start + count) deleted. returns the
+// length of the edited run if it wins, or 0 if it doesn't
+static size_t try_delete(const analyzed_run& run, size_t start, size_t count) {
+  size_t checkpoint_index = start / CHECKPOINT_INTERVAL;
+  level_state l = run.checkpoints[checkpoint_index];
+  for (size_t x = checkpoint_index * CHECKPOINT_INTERVAL; x < start; x++) {
+    l.exec_frame(run.actions[x]);
+  }
+
+  size_t original_length = run.actions.size();
+  for (size_t x = start + count; x < original_length; x++) {
+    // if the edited run is where the original one was at this point, the rest
+    // of it plays out the same way
+    if (l.gameplay_hash() == run.hashes[x]) {
+      return original_length - count;
+    }
+    l.exec_frame(run.actions[x]);
+    if (l.player_did_win) {
+      return x - count + 1;
+    }
+    if (!l.player_is_alive()) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+static vector<player_actions> apply_delete(const analyzed_run& run,
+    size_t start, size_t count, size_t new_length) {
+  vector<player_actions> ret(run.actions.begin(), run.actions.begin() + start);
+  ret.insert(ret.end(), run.actions.begin() + start + count, run.actions.end());
+  ret.resize(new_length);
+  return ret;
+}
+
+int main(int argc, char* argv[]) {
+  int64_t level_index = -1;
+  size_t num_threads = 0;
+  uint64_t seconds = DEFAULT_SECONDS;
+  size_t max_window = DEFAULT_MAX_WINDOW;
+  vector<string> positional_args;
+  for (int x = 1; x < argc; x++) {
+    if (!strncmp(argv[x], "--level=", 8)) {
+      level_index = strtoll(&argv[x][8], NULL, 10);
+    } else if (!strncmp(argv[x], "--threads=", 10)) {
+      num_threads = strtoull(&argv[x][10], NULL, 10);
+    } else if (!strncmp(argv[x], "--seconds=", 10)) {
+      seconds = strtoull(&argv[x][10], NULL, 10);
+    } else if (!strncmp(argv[x], "--max-window=", 13)) {
+      max_window = strtoull(&argv[x][13], NULL, 10);
+    } else if (argv[x][0] == '-') {
+      fprintf(stderr, "unknown option: %s\n", argv[x]);
+      print_usage();
+      return 2;
+    } else {
+      positional_args.emplace_back(argv[x]);
+    }
+  }
+  if ((positional_args.size() != 3) || (max_window == 0)) {
+    print_usage();
+    return 2;
+  }
+  if (num_threads == 0) {
+    num_threads = default_thread_count();
+  }
+
+  try {
+    level_pack pack(positional_args[0]);
+    recording_file r = load_recording_file(positional_args[1]);
+    if (level_index < 0) {
+      if (!r.has_fingerprint) {
+        throw runtime_error("recording has no fingerprint; use --level");
+      }
+      for (size_t x = 0; x < pack.size(); x++) {
+        if (r.matches_level(pack[x])) {
+          level_index = x;
+          break;
+        }
+      }
+      if (level_index < 0) {
+        throw runtime_error("recording was made on a level that isn\'t in this pack");
+      }
+    } else if (static_cast<size_t>(level_index) >= pack.size()) {
+      throw out_of_range("level index is beyond the end of the pack");
+    }
+    level_state level = pack[level_index].instantiate();
+
+    uint64_t start_time = now();
+    uint64_t deadline = start_time + seconds * 1000000;
+    auto elapsed = [&]() -> double {
+      return static_cast<double>(now() - start_time) / 1000000;
+    };
+
+    vector<player_actions> input;
+    for (const auto& a : r.actions) {
+      input.emplace_back(a);
+    }
+    analyzed_run run;
+    if (!analyze(level, input, run)) {
+      throw runtime_error("the recording doesn\'t win");
+    }
+    size_t input_length = input.size();
+    fprintf(stderr, "input: %zu frames (wins after %zu)\n", input_length,
+        run.actions.size());
+
+    bool changed = true;
+    while (changed && (now() < deadline)) {
+      changed = false;
+
+      vector<player_actions> cut = cut_loops(run);
+      if (cut.size() < run.actions.size()) {
+        size_t prev_length = run.actions.size();
+        if (!analyze(level, cut, run)) {
+          throw logic_error("cutting loops made the recording lose");
+        }
+        fprintf(stderr, "cut loops: %zu -> %zu frames (%.1f seconds)\n",
+            prev_length, run.actions.size(), elapsed());
+      }
+
+      // batches are a few candidates per thread, so stealing can balance out
+      // candidates that fail quickly against ones that simulate to the end
+      size_t batch_size = num_threads * 4;
+      for (size_t window = max_window; window > 0; window /= 2) {
+        for (size_t start = 0; (start + window < run.actions.size()) &&
+             (now() < deadline);) {
+          size_t batch_end = min<size_t>(start + batch_size,
+              run.actions.size() - window);
+          vector<size_t> new_lengths(batch_end - start, 0);
+          parallel_for(new_lengths.size(), [&](size_t index, size_t) {
+            new_lengths[index] = try_delete(run, start + index, window);
+          }, num_threads);
+
+          size_t index = 0;
+          while ((index < new_lengths.size()) && !new_lengths[index]) {
+            index++;
+          }
+          if (index == new_lengths.size()) {
+            start = batch_end;
+            continue;
+          }
+
+          size_t prev_length = run.actions.size();
+          vector<player_actions> edited = apply_delete(run, start + index,
+              window, new_lengths[index]);
+          if (!analyze(level, edited, run)) {
+            throw logic_error("deleting frames made the recording lose");
+          }
+          fprintf(stderr, "deleted %zu frames at %zu: %zu -> %zu frames (%.1f seconds)\n",
+              window, start + index, prev_length, run.actions.size(), elapsed());
+          start += index;
+          changed = true;
+        }
+      }
+    }
+
+    action_buffer output;
+    for (const auto& a : run.actions) {
+      output.push_back(a);
+    }
+    replay_result replay = replay_recording(level, output);
+    if ((replay.stats.state != Completed) || (output.size() > input_length)) {
+      throw logic_error("the optimized recording doesn\'t win");
+    }
+    save_recording(positional_args[2], output, level);
+
+    fprintf(stderr, "%zu -> %zu frames (%.1f seconds); saved %s\n",
+        input_length, output.size(), elapsed(), positional_args[2].c_str());
+    return 0;
+
+  } catch (const exception& e) {
+    fprintf(stderr, "mbes-optimize: %s\n", e.what());
+    return 2;
+  }
+}
@@ -0,0 +1,269 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <phosg/Strings.hh>
+
+#include "level.hh"
+#include "level_completion.hh"
+#include "level_pack.hh"
+
+using namespace std;
+
+
+// mbes-pack: merges, splits, reorders and deduplicates level packs.
+//
+// levels are identified by their content hash (level_state::hash), so two
+// levels are duplicates if they're identical no matter which packs they came
+// from or how those packs were encoded. packs are streamed: each level is
+// decoded (if at all) only while it's being hashed or copied, and the output is
+// written with level_pack_writer, so only the packs' directories and the set of
+// hashes are held in memory.
+
+static void print_usage() {
+  fprintf(stderr, "\
+usage: mbes-pack <command> [arguments]\n\
+\n\
+commands:\n\
+  list PACK\n\
+    print the index, content hash, size and item count of each level\n\
+  merge [--keep-duplicates] OUTPUT INPUT [INPUT ...]\n\
+    concatenate the input packs. unless --keep-duplicates is given, only the\n\
+    first copy of each level is kept\n\
+  dedup INPUT OUTPUT\n\
+    remove all but the first copy of each level\n\
+  split INPUT OUTPUT_PREFIX LEVELS_PER_PACK\n\
+    write the levels to OUTPUT_PREFIX_000.mbl, OUTPUT_PREFIX_001.mbl, etc.\n\
+  reorder INPUT OUTPUT ORDER\n\
+    write the levels in the given order, which is a comma-separated list of\n\
+    level indexes and ranges (e.g. 4,0-3,10-). levels can be repeated or left\n\
+    out\n\
+  remap-progress OLD_PACK NEW_PACK PROGRESS OUTPUT_PROGRESS\n\
+    convert a progress file for OLD_PACK into one for NEW_PACK, matching levels\n\
+    by content hash. levels that aren't in OLD_PACK start out not attempted\n");
+}
+
+static uint64_t level_hash(const level_pack& pack, size_t index) {
+  return pack.decode(index).hash();
+}
+
+static size_t parse_index(const string& s, size_t num_levels) {
+  char* end;
+  unsigned long long index = strtoull(s.c_str(), &end, 10);
+  if (s.empty() || *end) {
+    throw invalid_argument("invalid level index: " + s);
+  }
+  if (index >= num_levels) {
+    throw out_of_range(string_printf("level %llu is beyond the end of the pack (%zu levels)",
+        index, num_levels));
+  }
+  return index;
+}
+
+static vector<size_t> parse_order(const string& order, size_t num_levels) {
+  vector<size_t> ret;
+  for (const string& item : split(order, ',')) {
+    size_t dash = item.find('-');
+    if (dash == string::npos) {
+      ret.emplace_back(parse_index(item, num_levels));
+      continue;
+    }
+
+    // ranges are inclusive; an open-ended range goes to the last level
+    size_t start = parse_index(item.substr(0, dash), num_levels);
+    string end_str = item.substr(dash + 1);
+    size_t end = end_str.empty() ? num_levels - 1 : parse_index(end_str, num_levels);
+    if (start > end) {
+      throw invalid_argument("range is reversed: " + item);
+    }
+    for (size_t x = start; x <= end; x++) {
+      ret.emplace_back(x);
+    }
+  }
+  return ret;
+}
+
+static int command_list(const vector<string>& args) {
+  if (args.size() != 1) {
+    print_usage();
+    return 1;
+  }
+
+  level_pack pack(args[0]);
+  for (size_t x = 0; x < pack.size(); x++) {
+    level_state l = pack.decode(x);
+    printf("%zu: %016" PRIX64 " %" PRIu32 "x%" PRIu32 ", %" PRId32 " items\n",
+        x, l.hash(), l.w, l.h, l.num_items_remaining);
+  }
+  return 0;
+}
+
+static void write_merged(const string& output_filename,
+    const vector<string>& input_filenames, bool keep_duplicates) {
+  // open all the inputs before writing anything, since the output may replace
+  // one of them
+  vector<level_pack> inputs;
+  for (const string& filename : input_filenames) {
+    inputs.emplace_back(filename);
+  }
+
+  level_pack_writer w(output_filename);
+  unordered_set<uint64_t> seen_hashes;
+  size_t num_duplicates = 0;
+  for (const level_pack& pack : inputs) {
+    for (size_t x = 0; x < pack.size(); x++) {
+      if (!keep_duplicates && !seen_hashes.emplace(level_hash(pack, x)).second) {
+        num_duplicates++;
+        continue;
+      }
+      w.add(pack, x);
+    }
+  }
+  w.finish();
+
+  fprintf(stderr, "wrote %zu levels to %s (%zu duplicates removed)\n",
+      w.size(), output_filename.c_str(), num_duplicates);
+}
+
+static int command_merge(const vector<string>& args) {
+  bool keep_duplicates = !args.empty() && (args[0] == "--keep-duplicates");
+  size_t output_index = keep_duplicates ? 1 : 0;
+  if (args.size() < output_index + 2) {
+    print_usage();
+    return 1;
+  }
+  write_merged(args[output_index],
+      vector<string>(args.begin() + output_index + 1, args.end()),
+      keep_duplicates);
+  return 0;
+}
+
+static int command_dedup(const vector<string>& args) {
+  if (args.size() != 2) {
+    print_usage();
+    return 1;
+  }
+  write_merged(args[1], vector<string>(1, args[0]), false);
+  return 0;
+}
+
+static int command_split(const vector<string>& args) {
+  if (args.size() != 3) {
+    print_usage();
+    return 1;
+  }
+  size_t levels_per_pack = strtoull(args[2].c_str(), NULL, 10);
+  if (levels_per_pack == 0) {
+    throw invalid_argument("LEVELS_PER_PACK must be positive");
+  }
+
+  level_pack pack(args[0]);
+  for (size_t start = 0, pack_index = 0; start < pack.size();
+       start += levels_per_pack, pack_index++) {
+    string filename = string_printf("%s_%03zu.mbl", args[1].c_str(), pack_index);
+    level_pack_writer w(filename);
+    for (size_t x = start; (x < start + levels_per_pack) && (x < pack.size()); x++) {
+      w.add(pack, x);
+    }
+    w.finish();
+    fprintf(stderr, "wrote %zu levels to %s\n", w.size(), filename.c_str());
+  }
+  return 0;
+}
+
+static int command_reorder(const vector<string>& args) {
+  if (args.size() != 3) {
+    print_usage();
+    return 1;
+  }
+
+  level_pack pack(args[0]);
+  vector<size_t> order = parse_order(args[2], pack.size());
+
+  level_pack_writer w(args[1]);
+  for (size_t index : order) {
+    w.add(pack, index);
+  }
+  w.finish();
+
+  fprintf(stderr, "wrote %zu levels to %s\n", w.size(), args[1].c_str());
+  return 0;
+}
+
+static int command_remap_progress(const vector<string>& args) {
+  if (args.size() != 4) {
+    print_usage();
+    return 1;
+  }
+
+  level_pack old_pack(args[0]);
+  level_pack new_pack(args[1]);
+  vector<level_completion> old_lc = load_level_completion_state(args[2]);
+  old_lc.resize(old_pack.size());
+
+  // if a level appears more than once in the old pack, its new entry keeps the
+  // best of all of them
+  unordered_map<uint64_t, level_completion> hash_to_lc;
+  for (size_t x = 0; x < old_pack.size(); x++) {
+    if (old_lc[x].state == NotAttempted) {
+      continue;
+    }
+    auto emplace_ret = hash_to_lc.emplace(level_hash(old_pack, x), old_lc[x]);
+    if (!emplace_ret.second) {
+      emplace_ret.first->second.merge(old_lc[x]);
+    }
+  }
+
+  vector<level_completion> new_lc(new_pack.size());
+  size_t num_matched = 0;
+  for (size_t x = 0; x < new_pack.size(); x++) {
+    auto it = hash_to_lc.find(level_hash(new_pack, x));
+    if (it != hash_to_lc.end()) {
+      new_lc[x] = it->second;
+      num_matched++;
+    }
+  }
+  save_level_completion_state(args[3], new_lc);
+
+  fprintf(stderr, "carried over progress for %zu of %zu levels\n", num_matched,
+      new_lc.size());
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    print_usage();
+    return 1;
+  }
+  string command = argv[1];
+  vector<string> args(argv + 2, argv + argc);
+
+  try {
+    if (command == "list") {
+      return command_list(args);
+    } else if (command == "merge") {
+      return command_merge(args);
+    } else if (command == "dedup") {
+      return command_dedup(args);
+    } else if (command == "split") {
+      return command_split(args);
+    } else if (command == "reorder") {
+      return command_reorder(args);
+    } else if (command == "remap-progress") {
+      return command_remap_progress(args);
+    }
+    print_usage();
+    return 1;
+
+  } catch (const exception& e) {
+    fprintf(stderr, "mbes-pack: %s\n", e.what());
+    return 2;
+  }
+}
@@ -0,0 +1,129 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+
+#include "level.hh"
+#include "level_pack.hh"
+#include "recording.hh"
+#include "replay.hh"
+#include "solver.hh"
+
+using namespace std;
+
+
+// mbes-solve: finds a shortest winning recording for a level with
+// solve_level, checks it by replaying it, and saves it with a fingerprint so
+// the game and mbes-verify can match it to the level.
+
+static void print_usage() {
+  fprintf(stderr, "\
+usage: mbes-solve [options] PACK LEVEL_INDEX OUTPUT_RECORDING\n\
+\n\
+options:\n\
+  --threads=N: search on N threads (default: one per core)\n\
+  --seconds=N: give up after N seconds (default: no limit)\n\
+  --memory=N: use N megabytes for the table of seen states (default: 64)\n\
+  --max-frames=N: don't look for solutions longer than N frames\n\
+\n\
+the exit status is 0 if a solution was found, 1 if the level can\'t be won\n\
+(within --max-frames), 3 if the search ran out of time, or 2 on errors.\n");
+}
+
+int main(int argc, char* argv[]) {
+  solver_options options;
+  vector<string> positional_args;
+  for (int x = 1; x < argc; x++) {
+    if (!strncmp(argv[x], "--threads=", 10)) {
+      options.num_threads = strtoull(&argv[x][10], NULL, 10);
+    } else if (!strncmp(argv[x], "--seconds=", 10)) {
+      options.time_limit_usecs = strtod(&argv[x][10], NULL) * 1000000;
+    } else if (!strncmp(argv[x], "--memory=", 9)) {
+      options.table_size = strtoull(&argv[x][9], NULL, 10) * 1024 * 1024;
+    } else if (!strncmp(argv[x], "--max-frames=", 13)) {
+      options.max_frames = strtoull(&argv[x][13], NULL, 10);
+    } else if (argv[x][0] == '-') {
+      fprintf(stderr, "unknown option: %s\n", argv[x]);
+      print_usage();
+      return 2;
+    } else {
+      positional_args.emplace_back(argv[x]);
+    }
+  }
+  if (positional_args.size() != 3) {
+    print_usage();
+    return 2;
+  }
+
+  try {
+    level_pack pack(positional_args[0]);
+    char* end;
+    size_t level_index = strtoull(positional_args[1].c_str(), &end, 10);
+    if (positional_args[1].empty() || *end) {
+      throw invalid_argument("invalid level index: " + positional_args[1]);
+    }
+    if (level_index >= pack.size()) {
+      throw out_of_range(string_printf("level %zu is beyond the end of the pack (%zu levels)",
+          level_index, pack.size()));
+    }
+    level_state level = pack[level_index].instantiate();
+
+    // early rounds finish many times per second, so only report the latest
+    // one at most once per second
+    uint64_t start_time = now();
+    uint64_t last_progress_time = start_time;
+    options.progress = [&](uint64_t bound, uint64_t nodes_expanded) {
+      uint64_t t = now();
+      if (t - last_progress_time < 1000000) {
+        return;
+      }
+      last_progress_time = t;
+      fprintf(stderr, "no solution in %" PRIu64 " frames (%" PRIu64
+          " states, %.1f seconds)\n", bound, nodes_expanded,
+          static_cast<double>(t - start_time) / 1000000);
+    };
+    solver_result res = solve_level(level, options);
+    double seconds = static_cast<double>(now() - start_time) / 1000000;
+
+    if (!res.solved) {
+      if (res.unsolvable) {
+        fprintf(stderr, "level %zu can\'t be won", level_index);
+        if (options.max_frames) {
+          fprintf(stderr, " in %" PRIu64 " frames or less", options.max_frames);
+        }
+        fprintf(stderr, " (%" PRIu64 " states, %.1f seconds)\n",
+            res.nodes_expanded, seconds);
+        return 1;
+      }
+      fprintf(stderr, "ran out of time; every solution is at least %" PRIu64
+          " frames long (%" PRIu64 " states, %.1f seconds)\n", res.bound,
+          res.nodes_expanded, seconds);
+      return 3;
+    }
+
+    // the search identifies states by hash, so make sure the solution really
+    // wins before saving it
+    replay_result replay = replay_recording(level, res.solution);
+    if (replay.stats.state != Completed) {
+      throw logic_error("the solution doesn\'t win when replayed");
+    }
+    save_recording(positional_args[2], res.solution, level);
+
+    fprintf(stderr, "solved level %zu in %zu frames (%" PRIu64
+        " states, %.1f seconds); saved %s\n", level_index,
+        res.solution.size(), res.nodes_expanded, seconds,
+        positional_args[2].c_str());
+    return 0;
+
+  } catch (const exception& e) {
+    fprintf(stderr, "mbes-solve: %s\n", e.what());
+    return 2;
+  }
+}
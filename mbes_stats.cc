@@ -0,0 +1,277 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <phosg/Time.hh>
+
+#include "level.hh"
+#include "level_pack.hh"
+#include "parallel.hh"
+
+using namespace std;
+
+
+// mbes-stats: reports what's in each level of a pack and how expensive it is
+// to simulate, to find levels that are inconsistent or slow before they ship.
+//
+// a level is inconsistent if it has no player, needs more items than it has,
+// or can't be won from the start (see level_state::unwinnable). the number of
+// items available is level_state::count_items, which counts 9 for each item
+// dude and blue bomb; their explosions can also turn other bombs' explosions
+// into items, so levels that have any are never inconsistent for needing more
+// than that. portals that can never be used are reported too: jump portals
+// with nothing to jump to, and portals whose far side is a wall.
+//
+// the levels are analyzed in parallel. the cost per frame is measured by
+// running idle frames on a copy of the level without an undo log, so it's the
+// cost the solver and the other tools see; it's measured while the other
+// threads are busy too, so use --threads=1 for more precise numbers.
+
+static const uint64_t DEFAULT_TIMING_FRAMES = 1000;
+
+static const size_t NUM_CELL_TYPES = WhiteBomb + 1;
+
+static void print_usage() {
+  fprintf(stderr, "\
+usage: mbes-stats [options] PACK\n\
+\n\
+options:\n\
+  --csv: write the report as CSV (the default)\n\
+  --json: write the report as a JSON array\n\
+  --timing-frames=N: time N idle frames of each level (default: %" PRIu64 ");\n\
+    0 skips the timing\n\
+  --threads=N: analyze N levels at once (default: one per core)\n\
+\n\
+the exit status is 0 if every level is consistent, or 1 otherwise.\n",
+      DEFAULT_TIMING_FRAMES);
+}
+
+struct level_stats {
+  uint32_t w;
+  uint32_t h;
+  int32_t num_items_remaining;
+  size_t num_items_available; // level_state::count_items
+  bool valid;
+  bool unwinnable;
+  size_t entropy;
+  size_t cell_counts[NUM_CELL_TYPES];
+  size_t num_dudes;
+  size_t num_portals; // not counting jump portals
+  size_t num_jump_portals;
+  size_t num_unpaired_jump_portals;
+  size_t num_blocked_portals;
+  double usecs_per_frame; // 0 if not timed
+
+  bool consistent() const {
+    bool has_item_sources = this->cell_counts[ItemDude] ||
+        this->cell_counts[BlueBomb];
+    return this->valid && !this->unwinnable && (has_item_sources ||
+        (static_cast<int64_t>(this->num_items_available) >= this->num_items_remaining));
+  }
+};
+
+// true if the player can ever go through the portal at (x, y), going the same
+// way exec_frame does. a jump portal needs a portal facing the other way
+// further along the same line; any other portal needs its far side not to be a
+// wall (anything else could be moved or destroyed eventually)
+static bool portal_is_usable(const level_state& l, int32_t x, int32_t y) {
+  bool is_jump = l.at(x, y).is_jump_portal();
+  for (player_impulse dir : movement_impulses) {
+    const auto& offset = offset_for_impulse.at(dir);
+    pair<int32_t, int32_t> exit_pos;
+    if (!l.portal_exit_position(x - offset.first, y - offset.second, dir,
+        &exit_pos)) {
+      continue;
+    }
+    if (is_jump) {
+      return true;
+    }
+    cell_type far_side = l.at(exit_pos).type;
+    if ((far_side != Block) && (far_side != Destroyer) && (far_side != Deleter)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static level_stats analyze_level(level_state&& l, uint64_t timing_frames) {
+  l.set_undo_log_enabled(false);
+
+  level_stats ret;
+  ret.w = l.w;
+  ret.h = l.h;
+  ret.num_items_remaining = l.num_items_remaining;
+  ret.num_items_available = l.count_items();
+  ret.valid = l.validate();
+  // decoding rebuilds the winnability facts, so this is whether the level can
+  // be won from the start
+  ret.unwinnable = l.unwinnable;
+  ret.entropy = l.compute_entropy();
+  memset(ret.cell_counts, 0, sizeof(ret.cell_counts));
+  ret.num_portals = 0;
+  ret.num_jump_portals = 0;
+  ret.num_unpaired_jump_portals = 0;
+  ret.num_blocked_portals = 0;
+
+  for (int32_t y = 0; y < static_cast<int32_t>(l.h); y++) {
+    for (int32_t x = 0; x < static_cast<int32_t>(l.w); x++) {
+      const cell_state& c = l.at(x, y);
+      if (static_cast<size_t>(c.type) < NUM_CELL_TYPES) {
+        ret.cell_counts[c.type]++;
+      }
+      if (!c.is_any_portal()) {
+        continue;
+      }
+      if (c.is_jump_portal()) {
+        ret.num_jump_portals++;
+        if (!portal_is_usable(l, x, y)) {
+          ret.num_unpaired_jump_portals++;
+        }
+      } else {
+        ret.num_portals++;
+        if (!portal_is_usable(l, x, y)) {
+          ret.num_blocked_portals++;
+        }
+      }
+    }
+  }
+  ret.num_dudes = ret.cell_counts[ItemDude] + ret.cell_counts[BombDude];
+
+  ret.usecs_per_frame = 0;
+  if (timing_frames && ret.valid) {
+    uint64_t start_time = now();
+    for (uint64_t x = 0; x < timing_frames; x++) {
+      l.exec_frame(player_actions{None, false});
+    }
+    ret.usecs_per_frame = static_cast<double>(now() - start_time) / timing_frames;
+  }
+
+  return ret;
+}
+
+static void print_csv(const vector<level_stats>& results) {
+  printf("level,w,h,items_remaining,items_available,valid,unwinnable,"
+      "consistent,entropy,dudes,portals,jump_portals,unpaired_jump_portals,"
+      "blocked_portals,usecs_per_frame");
+  for (size_t x = 0; x < NUM_CELL_TYPES; x++) {
+    printf(",%s", name_for_cell_type(static_cast<cell_type>(x)));
+  }
+  printf("\n");
+
+  for (size_t x = 0; x < results.size(); x++) {
+    const auto& s = results[x];
+    printf("%zu,%" PRIu32 ",%" PRIu32 ",%" PRId32 ",%zu,%d,%d,%d,%zu,%zu,%zu,"
+        "%zu,%zu,%zu,%.2f", x, s.w, s.h, s.num_items_remaining,
+        s.num_items_available, s.valid, s.unwinnable, s.consistent(),
+        s.entropy, s.num_dudes, s.num_portals, s.num_jump_portals,
+        s.num_unpaired_jump_portals, s.num_blocked_portals, s.usecs_per_frame);
+    for (size_t y = 0; y < NUM_CELL_TYPES; y++) {
+      printf(",%zu", s.cell_counts[y]);
+    }
+    printf("\n");
+  }
+}
+
+static void print_json(const vector<level_stats>& results) {
+  printf("[");
+  for (size_t x = 0; x < results.size(); x++) {
+    const auto& s = results[x];
+    printf("%s\n  {\"level\": %zu, \"w\": %" PRIu32 ", \"h\": %" PRIu32
+        ", \"items_remaining\": %" PRId32 ", \"items_available\": %zu"
+        ", \"valid\": %s, \"unwinnable\": %s, \"consistent\": %s"
+        ", \"entropy\": %zu, \"dudes\": %zu, \"portals\": %zu"
+        ", \"jump_portals\": %zu, \"unpaired_jump_portals\": %zu"
+        ", \"blocked_portals\": %zu, \"usecs_per_frame\": %.2f, \"cells\": {",
+        x ? "," : "", x, s.w, s.h, s.num_items_remaining,
+        s.num_items_available, s.valid ? "true" : "false",
+        s.unwinnable ? "true" : "false", s.consistent() ? "true" : "false",
+        s.entropy, s.num_dudes, s.num_portals, s.num_jump_portals,
+        s.num_unpaired_jump_portals, s.num_blocked_portals, s.usecs_per_frame);
+    // only the types that appear, to keep it readable
+    bool first = true;
+    for (size_t y = 0; y < NUM_CELL_TYPES; y++) {
+      if (s.cell_counts[y]) {
+        printf("%s\"%s\": %zu", first ? "" : ", ",
+            name_for_cell_type(static_cast<cell_type>(y)), s.cell_counts[y]);
+        first = false;
+      }
+    }
+    printf("}}");
+  }
+  printf("\n]\n");
+}
+
+int main(int argc, char* argv[]) {
+  bool json = false;
+  uint64_t timing_frames = DEFAULT_TIMING_FRAMES;
+  size_t num_threads = 0;
+  vector<string> positional_args;
+  for (int x = 1; x < argc; x++) {
+    if (!strcmp(argv[x], "--csv")) {
+      json = false;
+    } else if (!strcmp(argv[x], "--json")) {
+      json = true;
+    } else if (!strncmp(argv[x], "--timing-frames=", 16)) {
+      timing_frames = strtoull(&argv[x][16], NULL, 10);
+    } else if (!strncmp(argv[x], "--threads=", 10)) {
+      num_threads = strtoull(&argv[x][10], NULL, 10);
+    } else if (argv[x][0] == '-') {
+      fprintf(stderr, "unknown option: %s\n", argv[x]);
+      print_usage();
+      return 2;
+    } else {
+      positional_args.emplace_back(argv[x]);
+    }
+  }
+  if (positional_args.size() != 1) {
+    print_usage();
+    return 2;
+  }
+
+  try {
+    level_pack pack(positional_args[0]);
+    vector<level_stats> results(pack.size());
+    uint64_t start_time = now();
+    // decoding doesn't cache anything in the pack, so each thread decodes its
+    // own levels
+    parallel_for(pack.size(), [&](size_t index, size_t) {
+      results[index] = analyze_level(pack.decode(index), timing_frames);
+    }, num_threads);
+    double seconds = static_cast<double>(now() - start_time) / 1000000;
+
+    if (json) {
+      print_json(results);
+    } else {
+      print_csv(results);
+    }
+
+    size_t num_inconsistent = 0, num_unusable_portals = 0;
+    size_t slowest_index = 0;
+    for (size_t x = 0; x < results.size(); x++) {
+      num_inconsistent += !results[x].consistent();
+      num_unusable_portals += results[x].num_unpaired_jump_portals +
+          results[x].num_blocked_portals;
+      if (results[x].usecs_per_frame > results[slowest_index].usecs_per_frame) {
+        slowest_index = x;
+      }
+    }
+    fprintf(stderr, "%zu levels in %.2f seconds: %zu inconsistent, %zu unusable"
+        " portals", results.size(), seconds, num_inconsistent,
+        num_unusable_portals);
+    if (timing_frames && !results.empty()) {
+      fprintf(stderr, "; slowest is level %zu at %.2f usecs per frame",
+          slowest_index, results[slowest_index].usecs_per_frame);
+    }
+    fprintf(stderr, "\n");
+    return num_inconsistent ? 1 : 0;
+
+  } catch (const exception& e) {
+    fprintf(stderr, "mbes-stats: %s\n", e.what());
+    return 2;
+  }
+}
@@ -0,0 +1,352 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <phosg/Strings.hh>
+
+#include "action_buffer.hh"
+#include "level.hh"
+#include "level_pack.hh"
+#include "path_planner.hh"
+#include "playout.hh"
+#include "recording.hh"
+#include "session.hh"
+
+using namespace std;
+
+
+// mbes-test: checks that the facts the game keeps up to date incrementally
+// during play agree with what's computed from scratch. each level in the pack
+// is played with random actions (and rewound at random); after every frame the
+// state's winnability tracker is compared against a fork of the state that
+// rebuilt it with recompute_winnability. every so often the state is also
+// round-tripped through a session file, a recording keyframe and a compressed
+// level, since those build states without playing any frames. a level whose
+// exit is walled off is checked too, since it must be unwinnable from the
+// start however it was loaded, and every playout mbes-difficulty plays on it
+// must be a dead end.
+//
+// path_planner is checked the same way: each level is played again following
+// paths to random targets (and sometimes wandering off them or rewinding), and
+// after every frame the distances it repaired are compared against a planner
+// that computed them from scratch.
+
+static const uint64_t DEFAULT_FRAMES = 1000;
+static const uint64_t ROUND_TRIP_INTERVAL = 100;
+static const size_t PATH_PLANNER_RUNS = 5;
+static const size_t WALLED_IN_EXIT_PLAYOUTS = 20;
+
+static void print_usage() {
+  fprintf(stderr, "\
+usage: mbes-test [options] PACK\n\
+\n\
+options:\n\
+  --frames=N: play at most N frames of each level (default: %" PRIu64 ")\n\
+  --seed=N: seed for the random actions (default: 0)\n\
+\n\
+the exit status is 0 if every check passed, or 1 otherwise.\n",
+      DEFAULT_FRAMES);
+}
+
+struct test_context {
+  string session_filename;
+  string pack_filename;
+  size_t num_checks;
+  size_t num_failures;
+
+  void fail(const char* what, size_t level_index, const level_state& l,
+      const string& details) {
+    fprintf(stderr, "level %zu frame %" PRIu64 ": %s: %s\n", level_index,
+        l.frames_executed, what, details.c_str());
+    this->num_failures++;
+  }
+};
+
+// compares l's winnability tracking against a fresh recompute of the same
+// state. what describes how l was built, for the failure message
+static bool check_winnability(test_context& ctx, const char* what,
+    size_t level_index, const level_state& l) {
+  ctx.num_checks++;
+  level_state expected = l.fork();
+  expected.recompute_winnability();
+
+  const auto& a = l.winnability;
+  const auto& b = expected.winnability;
+  if (l.unwinnable != expected.unwinnable) {
+    ctx.fail(what, level_index, l, string_printf("unwinnable is %d, not %d",
+        l.unwinnable, expected.unwinnable));
+    return false;
+  }
+  if (a.num_item_sources != b.num_item_sources) {
+    ctx.fail(what, level_index, l, string_printf(
+        "%" PRId32 " item sources, not %" PRId32, a.num_item_sources,
+        b.num_item_sources));
+    return false;
+  }
+  if ((a.cell_regions != b.cell_regions) ||
+      (a.regions.size() != b.regions.size())) {
+    ctx.fail(what, level_index, l, "regions don't match");
+    return false;
+  }
+  for (size_t x = 0; x < a.regions.size(); x++) {
+    const auto& ra = a.regions[x];
+    const auto& rb = b.regions[x];
+    if ((ra.items != rb.items) || (ra.exits != rb.exits) ||
+        (ra.red_bombs != rb.red_bombs)) {
+      ctx.fail(what, level_index, l, string_printf(
+          "region %zu has (%" PRId32 ", %" PRId32 ", %" PRId32 ") items, exits "
+          "and red bombs, not (%" PRId32 ", %" PRId32 ", %" PRId32 ")", x,
+          ra.items, ra.exits, ra.red_bombs, rb.items, rb.exits, rb.red_bombs));
+      return false;
+    }
+  }
+  return true;
+}
+
+static void check_round_trips(test_context& ctx, size_t level_index,
+    uint64_t level_hash, const level_state& l,
+    const action_buffer& recording) {
+  save_session(ctx.session_filename, level_index, level_hash, l, recording);
+  uint64_t loaded_level_index, loaded_level_hash;
+  level_state loaded;
+  action_buffer loaded_recording;
+  load_session(ctx.session_filename, &loaded_level_index, &loaded_level_hash,
+      loaded, loaded_recording);
+  ctx.num_checks++;
+  if ((loaded_level_index != level_index) || (loaded_level_hash != level_hash)) {
+    ctx.fail("session", level_index, l, string_printf("loaded level %"
+        PRIu64 " with hash %016" PRIX64 ", not %016" PRIX64, loaded_level_index,
+        loaded_level_hash, level_hash));
+  }
+  check_winnability(ctx, "session", level_index, loaded);
+
+  recording_keyframe kf;
+  kf.frame = l.frames_executed;
+  kf.state_hash = l.hash();
+  kf.data = encode_keyframe(l);
+  check_winnability(ctx, "keyframe", level_index, decode_keyframe(kf));
+
+  string compressed = compress_level(l);
+  check_winnability(ctx, "compressed level", level_index,
+      decompress_level(compressed.data(), compressed.size()));
+}
+
+static void test_level(test_context& ctx, const level_pack& pack,
+    size_t level_index, uint64_t max_frames, mt19937_64& rng) {
+  level_state l = pack.decode(level_index);
+  uint64_t level_hash = pack[level_index].hash();
+  check_winnability(ctx, "pack", level_index, l);
+  check_round_trips(ctx, level_index, level_hash, l, action_buffer());
+
+  action_buffer recording;
+  for (uint64_t frame = 0; (frame < max_frames) && l.player_is_alive() &&
+       !l.player_did_win; frame++) {
+    player_actions actions;
+    actions.impulse = static_cast<player_impulse>(rng() % 5);
+    actions.drop_bomb = ((rng() % 20) == 0);
+    l.exec_frame(actions);
+    recording.push_back(actions);
+    check_winnability(ctx, "exec_frame", level_index, l);
+
+    if ((rng() % 50) == 0) {
+      l.rewind_frames(rng() % 30);
+      recording.truncate(l.frames_executed);
+      check_winnability(ctx, "rewind", level_index, l);
+    }
+    if ((frame % ROUND_TRIP_INTERVAL) == 0) {
+      check_round_trips(ctx, level_index, level_hash, l, recording);
+    }
+  }
+}
+
+static void check_path_planner(test_context& ctx, size_t level_index,
+    const level_state& l, const path_planner& p) {
+  ctx.num_checks++;
+  auto target = p.target();
+  path_planner expected;
+  if (!expected.set_target(l, target.first, target.second)) {
+    // the player can't get to the target any more, so the other distances
+    // can't be compared
+    int32_t d = p.distance(l.player_x, l.player_y);
+    if (d >= 0) {
+      ctx.fail("path_planner", level_index, l, string_printf(
+          "player is %" PRId32 " moves from (%" PRId32 ", %" PRId32 "), which "
+          "is unreachable", d, target.first, target.second));
+    }
+    return;
+  }
+
+  for (int32_t y = 0; y < static_cast<int32_t>(l.h); y++) {
+    for (int32_t x = 0; x < static_cast<int32_t>(l.w); x++) {
+      int32_t d = p.distance(x, y);
+      int32_t expected_d = expected.distance(x, y);
+      if (d != expected_d) {
+        ctx.fail("path_planner", level_index, l, string_printf(
+            "(%" PRId32 ", %" PRId32 ") is %" PRId32 " moves from (%" PRId32
+            ", %" PRId32 "), not %" PRId32, x, y, d, target.first,
+            target.second, expected_d));
+        return;
+      }
+    }
+  }
+}
+
+static void test_path_planner(test_context& ctx, const level_state& initial,
+    size_t level_index, uint64_t max_frames, mt19937_64& rng) {
+  level_state l = initial;
+  path_planner p;
+  auto set_random_target = [&]() -> bool {
+    for (size_t attempt = 0; attempt < 20; attempt++) {
+      if (p.set_target(l, rng() % l.w, rng() % l.h)) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  for (uint64_t frame = 0; (frame < max_frames) && l.player_is_alive() &&
+       !l.player_did_win; frame++) {
+    if (!p.active() && !set_random_target()) {
+      break;
+    }
+
+    player_actions actions;
+    if ((rng() % 4) != 0) {
+      actions.impulse = p.next_impulse(l);
+    } else {
+      actions.impulse = static_cast<player_impulse>(rng() % 5);
+    }
+    actions.drop_bomb = false;
+    if (((rng() % 50) == 0) && l.can_rewind()) {
+      // the game counts rewinds itself, and the planner relies on it
+      l.rewind_count++;
+      l.rewind_frames(1 + rng() % 5);
+    } else {
+      l.exec_frame(actions);
+    }
+
+    p.update(l);
+    if (p.active()) {
+      check_path_planner(ctx, level_index, l, p);
+    }
+  }
+}
+
+static void check_unwinnable(test_context& ctx, const char* what,
+    const level_state& l, bool expected) {
+  ctx.num_checks++;
+  if (l.unwinnable != expected) {
+    fprintf(stderr, "walled-in exit: %s: unwinnable is %d, not %d\n", what,
+        l.unwinnable, expected);
+    ctx.num_failures++;
+  }
+}
+
+// a level whose exit is on the other side of a wall from the player, and the
+// same level with the wall removed
+static void test_walled_in_exit(test_context& ctx) {
+  for (bool walled : {true, false}) {
+    level_state l(12, 8, 2, 3);
+    l.at(9, 3) = cell_state(Exit);
+    if (walled) {
+      for (int32_t y = 1; y < static_cast<int32_t>(l.h) - 1; y++) {
+        l.at(6, y) = cell_state(Block);
+      }
+    }
+    l.recompute_winnability();
+    check_unwinnable(ctx, "recompute_winnability", l, walled);
+
+    string compressed = compress_level(l);
+    check_unwinnable(ctx, "compressed level",
+        decompress_level(compressed.data(), compressed.size()), walled);
+
+    level_pack_writer w(ctx.pack_filename);
+    w.add(l);
+    w.finish();
+    level_pack pack(ctx.pack_filename);
+    check_unwinnable(ctx, "pack", pack.decode(0), walled);
+
+    // mbes-difficulty plays from the template, not a decoded state
+    level_state start = pack.get(0)->instantiate();
+    check_unwinnable(ctx, "instantiate", start, walled);
+    for (playout_policy policy : {playout_policy::Random,
+                                  playout_policy::Greedy}) {
+      ctx.num_checks++;
+      mt19937_64 rng(1);
+      playout_totals totals;
+      for (size_t x = 0; x < WALLED_IN_EXIT_PLAYOUTS; x++) {
+        level_state l = start;
+        run_playout(l, policy, DEFAULT_FRAMES, rng, totals);
+      }
+      uint64_t expected_dead_ends = walled ? totals.playouts : 0;
+      if ((totals.dead_ends != expected_dead_ends) ||
+          (walled && totals.frames_survived)) {
+        fprintf(stderr, "walled-in exit: %s playouts: %" PRIu64 " dead ends "
+            "and %" PRIu64 " frames survived in %" PRIu64 " playouts\n",
+            (policy == playout_policy::Random) ? "random" : "greedy",
+            totals.dead_ends, totals.frames_survived, totals.playouts);
+        ctx.num_failures++;
+      }
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  uint64_t max_frames = DEFAULT_FRAMES;
+  uint64_t seed = 0;
+  vector<string> positional_args;
+  for (int x = 1; x < argc; x++) {
+    if (!strncmp(argv[x], "--frames=", 9)) {
+      max_frames = strtoull(&argv[x][9], NULL, 10);
+    } else if (!strncmp(argv[x], "--seed=", 7)) {
+      seed = strtoull(&argv[x][7], NULL, 10);
+    } else if (argv[x][0] == '-') {
+      fprintf(stderr, "unknown option: %s\n", argv[x]);
+      print_usage();
+      return 2;
+    } else {
+      positional_args.emplace_back(argv[x]);
+    }
+  }
+  if (positional_args.size() != 1) {
+    print_usage();
+    return 2;
+  }
+
+  test_context ctx;
+  ctx.session_filename = string_printf("/tmp/mbes-test-%d.mbs", getpid());
+  ctx.pack_filename = string_printf("/tmp/mbes-test-%d.mbl", getpid());
+  ctx.num_checks = 0;
+  ctx.num_failures = 0;
+  try {
+    test_walled_in_exit(ctx);
+
+    level_pack pack(positional_args[0]);
+    mt19937_64 rng(seed);
+    for (size_t x = 0; x < pack.size(); x++) {
+      test_level(ctx, pack, x, max_frames, rng);
+      level_state l = pack.decode(x);
+      for (size_t run = 0; run < PATH_PLANNER_RUNS; run++) {
+        test_path_planner(ctx, l, x, max_frames, rng);
+      }
+    }
+  } catch (const exception& e) {
+    unlink(ctx.session_filename.c_str());
+    unlink(ctx.pack_filename.c_str());
+    fprintf(stderr, "mbes-test: %s\n", e.what());
+    return 2;
+  }
+  unlink(ctx.session_filename.c_str());
+  unlink(ctx.pack_filename.c_str());
+
+  fprintf(stderr, "%zu checks, %zu failed\n", ctx.num_checks,
+      ctx.num_failures);
+  return ctx.num_failures ? 1 : 0;
+}
@@ -0,0 +1,451 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+
+#include "activity.hh"
+#include "catalog.hh"
+#include "level.hh"
+#include "level_completion.hh"
+#include "level_pack.hh"
+#include "parallel.hh"
+#include "recording.hh"
+#include "replay.hh"
+
+using namespace std;
+
+
+// mbes-verify: replays recordings against a level pack in parallel and
+// reports how each one turns out, in the same terms as the game's progress
+// file. recordings that carry a fingerprint are matched to their level by its
+// hash, and the final state is checked against the fingerprint, so this also
+// finds recordings that no longer play out the way they did when they were
+// made (e.g. after a change to the game's rules).
+//
+// with --heatmap, each replay also counts what happens in each cell (see
+// activity.hh) into its own counters, and the counters for each level are
+// added up after all the replays are done and saved as one file per level.
+//
+// with --catalog, the recordings that replayed as expected are also added to a
+// recording catalog (see catalog.hh), which is how recordings saved outside
+// the game (or before it had a catalog) get there.
+
+static void print_usage() {
+  fprintf(stderr, "\
+usage: mbes-verify [options] PACK RECORDING_OR_DIRECTORY [...]\n\
+\n\
+directories are searched (not recursively) for .mbr files.\n\
+\n\
+options:\n\
+  --csv: write the results as CSV (the default)\n\
+  --json: write the results as a JSON array\n\
+  --threads=N: replay on N threads (default: one per core)\n\
+  --level=N: replay recordings that have no fingerprint on level N. without\n\
+    this, those recordings can\'t be verified\n\
+  --heatmap=PREFIX: count the activity in each cell over all the recordings of\n\
+    each level, and save it as PREFIX_NNN.mbh (NNN is the level number)\n\
+  --catalog=DIR: add the recordings to the catalog in DIR (the game's is in\n\
+    its recordings directory), except those that didn't match their\n\
+    fingerprint. the game only reads its catalog at startup, so don't do this\n\
+    while it's running\n\
+\n\
+the exit status is 0 if every recording was replayed and matched its\n\
+fingerprint (whether or not it won), or 1 otherwise.\n");
+}
+
+enum class fingerprint_result {
+  None = 0, // the recording has no fingerprint
+  Match,
+  Mismatch,
+};
+
+struct verify_result {
+  string filename;
+  int64_t level_index; // -1 if unknown
+  replay_result replay;
+  fingerprint_result fingerprint;
+  string error; // empty if the recording was replayed
+  unique_ptr<activity_counters> activity; // only with --heatmap
+  uint64_t content_hash; // only with --catalog
+
+  verify_result() : level_index(-1), fingerprint(fingerprint_result::None),
+      content_hash(0) { }
+};
+
+static vector<string> find_recordings(const vector<string>& paths) {
+  vector<string> ret;
+  for (const string& path : paths) {
+    if (!isdir(path)) {
+      ret.emplace_back(path);
+      continue;
+    }
+    vector<string> names;
+    for (const string& name : list_directory(path)) {
+      if ((name.size() > 4) && !name.compare(name.size() - 4, 4, ".mbr")) {
+        names.emplace_back(name);
+      }
+    }
+    sort(names.begin(), names.end());
+    for (const string& name : names) {
+      ret.emplace_back(path + "/" + name);
+    }
+  }
+  return ret;
+}
+
+static void verify_recording(verify_result& res,
+    const vector<shared_ptr<const level_template>>& levels,
+    const unordered_map<uint64_t, size_t>& hash_to_level_index,
+    int64_t default_level_index, bool count_activity, bool compute_content_hash) {
+  try {
+    recording_file r = load_recording_file(res.filename);
+
+    if (r.has_fingerprint) {
+      auto it = hash_to_level_index.find(r.source_level_hash);
+      if (it == hash_to_level_index.end()) {
+        throw runtime_error("recording was made on a level that isn\'t in this pack");
+      }
+      res.level_index = it->second;
+    } else if (default_level_index >= 0) {
+      res.level_index = default_level_index;
+    } else {
+      throw runtime_error("recording has no fingerprint and no level was given");
+    }
+
+    const level_template& level = *levels[res.level_index];
+    if (count_activity) {
+      res.activity.reset(new activity_counters(level.w, level.h));
+    }
+    res.replay = replay_recording(level, r.actions, res.activity.get());
+    if (compute_content_hash) {
+      res.content_hash = recording_content_hash(r.actions, level.hash());
+    }
+
+    // the fingerprint describes the state after every frame of the recording,
+    // but replays stop at the win, so a recording that now wins early doesn't
+    // match either
+    if (r.has_fingerprint) {
+      res.fingerprint = ((res.replay.frames_executed == r.actions.size()) &&
+          (res.replay.final_state_hash == r.final_state_hash)) ?
+          fingerprint_result::Match : fingerprint_result::Mismatch;
+    }
+
+  } catch (const exception& e) {
+    res.error = e.what();
+  }
+}
+
+// adds the recordings that replayed as expected to the catalog in directory,
+// and returns how many of them weren't already there
+static size_t catalog_recordings(const string& directory,
+    const vector<verify_result>& results,
+    const vector<shared_ptr<const level_template>>& levels, size_t num_threads) {
+  recording_catalog catalog(directory);
+
+  // the same recording can appear more than once (e.g. under different names),
+  // so pick one of each before saving anything
+  vector<const verify_result*> to_add;
+  unordered_set<uint64_t> seen_content_hashes;
+  for (const auto& res : results) {
+    if (!res.error.empty() || (res.fingerprint == fingerprint_result::Mismatch)) {
+      continue;
+    }
+    if (!seen_content_hashes.emplace(res.content_hash).second) {
+      continue;
+    }
+    if (catalog.find(res.content_hash) &&
+        isfile(catalog.recording_filename(res.content_hash))) {
+      continue;
+    }
+    to_add.emplace_back(&res);
+  }
+
+  // saving simulates the recording again to make its fingerprint, so this is
+  // done on all cores too. only the catalog file itself is written serially
+  vector<string> errors(to_add.size());
+  parallel_for(to_add.size(), [&](size_t index, size_t) {
+    const verify_result& res = *to_add[index];
+    try {
+      save_recording(catalog.recording_filename(res.content_hash),
+          load_recording(res.filename), levels[res.level_index]->instantiate());
+    } catch (const exception& e) {
+      errors[index] = e.what();
+    }
+  }, num_threads);
+
+  size_t num_added = 0;
+  for (size_t x = 0; x < to_add.size(); x++) {
+    const verify_result& res = *to_add[x];
+    if (!errors[x].empty()) {
+      fprintf(stderr, "can\'t add %s to catalog: %s\n", res.filename.c_str(),
+          errors[x].c_str());
+      continue;
+    }
+    catalog_entry e;
+    e.content_hash = res.content_hash;
+    e.source_level_hash = levels[res.level_index]->hash();
+    e.level_index = res.level_index;
+    e.frames_executed = res.replay.frames_executed;
+    e.stats = res.replay.stats;
+    if (!catalog.find(e.content_hash)) {
+      num_added++;
+    }
+    catalog.add(e);
+  }
+  return num_added;
+}
+
+static const char* result_name(const verify_result& res) {
+  if (!res.error.empty()) {
+    return "error";
+  }
+  return (res.replay.stats.state == Completed) ? "won" : "not won";
+}
+
+static const char* fingerprint_name(fingerprint_result f) {
+  switch (f) {
+    case fingerprint_result::None:
+      return "none";
+    case fingerprint_result::Match:
+      return "match";
+    case fingerprint_result::Mismatch:
+      return "mismatch";
+  }
+  return "unknown";
+}
+
+static string csv_escape(const string& s) {
+  if (s.find_first_of(",\"\n") == string::npos) {
+    return s;
+  }
+  string ret = "\"";
+  for (char ch : s) {
+    if (ch == '\"') {
+      ret += '\"';
+    }
+    ret += ch;
+  }
+  return ret + "\"";
+}
+
+static string json_escape(const string& s) {
+  string ret = "\"";
+  for (char ch : s) {
+    if ((ch == '\"') || (ch == '\\')) {
+      ret += '\\';
+      ret += ch;
+    } else if (static_cast<unsigned char>(ch) < 0x20) {
+      ret += string_printf("\\u%04X", ch);
+    } else {
+      ret += ch;
+    }
+  }
+  return ret + "\"";
+}
+
+static void print_csv(const vector<verify_result>& results) {
+  printf("file,level,result,frames,extra_items,extra_bombs,cleared_space,"
+      "attenuated_space,entropy,final_state_hash,fingerprint,error\n");
+  for (const auto& res : results) {
+    printf("%s,", csv_escape(res.filename).c_str());
+    if (res.level_index >= 0) {
+      printf("%" PRId64, res.level_index);
+    }
+    printf(",%s,", result_name(res));
+    if (res.error.empty()) {
+      printf("%" PRIu64, res.replay.frames_executed);
+    }
+    // the stats are only meaningful for recordings that won
+    const level_completion& lc = res.replay.stats;
+    if (res.error.empty() && (lc.state == Completed)) {
+      printf(",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64,
+          lc.extra_items, lc.extra_bombs, lc.cleared_space, lc.attenuated_space,
+          lc.entropy);
+    } else {
+      printf(",,,,,");
+    }
+    if (res.error.empty()) {
+      printf(",%016" PRIX64 ",%s,\n", res.replay.final_state_hash,
+          fingerprint_name(res.fingerprint));
+    } else {
+      printf(",,,%s\n", csv_escape(res.error).c_str());
+    }
+  }
+}
+
+static void print_json(const vector<verify_result>& results) {
+  printf("[");
+  for (size_t x = 0; x < results.size(); x++) {
+    const auto& res = results[x];
+    printf("%s\n  {\"file\": %s, \"level\": ", x ? "," : "",
+        json_escape(res.filename).c_str());
+    if (res.level_index >= 0) {
+      printf("%" PRId64, res.level_index);
+    } else {
+      printf("null");
+    }
+    printf(", \"result\": \"%s\"", result_name(res));
+
+    if (!res.error.empty()) {
+      printf(", \"error\": %s}", json_escape(res.error).c_str());
+      continue;
+    }
+
+    printf(", \"frames\": %" PRIu64, res.replay.frames_executed);
+    const level_completion& lc = res.replay.stats;
+    if (lc.state == Completed) {
+      printf(", \"extra_items\": %" PRIu64 ", \"extra_bombs\": %" PRIu64
+          ", \"cleared_space\": %" PRIu64 ", \"attenuated_space\": %" PRIu64
+          ", \"entropy\": %" PRIu64, lc.extra_items, lc.extra_bombs,
+          lc.cleared_space, lc.attenuated_space, lc.entropy);
+    }
+    printf(", \"final_state_hash\": \"%016" PRIX64 "\", \"fingerprint\": \"%s\"}",
+        res.replay.final_state_hash, fingerprint_name(res.fingerprint));
+  }
+  printf("\n]\n");
+}
+
+int main(int argc, char* argv[]) {
+  bool json = false;
+  size_t num_threads = 0;
+  int64_t default_level_index = -1;
+  string heatmap_prefix;
+  string catalog_directory;
+  vector<string> positional_args;
+  for (int x = 1; x < argc; x++) {
+    if (!strcmp(argv[x], "--csv")) {
+      json = false;
+    } else if (!strcmp(argv[x], "--json")) {
+      json = true;
+    } else if (!strncmp(argv[x], "--threads=", 10)) {
+      num_threads = strtoull(&argv[x][10], NULL, 10);
+    } else if (!strncmp(argv[x], "--level=", 8)) {
+      default_level_index = strtoll(&argv[x][8], NULL, 10);
+    } else if (!strncmp(argv[x], "--heatmap=", 10)) {
+      heatmap_prefix = &argv[x][10];
+    } else if (!strncmp(argv[x], "--catalog=", 10)) {
+      catalog_directory = &argv[x][10];
+    } else if (argv[x][0] == '-') {
+      fprintf(stderr, "unknown option: %s\n", argv[x]);
+      print_usage();
+      return 2;
+    } else {
+      positional_args.emplace_back(argv[x]);
+    }
+  }
+  if (positional_args.size() < 2) {
+    print_usage();
+    return 2;
+  }
+
+  // decode every level up front: the templates are immutable, so the replay
+  // threads can share them
+  vector<shared_ptr<const level_template>> levels;
+  unordered_map<uint64_t, size_t> hash_to_level_index;
+  try {
+    level_pack pack(positional_args[0]);
+    for (size_t x = 0; x < pack.size(); x++) {
+      levels.emplace_back(pack.get(x));
+      hash_to_level_index.emplace(levels.back()->hash(), x);
+    }
+  } catch (const exception& e) {
+    fprintf(stderr, "can\'t load level pack %s: %s\n",
+        positional_args[0].c_str(), e.what());
+    return 2;
+  }
+  if (default_level_index >= static_cast<int64_t>(levels.size())) {
+    fprintf(stderr, "level %" PRId64 " is beyond the end of the pack\n",
+        default_level_index);
+    return 2;
+  }
+
+  vector<verify_result> results;
+  try {
+    for (const string& filename : find_recordings(vector<string>(
+        positional_args.begin() + 1, positional_args.end()))) {
+      results.emplace_back();
+      results.back().filename = filename;
+    }
+  } catch (const exception& e) {
+    fprintf(stderr, "can\'t list recordings: %s\n", e.what());
+    return 2;
+  }
+
+  parallel_for(results.size(), [&](size_t index, size_t) {
+    verify_recording(results[index], levels, hash_to_level_index,
+        default_level_index, !heatmap_prefix.empty(),
+        !catalog_directory.empty());
+  }, num_threads);
+
+  if (!catalog_directory.empty()) {
+    try {
+      size_t num_added = catalog_recordings(catalog_directory, results, levels,
+          num_threads);
+      fprintf(stderr, "added %zu recording%s to catalog\n", num_added,
+          (num_added == 1) ? "" : "s");
+    } catch (const exception& e) {
+      fprintf(stderr, "can\'t open catalog %s: %s\n",
+          catalog_directory.c_str(), e.what());
+      return 2;
+    }
+  }
+
+  if (!heatmap_prefix.empty()) {
+    map<size_t, activity_counters> level_activity;
+    for (const auto& res : results) {
+      if (!res.activity.get()) {
+        continue;
+      }
+      auto it = level_activity.find(res.level_index);
+      if (it == level_activity.end()) {
+        level_activity.emplace(res.level_index, *res.activity);
+      } else {
+        it->second.add(*res.activity);
+      }
+    }
+    try {
+      for (const auto& it : level_activity) {
+        save_activity(string_printf("%s_%03zu.mbh", heatmap_prefix.c_str(),
+            it.first), it.second);
+      }
+    } catch (const exception& e) {
+      fprintf(stderr, "can\'t save heatmap: %s\n", e.what());
+      return 2;
+    }
+    fprintf(stderr, "saved heatmaps for %zu level%s\n", level_activity.size(),
+        (level_activity.size() == 1) ? "" : "s");
+  }
+
+  if (json) {
+    print_json(results);
+  } else {
+    print_csv(results);
+  }
+
+  size_t num_won = 0, num_mismatched = 0, num_errors = 0;
+  for (const auto& res : results) {
+    if (!res.error.empty()) {
+      num_errors++;
+    } else if (res.replay.stats.state == Completed) {
+      num_won++;
+    }
+    if (res.fingerprint == fingerprint_result::Mismatch) {
+      num_mismatched++;
+    }
+  }
+  fprintf(stderr, "%zu recordings: %zu won, %zu fingerprint mismatches, %zu errors\n",
+      results.size(), num_won, num_mismatched, num_errors);
+  return (num_mismatched || num_errors) ? 1 : 0;
+}
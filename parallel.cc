@@ -0,0 +1,211 @@
+#include <stddef.h>
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "parallel.hh"
+
+using namespace std;
+
+
+size_t default_thread_count() {
+  size_t ret = thread::hardware_concurrency();
+  return ret ? ret : 1;
+}
+
+// the indexes a thread has left to run. the owner takes from the front and
+// thieves take from the back; a thread never holds two of these locks at once
+struct work_range {
+  mutex lock;
+  size_t begin;
+  size_t end;
+};
+
+// one parallel_for call: the work left for each thread, and the first
+// exception any of them threw
+struct thread_pool::loop {
+  size_t count;
+  const function<void(size_t, size_t)>& fn;
+  size_t num_threads;
+  unique_ptr<work_range[]> ranges;
+
+  atomic<bool> failed;
+  mutex exception_lock;
+  exception_ptr first_exception;
+
+  loop(size_t count, const function<void(size_t, size_t)>& fn,
+      size_t num_threads) : count(count), fn(fn), num_threads(num_threads),
+      ranges(new work_range[num_threads]), failed(false) {
+    for (size_t x = 0; x < num_threads; x++) {
+      this->ranges[x].begin = (count * x) / num_threads;
+      this->ranges[x].end = (count * (x + 1)) / num_threads;
+    }
+  }
+
+  void run(size_t thread_index) {
+    work_range& own = this->ranges[thread_index];
+    while (!this->failed) {
+      size_t index;
+      {
+        lock_guard<mutex> g(own.lock);
+        index = (own.begin < own.end) ? own.begin++ : this->count;
+      }
+
+      if (index == this->count) {
+        // out of work; find the thread with the most left and take half. the
+        // sizes can change between looking and locking, so check again after
+        // locking the victim
+        size_t victim = this->num_threads;
+        size_t victim_remaining = 0;
+        for (size_t x = 0; x < this->num_threads; x++) {
+          if (x == thread_index) {
+            continue;
+          }
+          lock_guard<mutex> g(this->ranges[x].lock);
+          size_t remaining = this->ranges[x].end - this->ranges[x].begin;
+          if (remaining > victim_remaining) {
+            victim = x;
+            victim_remaining = remaining;
+          }
+        }
+        if (victim == this->num_threads) {
+          return; // nothing left anywhere
+        }
+
+        size_t stolen_begin, stolen_end;
+        {
+          lock_guard<mutex> g(this->ranges[victim].lock);
+          work_range& r = this->ranges[victim];
+          stolen_end = r.end;
+          stolen_begin = r.begin + (r.end - r.begin) / 2;
+          r.end = stolen_begin;
+        }
+        lock_guard<mutex> g(own.lock);
+        own.begin = stolen_begin;
+        own.end = stolen_end;
+        continue;
+      }
+
+      try {
+        this->fn(index, thread_index);
+      } catch (...) {
+        lock_guard<mutex> g(this->exception_lock);
+        if (!this->first_exception) {
+          this->first_exception = current_exception();
+        }
+        this->failed = true;
+      }
+    }
+  }
+};
+
+void parallel_for(size_t count, const function<void(size_t, size_t)>& fn,
+    size_t num_threads) {
+  if (num_threads == 0) {
+    num_threads = default_thread_count();
+  }
+  if (num_threads > count) {
+    num_threads = count;
+  }
+  if (num_threads <= 1) {
+    for (size_t x = 0; x < count; x++) {
+      fn(x, 0);
+    }
+    return;
+  }
+
+  thread_pool pool(num_threads);
+  pool.parallel_for(count, fn);
+}
+
+
+
+thread_pool::thread_pool(size_t num_threads) :
+    num_threads(num_threads ? num_threads : default_thread_count()),
+    current_loop(NULL), loop_count(0), num_workers_running(0),
+    should_exit(false) {
+  for (size_t x = 1; x < this->num_threads; x++) {
+    this->workers.emplace_back(&thread_pool::worker_routine, this, x);
+  }
+}
+
+thread_pool::~thread_pool() {
+  {
+    lock_guard<mutex> g(this->lock);
+    this->should_exit = true;
+  }
+  this->loop_started.notify_all();
+  for (auto& t : this->workers) {
+    t.join();
+  }
+}
+
+size_t thread_pool::size() const {
+  return this->num_threads;
+}
+
+void thread_pool::parallel_for(size_t count,
+    const function<void(size_t, size_t)>& fn) {
+  size_t num_threads = (this->num_threads > count) ? count : this->num_threads;
+  if (num_threads <= 1) {
+    for (size_t x = 0; x < count; x++) {
+      fn(x, 0);
+    }
+    return;
+  }
+
+  loop l(count, fn, num_threads);
+  {
+    lock_guard<mutex> g(this->lock);
+    this->current_loop = &l;
+    this->loop_count++;
+    this->num_workers_running = num_threads - 1;
+  }
+  this->loop_started.notify_all();
+
+  l.run(0);
+
+  {
+    unique_lock<mutex> g(this->lock);
+    this->loop_finished.wait(g, [this]() {
+      return this->num_workers_running == 0;
+    });
+    this->current_loop = NULL;
+  }
+
+  if (l.first_exception) {
+    rethrow_exception(l.first_exception);
+  }
+}
+
+void thread_pool::worker_routine(size_t thread_index) {
+  uint64_t last_loop_count = 0;
+  unique_lock<mutex> g(this->lock);
+  for (;;) {
+    this->loop_started.wait(g, [&]() {
+      return this->should_exit || (this->loop_count != last_loop_count);
+    });
+    if (this->should_exit) {
+      return;
+    }
+    last_loop_count = this->loop_count;
+
+    // loops with fewer items than the pool has threads don't use all of them
+    loop* l = this->current_loop;
+    if (!l || (thread_index >= l->num_threads)) {
+      continue;
+    }
+
+    g.unlock();
+    l->run(thread_index);
+    g.lock();
+    if (--this->num_workers_running == 0) {
+      this->loop_finished.notify_one();
+    }
+  }
+}
@@ -0,0 +1,67 @@
+#ifndef __PARALLEL_H
+#define __PARALLEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// the number of threads to use when the caller doesn't specify one: one per
+// core, or 1 if the core count is unknown
+size_t default_thread_count();
+
+// calls fn(index, thread_index) for every index in [0, count), using
+// num_threads threads (or default_thread_count() if it's 0). each thread starts
+// with an equal share of the indexes and takes them in order; a thread that
+// runs out steals the upper half of the remaining indexes from the thread with
+// the most left, so work items that take very different amounts of time (e.g.
+// replays of recordings of different lengths) still keep every thread busy.
+//
+// if fn throws, no more indexes are started, and the first exception is
+// rethrown after all the threads have stopped.
+void parallel_for(size_t count,
+    const std::function<void(size_t index, size_t thread_index)>& fn,
+    size_t num_threads = 0);
+
+// runs parallel_for on threads that are started once and kept until the pool
+// is destroyed, for callers that run many short loops (e.g. one per search
+// round, or one per step of a batch of games) and would otherwise spend more
+// time starting threads than running them. the calling thread does some of
+// the work too, so the pool starts num_threads - 1 threads of its own.
+class thread_pool {
+public:
+  // 0 means default_thread_count()
+  explicit thread_pool(size_t num_threads = 0);
+  thread_pool(const thread_pool&) = delete;
+  thread_pool& operator=(const thread_pool&) = delete;
+  ~thread_pool();
+
+  size_t size() const;
+
+  // the same as the parallel_for function, using at most size() threads.
+  // only one thread can call this at a time, and fn must not call it
+  void parallel_for(size_t count,
+      const std::function<void(size_t index, size_t thread_index)>& fn);
+
+private:
+  struct loop;
+
+  void worker_routine(size_t thread_index);
+
+  size_t num_threads;
+  std::mutex lock;
+  std::condition_variable loop_started;
+  std::condition_variable loop_finished;
+  loop* current_loop; // NULL between loops
+  uint64_t loop_count; // loops started so far; workers wait for it to change
+  size_t num_workers_running;
+  bool should_exit;
+  std::vector<std::thread> workers;
+};
+
+#endif // __PARALLEL_H
@@ -0,0 +1,399 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "level.hh"
+#include "path_planner.hh"
+
+using namespace std;
+
+
+static const int32_t UNREACHABLE = 0x7FFFFFFF;
+
+// distance between two coordinates along one axis of the wrapping grid
+static int32_t wrapped_distance(int32_t a, int32_t b, int32_t size) {
+  int32_t d = (((a - b) % size) + size) % size;
+  return min(d, size - d);
+}
+
+// true if the player would be crushed or blown up soon after moving into
+// (x, y)
+static bool is_deadly(const level_state& l, int32_t x, int32_t y) {
+  const cell_state& above = l.at(x, y - 1);
+  if (above.should_fall() && (above.param == Falling)) {
+    return true;
+  }
+  for (const auto& e : l.pending_explosions) {
+    if ((wrapped_distance(x, e.x, l.w) <= e.size) &&
+        (wrapped_distance(y, e.y, l.h) <= e.size)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+path_planner::path_planner() : is_active(false), w(0), h(0), target_index(0),
+    frames_executed(0), rewind_count(0) { }
+
+bool path_planner::set_target(const level_state& l, int32_t x, int32_t y) {
+  if ((x < 0) || (y < 0) || (static_cast<uint32_t>(x) >= l.w) ||
+      (static_cast<uint32_t>(y) >= l.h)) {
+    this->clear();
+    return false;
+  }
+
+  this->is_active = true;
+  this->target_index = y * l.w + x;
+  this->rebuild(l);
+  if (this->distances[l.player_y * l.w + l.player_x] == UNREACHABLE) {
+    this->clear();
+    return false;
+  }
+  return true;
+}
+
+void path_planner::clear() {
+  this->is_active = false;
+}
+
+bool path_planner::active() const {
+  return this->is_active;
+}
+
+pair<int32_t, int32_t> path_planner::target() const {
+  return make_pair(this->target_index % this->w, this->target_index / this->w);
+}
+
+int32_t path_planner::distance(int32_t x, int32_t y) const {
+  if (!this->is_active || (x < 0) || (y < 0) ||
+      (static_cast<uint32_t>(x) >= this->w) ||
+      (static_cast<uint32_t>(y) >= this->h)) {
+    return -1;
+  }
+  int32_t ret = this->distances[y * this->w + x];
+  return (ret == UNREACHABLE) ? -1 : ret;
+}
+
+void path_planner::update(const level_state& l) {
+  if (!this->is_active) {
+    return;
+  }
+  if ((l.w != this->w) || (l.h != this->h)) {
+    this->clear();
+    return;
+  }
+  if (l.rewind_count == this->rewind_count) {
+    if (l.frames_executed == this->frames_executed) {
+      return;
+    }
+    // changed_cells only covers the last frame, so it's only enough if
+    // exactly one frame has run since the last update
+    if (l.frames_executed == this->frames_executed + 1) {
+      this->repair(l);
+      this->frames_executed = l.frames_executed;
+      return;
+    }
+  }
+  this->rebuild(l);
+}
+
+player_impulse path_planner::next_impulse(const level_state& l) {
+  this->update(l);
+  if (!this->is_active) {
+    return None;
+  }
+
+  uint32_t index = l.player_y * this->w + l.player_x;
+  int32_t distance = this->distances[index];
+  if ((distance == 0) || (distance == UNREACHABLE)) {
+    this->clear();
+    return None;
+  }
+
+  uint32_t next_index = 0;
+  player_impulse ret = None;
+  this->for_each_successor(index, [&](uint32_t to, player_impulse dir) {
+    if ((ret == None) && (this->distances[to] == distance - 1)) {
+      next_index = to;
+      ret = dir;
+    }
+  });
+  // walking into the exit before the level can be won doesn't go anywhere
+  bool can_win = (l.num_red_bombs >= 0) && (l.num_items_remaining <= 0);
+  if ((ret == None) || ((l.cells[next_index].type == Exit) && !can_win) ||
+      is_deadly(l, next_index % this->w, next_index / this->w)) {
+    this->clear();
+    return None;
+  }
+  return ret;
+}
+
+uint8_t path_planner::flags_for_cell(const level_state& l,
+    uint32_t index) const {
+  const cell_state& c = l.cells[index];
+  uint8_t ret = 0;
+  if (c.is_edible() || (c.type == Player) ||
+      ((index == this->target_index) && (c.type == Exit))) {
+    ret |= Passable;
+  }
+  if (c.type == Empty) {
+    ret |= IsEmpty;
+  }
+  if (c.is_any_portal()) {
+    ret |= IsPortal;
+  }
+  return ret;
+}
+
+uint32_t path_planner::neighbor(uint32_t index, player_impulse dir) const {
+  const auto& offset = offset_for_impulse.at(dir);
+  uint32_t x = (index % this->w + this->w + offset.first) % this->w;
+  uint32_t y = (index / this->w + this->h + offset.second) % this->h;
+  return y * this->w + x;
+}
+
+template <typename F>
+void path_planner::for_each_successor(uint32_t index, F fn) const {
+  uint8_t flags = this->cell_flags[index];
+  if (!(flags & Passable)) {
+    return;
+  }
+  for (player_impulse dir : movement_impulses) {
+    uint32_t to = this->neighbor(index, dir);
+    if (this->cell_flags[to] & Passable) {
+      fn(to, dir);
+    }
+  }
+  if (!(flags & PortalSource)) {
+    return;
+  }
+  auto it = lower_bound(this->edges_by_from.begin(), this->edges_by_from.end(),
+      index, [](const portal_edge& e, uint32_t index) {
+    return e.from < index;
+  });
+  for (; (it != this->edges_by_from.end()) && (it->from == index); it++) {
+    if (this->cell_flags[it->to] & IsEmpty) {
+      fn(it->to, it->dir);
+    }
+  }
+}
+
+template <typename F>
+void path_planner::for_each_predecessor(uint32_t index, F fn) const {
+  uint8_t flags = this->cell_flags[index];
+  if (flags & Passable) {
+    for (player_impulse dir : movement_impulses) {
+      uint32_t from = this->neighbor(index, dir);
+      if (this->cell_flags[from] & Passable) {
+        fn(from);
+      }
+    }
+  }
+  if ((flags & (IsEmpty | PortalDestination)) != (IsEmpty | PortalDestination)) {
+    return;
+  }
+  auto it = lower_bound(this->edges_by_to.begin(), this->edges_by_to.end(),
+      index, [](const portal_edge& e, uint32_t index) {
+    return e.to < index;
+  });
+  for (; (it != this->edges_by_to.end()) && (it->to == index); it++) {
+    if (this->cell_flags[it->from] & Passable) {
+      fn(it->from);
+    }
+  }
+}
+
+void path_planner::rebuild(const level_state& l) {
+  this->w = l.w;
+  this->h = l.h;
+  this->frames_executed = l.frames_executed;
+  this->rewind_count = l.rewind_count;
+  this->cell_flags.resize(l.cells.size());
+  for (uint32_t x = 0; x < l.cells.size(); x++) {
+    this->cell_flags[x] = this->flags_for_cell(l, x);
+  }
+  this->rebuild_portal_edges(l);
+
+  // breadth-first search backward from the target
+  this->distances.assign(l.cells.size(), UNREACHABLE);
+  if (!(this->cell_flags[this->target_index] & Passable)) {
+    return;
+  }
+  this->distances[this->target_index] = 0;
+  this->pending.clear();
+  this->pending.emplace_back(this->target_index);
+  for (size_t x = 0; x < this->pending.size(); x++) {
+    uint32_t index = this->pending[x];
+    int32_t distance = this->distances[index] + 1;
+    this->for_each_predecessor(index, [&](uint32_t from) {
+      if (this->distances[from] == UNREACHABLE) {
+        this->distances[from] = distance;
+        this->pending.emplace_back(from);
+      }
+    });
+  }
+}
+
+void path_planner::rebuild_portal_edges(const level_state& l) {
+  this->edges_by_from.clear();
+  for (int32_t y = 0; y < static_cast<int32_t>(l.h); y++) {
+    for (int32_t x = 0; x < static_cast<int32_t>(l.w); x++) {
+      const cell_state& c = l.at(x, y);
+      if (!c.is_any_portal()) {
+        continue;
+      }
+
+      // from the cell behind the portal, going through it
+      for (player_impulse dir : movement_impulses) {
+        const auto& offset = offset_for_impulse.at(dir);
+        int32_t from_x = x - offset.first, from_y = y - offset.second;
+        pair<int32_t, int32_t> to;
+        if (l.portal_exit_position(from_x, from_y, dir, &to)) {
+          portal_edge e{
+              static_cast<uint32_t>(&l.at(from_x, from_y) - l.cells.data()),
+              static_cast<uint32_t>(&l.at(to) - l.cells.data()), dir};
+          this->cell_flags[e.from] |= PortalSource;
+          this->cell_flags[e.to] |= PortalDestination;
+          this->edges_by_from.emplace_back(e);
+        }
+      }
+    }
+  }
+
+  this->edges_by_to = this->edges_by_from;
+  sort(this->edges_by_from.begin(), this->edges_by_from.end(),
+      [](const portal_edge& a, const portal_edge& b) {
+    return a.from < b.from;
+  });
+  sort(this->edges_by_to.begin(), this->edges_by_to.end(),
+      [](const portal_edge& a, const portal_edge& b) {
+    return a.to < b.to;
+  });
+}
+
+void path_planner::repair(const level_state& l) {
+  // the only edges that can have appeared or disappeared are those out of the
+  // changed cells and into them, so only the cells they start from can need
+  // different distances at first. most changes (e.g. the player moving, or an
+  // item falling through empty space onto a circuit) don't change any edges
+  this->affected.clear();
+  for (uint32_t index : l.changed_cells) {
+    uint8_t prev_flags = this->cell_flags[index];
+    uint8_t flags = this->flags_for_cell(l, index) |
+        (prev_flags & (PortalSource | PortalDestination));
+    uint8_t relevant = Passable | IsPortal |
+        ((flags & PortalDestination) ? IsEmpty : 0);
+    this->cell_flags[index] = flags;
+    if (!((prev_flags ^ flags) & relevant)) {
+      continue;
+    }
+
+    // portals only change when they're destroyed, but then the jump portal
+    // searches can end somewhere else, so it's simplest to start over
+    if ((prev_flags ^ flags) & IsPortal) {
+      this->rebuild(l);
+      return;
+    }
+
+    this->affected.emplace_back(index);
+    for (player_impulse dir : movement_impulses) {
+      this->affected.emplace_back(this->neighbor(index, dir));
+    }
+    if (flags & PortalDestination) {
+      auto it = lower_bound(this->edges_by_to.begin(), this->edges_by_to.end(),
+          index, [](const portal_edge& e, uint32_t index) {
+        return e.to < index;
+      });
+      for (; (it != this->edges_by_to.end()) && (it->to == index); it++) {
+        this->affected.emplace_back(it->from);
+      }
+    }
+  }
+  if (this->affected.empty()) {
+    return;
+  }
+
+  // first forget the distances that aren't backed by a path any more: a
+  // cell's distance holds if it has a successor one step closer to the
+  // target. when one is forgotten, the cells that might have been relying on
+  // it are checked too
+  this->invalidated.clear();
+  this->pending = this->affected;
+  while (!this->pending.empty()) {
+    uint32_t index = this->pending.back();
+    this->pending.pop_back();
+    int32_t distance = this->distances[index];
+    if (distance == UNREACHABLE) {
+      continue;
+    }
+    bool supported = false;
+    if (distance == 0) {
+      supported = (index == this->target_index) &&
+          (this->cell_flags[index] & Passable);
+    } else {
+      this->for_each_successor(index, [&](uint32_t to, player_impulse) {
+        supported |= (this->distances[to] == distance - 1);
+      });
+    }
+    if (supported) {
+      continue;
+    }
+    this->distances[index] = UNREACHABLE;
+    this->invalidated.emplace_back(index);
+    this->for_each_predecessor(index, [&](uint32_t from) {
+      if (this->distances[from] == distance + 1) {
+        this->pending.emplace_back(from);
+      }
+    });
+  }
+
+  // then lower the distances of the affected and forgotten cells as far as
+  // their successors allow, and spread any improvements backward, closest
+  // cells first
+  this->heap.clear();
+  auto lower = [&](uint32_t index) {
+    if (!(this->cell_flags[index] & Passable)) {
+      return;
+    }
+    int32_t best = (index == this->target_index) ? 0 : UNREACHABLE;
+    this->for_each_successor(index, [&](uint32_t to, player_impulse) {
+      if (this->distances[to] < best - 1) {
+        best = this->distances[to] + 1;
+      }
+    });
+    if (best < this->distances[index]) {
+      this->distances[index] = best;
+      this->heap.emplace_back(best, index);
+      push_heap(this->heap.begin(), this->heap.end(),
+          greater<pair<int32_t, uint32_t>>());
+    }
+  };
+  for (uint32_t index : this->affected) {
+    lower(index);
+  }
+  for (uint32_t index : this->invalidated) {
+    lower(index);
+  }
+  while (!this->heap.empty()) {
+    pop_heap(this->heap.begin(), this->heap.end(),
+        greater<pair<int32_t, uint32_t>>());
+    int32_t distance = this->heap.back().first;
+    uint32_t index = this->heap.back().second;
+    this->heap.pop_back();
+    if (distance != this->distances[index]) {
+      continue;
+    }
+    this->for_each_predecessor(index, [&](uint32_t from) {
+      if (this->distances[from] > distance + 1) {
+        this->distances[from] = distance + 1;
+        this->heap.emplace_back(distance + 1, from);
+        push_heap(this->heap.begin(), this->heap.end(),
+            greater<pair<int32_t, uint32_t>>());
+      }
+    });
+  }
+}
@@ -0,0 +1,100 @@
+#ifndef __PATH_PLANNER_H
+#define __PATH_PLANNER_H
+
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include "level.hh"
+
+
+// plans the player's moves to a cell they clicked on. paths only go through
+// cells the player can walk into without pushing or pulling anything
+// (cell_state::is_edible), and through portals the same way exec_frame does.
+//
+// the planner keeps the distance from every cell to the target. setting a
+// target computes all of them, but after that only the distances that depend
+// on the cells each frame changed (level_state::changed_cells) are fixed, so
+// following a path costs time proportional to how much of the level changes
+// rather than to its size. if the state jumps to another frame instead (e.g.
+// by rewinding), everything is computed again.
+class path_planner {
+public:
+  path_planner();
+
+  // starts a new path. returns false (and clears the current path) if the
+  // player can't get to the cell from where they are now
+  bool set_target(const level_state& l, int32_t x, int32_t y);
+  void clear();
+  bool active() const;
+  std::pair<int32_t, int32_t> target() const;
+  // moves from a cell to the target as of the last update, or -1 if the
+  // target can't be reached from there or there's no path
+  int32_t distance(int32_t x, int32_t y) const;
+
+  // brings the distances up to date with the state. call this after every
+  // frame while the path is active
+  void update(const level_state& l);
+
+  // the player's next move along the path, or None if there isn't one. the
+  // path is cleared when the player gets to the target, when the target can't
+  // be reached any more, or when the next step would put the player under a
+  // falling object or in an explosion
+  player_impulse next_impulse(const level_state& l);
+
+private:
+  struct portal_edge {
+    uint32_t from; // the cell the player moves from
+    uint32_t to; // where they come out; the edge is usable only if it's Empty
+    player_impulse dir;
+  };
+
+  // what the planner knows about each cell, kept up to date from
+  // level_state::changed_cells. only changes to the first two (or to the
+  // third, for portal destinations) make any edges appear or disappear
+  enum cell_flag {
+    Passable = 0x01,
+    IsEmpty = 0x02,
+    IsPortal = 0x04,
+    PortalSource = 0x08,
+    PortalDestination = 0x10,
+  };
+
+  uint8_t flags_for_cell(const level_state& l, uint32_t index) const;
+  uint32_t neighbor(uint32_t index, player_impulse dir) const;
+
+  // these only visit the edges that can be used in the current state
+  template <typename F>
+  void for_each_successor(uint32_t index, F fn) const;
+  template <typename F>
+  void for_each_predecessor(uint32_t index, F fn) const;
+
+  void rebuild(const level_state& l);
+  void rebuild_portal_edges(const level_state& l);
+  void repair(const level_state& l);
+
+  bool is_active;
+  uint32_t w;
+  uint32_t h;
+  uint32_t target_index;
+  // the state the distances are for
+  uint64_t frames_executed;
+  uint64_t rewind_count;
+
+  // moves from each cell to the target, or UNREACHABLE
+  std::vector<int32_t> distances;
+  std::vector<uint8_t> cell_flags;
+
+  // every way through a portal, sorted by source and by destination
+  std::vector<portal_edge> edges_by_from;
+  std::vector<portal_edge> edges_by_to;
+
+  // scratch space for repair, kept to avoid allocating every frame
+  std::vector<uint32_t> affected;
+  std::vector<uint32_t> pending;
+  std::vector<uint32_t> invalidated;
+  std::vector<std::pair<int32_t, uint32_t>> heap;
+};
+
+#endif // __PATH_PLANNER_H
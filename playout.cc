@@ -0,0 +1,138 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <random>
+
+#include "level.hh"
+#include "playout.hh"
+
+using namespace std;
+
+
+// the shorter way from a to b on a level that wraps around, as a signed offset
+static int32_t wrapped_delta(int32_t a, int32_t b, int32_t size) {
+  int32_t d = (b - a) % size;
+  if (d > size / 2) {
+    d -= size;
+  } else if (d < -size / 2) {
+    d += size;
+  }
+  return d;
+}
+
+// chooses moves for one playout. the greedy policy remembers its target until
+// it's gone, so it only searches the level when something's collected or
+// destroyed
+struct playout_player {
+  playout_policy policy;
+  mt19937_64& rng;
+  player_impulse last_impulse;
+  int32_t target_x;
+  int32_t target_y;
+  cell_type target_type;
+
+  playout_player(playout_policy policy, mt19937_64& rng) : policy(policy),
+      rng(rng), last_impulse(None), target_x(-1), target_y(-1),
+      target_type(Empty) { }
+
+  bool find_target(const level_state& l) {
+    this->target_type = (l.num_items_remaining > 0) ? Item : Exit;
+    int64_t min_distance = -1;
+    for (int32_t y = 0; y < static_cast<int32_t>(l.h); y++) {
+      for (int32_t x = 0; x < static_cast<int32_t>(l.w); x++) {
+        if (l.at(x, y).type != this->target_type) {
+          continue;
+        }
+        int64_t distance = abs(wrapped_delta(l.player_x, x, l.w)) +
+            abs(wrapped_delta(l.player_y, y, l.h));
+        if ((min_distance < 0) || (distance < min_distance)) {
+          min_distance = distance;
+          this->target_x = x;
+          this->target_y = y;
+        }
+      }
+    }
+    return (min_distance >= 0);
+  }
+
+  player_impulse random_impulse() {
+    // mostly keep going the same way, so the player gets somewhere instead of
+    // jittering in place
+    if ((this->last_impulse != None) && ((this->rng() & 3) != 0)) {
+      return this->last_impulse;
+    }
+    return static_cast<player_impulse>(this->rng() % 5);
+  }
+
+  player_actions next(const level_state& l) {
+    player_actions ret;
+    ret.impulse = None;
+    if ((this->policy == playout_policy::Greedy) && ((this->rng() % 10) < 7)) {
+      bool have_target = (this->target_x >= 0) &&
+          (l.at(this->target_x, this->target_y).type == this->target_type) &&
+          ((this->target_type == Item) || (l.num_items_remaining <= 0));
+      if (have_target || this->find_target(l)) {
+        int32_t dx = wrapped_delta(l.player_x, this->target_x, l.w);
+        int32_t dy = wrapped_delta(l.player_y, this->target_y, l.h);
+        bool horizontal = (dy == 0) || ((dx != 0) && (this->rng() & 1));
+        if (horizontal) {
+          ret.impulse = (dx < 0) ? Left : Right;
+        } else {
+          ret.impulse = (dy < 0) ? Up : Down;
+        }
+      }
+    }
+    if (ret.impulse == None) {
+      ret.impulse = this->random_impulse();
+    }
+    this->last_impulse = ret.impulse;
+
+    // only drop bombs the player has, like the solver
+    ret.drop_bomb = (ret.impulse != None) && (l.num_red_bombs > 0) &&
+        ((this->rng() % 32) == 0);
+    return ret;
+  }
+};
+
+void run_playout(level_state& l, playout_policy policy,
+    uint64_t max_frames, mt19937_64& rng, playout_totals& totals) {
+  playout_player player(policy, rng);
+  int32_t initial_items = l.num_items_remaining;
+
+  totals.playouts++;
+  if (l.unwinnable) {
+    totals.dead_ends++;
+    return;
+  }
+
+  uint64_t frame;
+  for (frame = 0; frame < max_frames; frame++) {
+    // things that fall on the player explode on the frame they land, so a
+    // death can be told apart by what was falling just above the player
+    const cell_state& above = l.at(l.player_x, l.player_y - 1);
+    bool falling_above = above.should_fall() && (above.param == Falling);
+
+    l.exec_frame(player.next(l));
+    if (l.player_did_win) {
+      totals.wins++;
+      break;
+    }
+    if (!l.player_is_alive()) {
+      (falling_above ? totals.crushed : totals.exploded)++;
+      break;
+    }
+    if (l.unwinnable) {
+      totals.dead_ends++;
+      break;
+    }
+  }
+
+  totals.frames_survived += frame;
+  totals.frames_executed += (frame < max_frames) ? (frame + 1) : frame;
+  int32_t items = initial_items - l.num_items_remaining;
+  totals.items_collected += max<int32_t>(items, 0);
+  if ((items > 0) || l.player_did_win) {
+    totals.made_progress++;
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef __PLAYOUT_H
+#define __PLAYOUT_H
+
+#include <stdint.h>
+
+#include <random>
+
+#include "level.hh"
+
+
+// short games with random (or greedy, but still random) moves, which
+// mbes-difficulty plays many of to rate a level. a playout ends when the
+// player dies, wins, or the level is unwinnable (see level_state::unwinnable),
+// or after a number of frames.
+
+enum class playout_policy {
+  Random = 0,
+  Greedy,
+};
+
+struct playout_totals {
+  uint64_t playouts;
+  uint64_t wins;
+  uint64_t crushed; // died to something falling on the player
+  uint64_t exploded; // died to any other explosion
+  uint64_t dead_ends; // made the level unwinnable, or it was from the start
+  uint64_t made_progress; // collected an item or won
+  uint64_t items_collected;
+  uint64_t frames_survived;
+  uint64_t frames_executed; // frames_survived plus the frames playouts ended on
+
+  playout_totals() : playouts(0), wins(0), crushed(0), exploded(0),
+      dead_ends(0), made_progress(0), items_collected(0), frames_survived(0),
+      frames_executed(0) { }
+
+  void add(const playout_totals& other) {
+    this->playouts += other.playouts;
+    this->wins += other.wins;
+    this->crushed += other.crushed;
+    this->exploded += other.exploded;
+    this->dead_ends += other.dead_ends;
+    this->made_progress += other.made_progress;
+    this->items_collected += other.items_collected;
+    this->frames_survived += other.frames_survived;
+    this->frames_executed += other.frames_executed;
+  }
+};
+
+// plays l until the playout ends and adds how it went to totals. a level
+// that's already unwinnable counts as a dead end without playing any frames
+void run_playout(level_state& l, playout_policy policy, uint64_t max_frames,
+    std::mt19937_64& rng, playout_totals& totals);
+
+#endif // __PLAYOUT_H
@@ -0,0 +1,416 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "action_buffer.hh"
+#include "codec.hh"
+#include "file_io.hh"
+#include "level.hh"
+#include "level_pack.hh"
+#include "recording.hh"
+
+using namespace std;
+
+
+// version 1: the signature, a 32-bit frame count, then four bits per frame
+// (drop_bomb, then the impulse's three bits), packed MSB-first.
+static const uint32_t RECORDING_SIGNATURE_V1 = 0x43454345;
+
+// version 2: this header, then num_runs runs. each run is a number of frames
+// and the action that was taken on all of them; the action is stored as a
+// nibble with drop_bomb in bit 3 and the impulse in bits 0-2. without
+// entropy coding, each run is a varint ((length - 1) << 4) | action. with it,
+// the runs are range-coded: the action is modeled on the previous run's
+// action, and the length is modeled on the run's own action.
+//
+// if the fingerprint flag is set, a recording_fingerprint_v2 follows the
+// header and the runs take up only runs_size bytes. after them are
+// num_keyframes recording_keyframe_entry_v2 structs, then the keyframes' data
+// (see encode_keyframe) in the same order.
+static const uint32_t RECORDING_SIGNATURE_V2 = 0x3252424D; // 'MBR2'
+static const uint32_t RECORDING_FLAG_ENTROPY_CODED = 0x00000001;
+static const uint32_t RECORDING_FLAG_HAS_FINGERPRINT = 0x00000002;
+
+struct recording_header_v2 {
+  uint32_t signature;
+  uint32_t flags;
+  uint64_t num_frames;
+  uint64_t num_runs;
+};
+
+struct recording_fingerprint_v2 {
+  uint64_t source_level_hash;
+  uint64_t final_state_hash;
+  uint64_t runs_size;
+  uint64_t num_keyframes;
+};
+
+struct recording_keyframe_entry_v2 {
+  uint64_t frame;
+  uint64_t state_hash;
+  uint64_t size;
+};
+
+struct recording_run {
+  uint64_t length;
+  uint8_t action;
+};
+
+struct recording_run_models {
+  bit_tree_model<4> actions[16];
+  integer_model lengths[16];
+};
+
+
+
+recording_file::recording_file() : has_fingerprint(false),
+    source_level_hash(0), final_state_hash(0) { }
+
+bool recording_file::matches_level(const level_state& source_level) const {
+  return !this->has_fingerprint ||
+      (this->source_level_hash == source_level.hash());
+}
+
+bool recording_file::matches_level(const level_template& source_level) const {
+  return !this->has_fingerprint ||
+      (this->source_level_hash == source_level.hash());
+}
+
+
+
+static inline struct player_actions nibble_to_action(uint8_t nibble) {
+  if ((nibble & 0x07) > Right) {
+    throw runtime_error("recording contains an invalid impulse");
+  }
+  return decode_action(nibble);
+}
+
+// appends a run to the recording, checking it against the header's frame
+// count first so a corrupt run length can't make us allocate huge amounts of
+// memory
+static void append_run(action_buffer& recording, uint64_t num_frames,
+    uint64_t length, uint8_t action) {
+  if ((length == 0) || (length > num_frames - recording.size())) {
+    throw runtime_error("recording run extends beyond end of recording");
+  }
+  recording.append_run(nibble_to_action(action), length);
+}
+
+// keyframes are the level's compressed representation, preceded by the
+// runtime fields that compress_level doesn't store
+string encode_keyframe(const level_state& l) {
+  string data;
+  append_varint(data, l.player_lose_frame);
+  data.push_back((l.player_will_drop_bomb ? 0x01 : 0x00) |
+      (l.player_did_win ? 0x02 : 0x00));
+  data += compress_level(l);
+  return data;
+}
+
+level_state decode_keyframe(const recording_keyframe& kf) {
+  const uint8_t* ptr = reinterpret_cast<const uint8_t*>(kf.data.data());
+  const uint8_t* end = ptr + kf.data.size();
+  uint64_t player_lose_frame = read_varint(ptr, end);
+  if (ptr == end) {
+    throw runtime_error("recording keyframe is truncated");
+  }
+  uint8_t flags = *(ptr++);
+
+  level_state l = decompress_level(ptr, end - ptr);
+  l.player_lose_frame = player_lose_frame;
+  l.player_will_drop_bomb = (flags & 0x01) ? true : false;
+  l.player_did_win = (flags & 0x02) ? true : false;
+  // decompress_level tracked winnability before the flags were set
+  l.update_winnability();
+  l.clear_undo_log();
+  if (l.hash() != kf.state_hash) {
+    throw runtime_error("recording keyframe is corrupt");
+  }
+  return l;
+}
+
+
+
+static action_buffer decode_recording_v1(const uint8_t* data, size_t size) {
+  mapped_reader r(data, size);
+  r.skip(sizeof(uint32_t)); // signature
+  uint32_t count = *r.get<uint32_t>();
+  if (r.remaining() < (static_cast<uint64_t>(count) + 1) / 2) {
+    throw runtime_error("recording is truncated");
+  }
+  const uint8_t* frame_data = r.get<uint8_t>((static_cast<uint64_t>(count) + 1) / 2);
+
+  action_buffer recording;
+
+  // 16 frames at a time: byte-swap each word so the first frame is in the
+  // high nibble, then shift the frames out from the top
+  uint32_t x = 0;
+  for (; count - x >= 16; x += 16) {
+    uint64_t w;
+    memcpy(&w, frame_data + (x >> 1), sizeof(w));
+    w = __builtin_bswap64(w);
+    for (size_t y = 0; y < 16; y++) {
+      recording.push_back(nibble_to_action(w >> 60));
+      w <<= 4;
+    }
+  }
+  for (; x < count; x++) {
+    uint8_t b = frame_data[x >> 1];
+    recording.push_back(nibble_to_action((x & 1) ? (b & 0x0F) : (b >> 4)));
+  }
+
+  return recording;
+}
+
+static action_buffer decode_runs_v2(const recording_header_v2& header,
+    const uint8_t* payload, const uint8_t* payload_end) {
+  if (header.num_runs > header.num_frames) {
+    throw runtime_error("recording has more runs than frames");
+  }
+
+  action_buffer recording;
+  if (header.flags & RECORDING_FLAG_ENTROPY_CODED) {
+    recording_run_models models;
+    range_decoder dec(payload, payload_end - payload);
+    uint8_t prev_action = 0;
+    for (uint64_t x = 0; x < header.num_runs; x++) {
+      uint8_t action = models.actions[prev_action].decode(dec);
+      uint64_t length = models.lengths[action].decode(dec) + 1;
+      if (dec.overran()) {
+        throw runtime_error("recording is truncated");
+      }
+      append_run(recording, header.num_frames, length, action);
+      prev_action = action;
+    }
+
+  } else {
+    for (uint64_t x = 0; x < header.num_runs; x++) {
+      uint64_t v = read_varint(payload, payload_end);
+      append_run(recording, header.num_frames, (v >> 4) + 1, v & 0x0F);
+    }
+    if (payload != payload_end) {
+      throw runtime_error("recording has extra data after the last run");
+    }
+  }
+
+  if (recording.size() != header.num_frames) {
+    throw runtime_error("recording frame count does not match its runs");
+  }
+  return recording;
+}
+
+static recording_file decode_recording_v2(const uint8_t* data, size_t size) {
+  mapped_reader r(data, size);
+  const auto* header = r.get<recording_header_v2>();
+  if (header->flags & ~(RECORDING_FLAG_ENTROPY_CODED | RECORDING_FLAG_HAS_FINGERPRINT)) {
+    throw runtime_error("recording has unknown flags");
+  }
+
+  recording_file ret;
+  if (!(header->flags & RECORDING_FLAG_HAS_FINGERPRINT)) {
+    ret.actions = decode_runs_v2(*header, data + r.where(), data + size);
+    return ret;
+  }
+
+  const auto* fingerprint = r.get<recording_fingerprint_v2>();
+  if (fingerprint->runs_size > r.remaining()) {
+    throw runtime_error("recording is truncated");
+  }
+  const uint8_t* runs = r.get<uint8_t>(fingerprint->runs_size);
+  ret.actions = decode_runs_v2(*header, runs, runs + fingerprint->runs_size);
+  ret.has_fingerprint = true;
+  ret.source_level_hash = fingerprint->source_level_hash;
+  ret.final_state_hash = fingerprint->final_state_hash;
+
+  if (fingerprint->num_keyframes > r.remaining() / sizeof(recording_keyframe_entry_v2)) {
+    throw runtime_error("recording keyframe index is truncated");
+  }
+  const auto* entries = r.get<recording_keyframe_entry_v2>(
+      fingerprint->num_keyframes);
+  for (size_t x = 0; x < fingerprint->num_keyframes; x++) {
+    const auto& e = entries[x];
+    if ((e.frame > header->num_frames) ||
+        (x && (e.frame <= entries[x - 1].frame))) {
+      throw runtime_error("recording keyframe index is corrupt");
+    }
+    if (e.size > r.remaining()) {
+      throw runtime_error("recording keyframe is truncated");
+    }
+    ret.keyframes.emplace_back();
+    auto& kf = ret.keyframes.back();
+    kf.frame = e.frame;
+    kf.state_hash = e.state_hash;
+    kf.data.assign(r.get<char>(e.size), e.size);
+  }
+
+  return ret;
+}
+
+recording_file decode_recording_file(const void* data, size_t size) {
+  if (size < sizeof(uint32_t)) {
+    throw runtime_error("recording is truncated");
+  }
+  uint32_t signature;
+  memcpy(&signature, data, sizeof(signature));
+
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  if (signature == RECORDING_SIGNATURE_V1) {
+    recording_file ret;
+    ret.actions = decode_recording_v1(bytes, size);
+    return ret;
+  }
+  if (signature == RECORDING_SIGNATURE_V2) {
+    return decode_recording_v2(bytes, size);
+  }
+  throw invalid_argument("incorrect version");
+}
+
+action_buffer decode_recording(const void* data, size_t size) {
+  return decode_recording_file(data, size).actions;
+}
+
+
+
+static string encode_runs_v2(recording_header_v2& header,
+    const action_buffer& recording, bool entropy_code) {
+  vector<recording_run> runs;
+  recording.for_each_run([&](const struct player_actions& actions,
+      uint64_t length) {
+    runs.push_back({length, encode_action(actions)});
+  });
+
+  header.signature = RECORDING_SIGNATURE_V2;
+  header.flags = entropy_code ? RECORDING_FLAG_ENTROPY_CODED : 0;
+  header.num_frames = recording.size();
+  header.num_runs = runs.size();
+
+  if (entropy_code) {
+    recording_run_models models;
+    range_encoder enc;
+    uint8_t prev_action = 0;
+    for (const auto& run : runs) {
+      models.actions[prev_action].encode(enc, run.action);
+      models.lengths[run.action].encode(enc, run.length - 1);
+      prev_action = run.action;
+    }
+    return enc.finish();
+  }
+
+  string data;
+  data.reserve(runs.size() * 2);
+  for (const auto& run : runs) {
+    append_varint(data, ((run.length - 1) << 4) | run.action);
+  }
+  return data;
+}
+
+string encode_recording(const action_buffer& recording, bool entropy_code) {
+  recording_header_v2 header;
+  string runs = encode_runs_v2(header, recording, entropy_code);
+
+  string data(reinterpret_cast<const char*>(&header), sizeof(header));
+  data += runs;
+  return data;
+}
+
+string encode_recording(const action_buffer& recording,
+    const level_state& source_level, uint64_t keyframe_interval,
+    bool entropy_code) {
+  recording_header_v2 header;
+  string runs = encode_runs_v2(header, recording, entropy_code);
+  header.flags |= RECORDING_FLAG_HAS_FINGERPRINT;
+
+  // replay the recording to get the keyframes and final state. nothing will
+  // rewind this copy, so it doesn't need an undo log
+  level_state l = source_level;
+  l.set_undo_log_enabled(false);
+  vector<recording_keyframe_entry_v2> entries;
+  string keyframe_data;
+  auto it = recording.begin();
+  for (size_t x = 0; x < recording.size(); x++, it++) {
+    if (x && keyframe_interval && ((x % keyframe_interval) == 0)) {
+      string kf = encode_keyframe(l);
+      entries.push_back({x, l.hash(), kf.size()});
+      keyframe_data += kf;
+    }
+    l.exec_frame(*it);
+  }
+
+  recording_fingerprint_v2 fingerprint;
+  fingerprint.source_level_hash = source_level.hash();
+  fingerprint.final_state_hash = l.hash();
+  fingerprint.runs_size = runs.size();
+  fingerprint.num_keyframes = entries.size();
+
+  string data(reinterpret_cast<const char*>(&header), sizeof(header));
+  data.append(reinterpret_cast<const char*>(&fingerprint), sizeof(fingerprint));
+  data += runs;
+  data.append(reinterpret_cast<const char*>(entries.data()),
+      entries.size() * sizeof(recording_keyframe_entry_v2));
+  data += keyframe_data;
+  return data;
+}
+
+
+
+recording_file load_recording_file(const string& filename) {
+  mapped_file f(filename);
+  return decode_recording_file(f.data(), f.size());
+}
+
+action_buffer load_recording(const string& filename) {
+  return load_recording_file(filename).actions;
+}
+
+void save_recording(const string& filename, const action_buffer& recording,
+    bool entropy_code) {
+  save_file_atomic(filename, encode_recording(recording, entropy_code));
+}
+
+void save_recording(const string& filename, const action_buffer& recording,
+    const level_state& source_level, uint64_t keyframe_interval,
+    bool entropy_code) {
+  save_file_atomic(filename, encode_recording(recording, source_level,
+      keyframe_interval, entropy_code));
+}
+
+
+
+uint64_t recording_content_hash(const action_buffer& recording,
+    uint64_t source_level_hash) {
+  // the plain (not range-coded) runs are a canonical form of the actions
+  recording_header_v2 header;
+  string runs = encode_runs_v2(header, recording, false);
+  return fnv1a64(runs.data(), runs.size(), source_level_hash);
+}
+
+level_state seek_recording(const level_state& source_level,
+    const action_buffer& recording,
+    const vector<recording_keyframe>& keyframes, uint64_t frame) {
+  if (frame > recording.size()) {
+    throw out_of_range("seek target is beyond the end of the recording");
+  }
+
+  // find the last keyframe at or before the target frame
+  auto kf_it = upper_bound(keyframes.begin(), keyframes.end(), frame,
+      [](uint64_t frame, const recording_keyframe& kf) {
+    return frame < kf.frame;
+  });
+
+  uint64_t start_frame = 0;
+  level_state l = (kf_it == keyframes.begin()) ? source_level :
+      decode_keyframe(*(kf_it - 1));
+  if (kf_it != keyframes.begin()) {
+    start_frame = (kf_it - 1)->frame;
+  }
+
+  auto it = recording.iterator_at(start_frame);
+  for (uint64_t x = start_frame; x < frame; x++, it++) {
+    l.exec_frame(*it);
+  }
+  return l;
+}
@@ -0,0 +1,87 @@
+#ifndef __RECORDING_H
+#define __RECORDING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "action_buffer.hh"
+#include "level.hh"
+
+
+// recordings (.mbr files) are the sequence of player actions for every frame
+// of a game. version 1 files store four bits per frame; version 2 files store
+// runs of identical actions, optionally range-coded. both can be read, but
+// recordings are always written as version 2.
+//
+// version 2 recordings saved with their source level also carry a
+// fingerprint: hashes of the source level and of the final state, plus
+// periodic keyframes of the game state so replays can start anywhere without
+// simulating everything before that point.
+
+static const uint64_t DEFAULT_KEYFRAME_INTERVAL = 2048;
+
+struct recording_keyframe {
+  uint64_t frame;
+  uint64_t state_hash; // level_state::hash() of the state at this frame
+  std::string data;
+};
+
+// keyframe data holds everything level_state::hash covers. decode_keyframe
+// throws runtime_error if the decoded state doesn't match kf.state_hash; the
+// decoded state's undo log starts at the keyframe
+std::string encode_keyframe(const level_state& l);
+level_state decode_keyframe(const recording_keyframe& kf);
+
+struct recording_file {
+  action_buffer actions;
+
+  bool has_fingerprint;
+  uint64_t source_level_hash;
+  uint64_t final_state_hash;
+  std::vector<recording_keyframe> keyframes;
+
+  recording_file();
+
+  // true if the recording has no fingerprint or was made on this level
+  bool matches_level(const level_state& source_level) const;
+  bool matches_level(const level_template& source_level) const;
+};
+
+std::string encode_recording(const action_buffer& recording,
+    bool entropy_code = true);
+// simulates the recording on source_level to generate the fingerprint
+std::string encode_recording(const action_buffer& recording,
+    const level_state& source_level,
+    uint64_t keyframe_interval = DEFAULT_KEYFRAME_INTERVAL,
+    bool entropy_code = true);
+recording_file decode_recording_file(const void* data, size_t size);
+action_buffer decode_recording(const void* data, size_t size);
+
+recording_file load_recording_file(const std::string& filename);
+action_buffer load_recording(const std::string& filename);
+void save_recording(const std::string& filename,
+    const action_buffer& recording, bool entropy_code = true);
+void save_recording(const std::string& filename,
+    const action_buffer& recording,
+    const level_state& source_level,
+    uint64_t keyframe_interval = DEFAULT_KEYFRAME_INTERVAL,
+    bool entropy_code = true);
+
+// identifies a recording by its actions and the level it was made on. two
+// recordings have the same content hash if and only if (barring collisions)
+// they play out identically, regardless of how they were encoded
+uint64_t recording_content_hash(const action_buffer& recording,
+    uint64_t source_level_hash);
+
+// returns the state after the first frame actions of the recording have been
+// executed on source_level. starts from the latest keyframe at or before
+// frame, so only the frames after it are simulated. the returned state's undo
+// log starts at that keyframe. keyframes must be sorted by frame.
+level_state seek_recording(const level_state& source_level,
+    const action_buffer& recording,
+    const std::vector<recording_keyframe>& keyframes, uint64_t frame);
+
+#endif // __RECORDING_H
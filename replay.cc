@@ -0,0 +1,47 @@
+#include <stdint.h>
+
+#include "action_buffer.hh"
+#include "activity.hh"
+#include "level.hh"
+#include "level_completion.hh"
+#include "replay.hh"
+
+using namespace std;
+
+
+replay_result::replay_result() : frames_executed(0), final_state_hash(0) {
+  this->stats.state = Attempted;
+}
+
+static replay_result replay_recording_on(level_state& l,
+    const action_buffer& recording, activity_counters* activity) {
+  // nothing rewinds this copy, so it doesn't need an undo log
+  l.set_undo_log_enabled(false);
+  l.activity = activity;
+
+  uint64_t frame = 0;
+  for (auto it = recording.begin(); (it != recording.end()) && !l.player_did_win;
+       it++, frame++) {
+    l.exec_frame(*it);
+  }
+
+  replay_result ret;
+  if (l.player_did_win) {
+    ret.stats = completion_for_win(l);
+  }
+  ret.frames_executed = frame;
+  ret.final_state_hash = l.hash();
+  return ret;
+}
+
+replay_result replay_recording(const level_state& source_level,
+    const action_buffer& recording, activity_counters* activity) {
+  level_state l = source_level;
+  return replay_recording_on(l, recording, activity);
+}
+
+replay_result replay_recording(const level_template& source_level,
+    const action_buffer& recording, activity_counters* activity) {
+  level_state l(source_level);
+  return replay_recording_on(l, recording, activity);
+}
@@ -0,0 +1,32 @@
+#ifndef __REPLAY_H
+#define __REPLAY_H
+
+#include <stdint.h>
+
+#include "action_buffer.hh"
+#include "activity.hh"
+#include "level.hh"
+#include "level_completion.hh"
+
+
+struct replay_result {
+  // stats.state is Completed if the recording wins the level and Attempted
+  // otherwise; the other stats are only meaningful if it's Completed
+  level_completion stats;
+  // frames that were executed. replays stop on the frame the player wins, so
+  // this can be less than the recording's length
+  uint64_t frames_executed;
+  uint64_t final_state_hash;
+
+  replay_result();
+};
+
+// plays the recording on a copy of source_level without rendering anything.
+// if activity isn't NULL, what happens in each cell is added to it (see
+// activity.hh); the copy never uses source_level's counters
+replay_result replay_recording(const level_state& source_level,
+    const action_buffer& recording, activity_counters* activity = NULL);
+replay_result replay_recording(const level_template& source_level,
+    const action_buffer& recording, activity_counters* activity = NULL);
+
+#endif // __REPLAY_H
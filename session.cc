@@ -0,0 +1,259 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <phosg/Filesystem.hh>
+
+#include "action_buffer.hh"
+#include "file_io.hh"
+#include "level.hh"
+#include "session.hh"
+
+using namespace std;
+
+
+// the session file is a fixed header followed by flat arrays of fixed-size
+// records, all 8-byte aligned, so it can be mapped and converted in bulk
+// without any per-field parsing:
+//   session_header
+//   session_cell[num_cells]
+//   explosion_info[num_pending_explosions]
+//   session_undo_record[num_undo_entries]
+//   uint8_t[num_recording_frames] (bit 3 = drop_bomb, bits 0-2 = impulse)
+
+static const uint64_t SESSION_SIGNATURE = 0x4D42455353455353; // 'MBESSESS'
+static const uint64_t SESSION_VERSION = 1;
+
+// no real level is anywhere near this big; refuse to allocate it
+static const uint64_t MAX_SESSION_CELLS = 0x1000000;
+
+struct session_header {
+  uint64_t signature;
+  uint64_t version;
+  uint64_t level_index;
+  uint64_t level_hash; // added in version 1
+  uint32_t w;
+  uint32_t h;
+  int32_t player_x;
+  int32_t player_y;
+  int32_t num_items_remaining;
+  int32_t num_red_bombs;
+  uint64_t frames_executed;
+  uint64_t rewind_count;
+  uint64_t player_lose_frame;
+  double player_lose_buffer;
+  float updates_per_second;
+  uint8_t player_will_drop_bomb;
+  uint8_t player_did_win;
+  uint8_t unused[2];
+  uint64_t num_pending_explosions;
+  uint64_t num_undo_entries;
+  uint64_t num_recording_frames;
+};
+
+struct session_cell {
+  int32_t type;
+  int32_t param;
+};
+
+struct session_undo_record {
+  uint8_t type;
+  uint8_t explosion_type;
+  uint16_t unused;
+  int32_t x;
+  int32_t y;
+  int32_t value; // cell type for Cell entries, size for explosion entries
+  uint64_t frame; // frame for markers and explosions, param for Cell entries
+};
+
+
+
+void save_session(const string& filename, uint64_t level_index,
+    uint64_t level_hash, const level_state& game,
+    const action_buffer& recording) {
+  typedef level_state::undo_log_entry::entry_type entry_type;
+
+  size_t num_cells = game.w * game.h;
+  size_t total_size = sizeof(session_header) +
+      num_cells * sizeof(session_cell) +
+      game.pending_explosions.size() * sizeof(explosion_info) +
+      game.undo_log.size() * sizeof(session_undo_record) +
+      recording.size();
+  string data(total_size, '\0');
+  uint8_t* ptr = reinterpret_cast<uint8_t*>(&data[0]);
+
+  session_header* header = reinterpret_cast<session_header*>(ptr);
+  header->signature = SESSION_SIGNATURE;
+  header->version = SESSION_VERSION;
+  header->level_index = level_index;
+  header->level_hash = level_hash;
+  header->w = game.w;
+  header->h = game.h;
+  header->player_x = game.player_x;
+  header->player_y = game.player_y;
+  header->num_items_remaining = game.num_items_remaining;
+  header->num_red_bombs = game.num_red_bombs;
+  header->frames_executed = game.frames_executed;
+  header->rewind_count = game.rewind_count;
+  header->player_lose_frame = game.player_lose_frame;
+  header->player_lose_buffer = game.player_lose_buffer;
+  header->updates_per_second = game.updates_per_second;
+  header->player_will_drop_bomb = game.player_will_drop_bomb;
+  header->player_did_win = game.player_did_win;
+  header->num_pending_explosions = game.pending_explosions.size();
+  header->num_undo_entries = game.undo_log.size();
+  header->num_recording_frames = recording.size();
+  ptr += sizeof(session_header);
+
+  session_cell* cells = reinterpret_cast<session_cell*>(ptr);
+  for (size_t x = 0; x < num_cells; x++) {
+    cells[x].type = game.cells[x].type;
+    cells[x].param = game.cells[x].param;
+  }
+  ptr += num_cells * sizeof(session_cell);
+
+  for (const explosion_info& e : game.pending_explosions) {
+    memcpy(ptr, &e, sizeof(e));
+    ptr += sizeof(e);
+  }
+
+  session_undo_record* undo_records = reinterpret_cast<session_undo_record*>(ptr);
+  for (const auto& e : game.undo_log) {
+    session_undo_record& r = *(undo_records++);
+    r.type = static_cast<uint8_t>(e.type);
+    switch (e.type) {
+      case entry_type::FrameMarker:
+        r.frame = e.frame;
+        break;
+      case entry_type::Cell:
+        r.x = e.cell.x;
+        r.y = e.cell.y;
+        r.value = e.cell.old_state.type;
+        r.frame = static_cast<uint32_t>(e.cell.old_state.param);
+        break;
+      case entry_type::CreateExplosion:
+      case entry_type::ExecuteExplosion:
+        r.explosion_type = e.explosion.type;
+        r.x = e.explosion.x;
+        r.y = e.explosion.y;
+        r.value = e.explosion.size;
+        r.frame = e.explosion.frame;
+        break;
+      case entry_type::GetItem:
+      case entry_type::GetRedBomb:
+      case entry_type::DropRedBomb:
+        break;
+    }
+  }
+  ptr = reinterpret_cast<uint8_t*>(undo_records);
+
+  for (auto it = recording.begin(); it != recording.end(); it++) {
+    *(ptr++) = encode_action(*it);
+  }
+
+  save_file_atomic(filename, data);
+}
+
+void load_session(const string& filename, uint64_t* level_index,
+    uint64_t* level_hash, level_state& game, action_buffer& recording) {
+  typedef level_state::undo_log_entry::entry_type entry_type;
+
+  mapped_file f(filename);
+  mapped_reader r(f.data(), f.size());
+
+  const session_header* header = r.get<session_header>();
+  if (header->signature != SESSION_SIGNATURE) {
+    throw runtime_error("file is not a session snapshot");
+  }
+  if (header->version != SESSION_VERSION) {
+    throw runtime_error("unsupported session version");
+  }
+
+  // the cells must all be in the file, but check the dimensions first anyway:
+  // a zero dimension would make every coordinate computation divide by zero,
+  // and w * h can overflow when multiplied by the record size
+  if (!header->w || !header->h ||
+      (header->w > MAX_SESSION_CELLS) || (header->h > MAX_SESSION_CELLS) ||
+      (static_cast<uint64_t>(header->w) * header->h > MAX_SESSION_CELLS)) {
+    throw runtime_error("session has invalid dimensions");
+  }
+  size_t num_cells = static_cast<size_t>(header->w) * header->h;
+  const session_cell* cells = r.get<session_cell>(num_cells);
+  const explosion_info* explosions = r.get<explosion_info>(
+      header->num_pending_explosions);
+  const session_undo_record* undo_records = r.get<session_undo_record>(
+      header->num_undo_entries);
+  const uint8_t* recording_data = r.get<uint8_t>(header->num_recording_frames);
+
+  // the undo log must always start with a frame marker, and the last entry
+  // must be the marker for the current frame; rewinding relies on both
+  if (!header->num_undo_entries ||
+      (undo_records[0].type != static_cast<uint8_t>(entry_type::FrameMarker)) ||
+      (undo_records[header->num_undo_entries - 1].type != static_cast<uint8_t>(entry_type::FrameMarker)) ||
+      (undo_records[header->num_undo_entries - 1].frame != header->frames_executed)) {
+    throw runtime_error("session undo log is inconsistent");
+  }
+
+  level_state l(header->w, header->h, -1, -1);
+  l.player_x = header->player_x;
+  l.player_y = header->player_y;
+  l.num_items_remaining = header->num_items_remaining;
+  l.num_red_bombs = header->num_red_bombs;
+  l.frames_executed = header->frames_executed;
+  l.rewind_count = header->rewind_count;
+  l.player_lose_frame = header->player_lose_frame;
+  l.player_lose_buffer = header->player_lose_buffer;
+  l.updates_per_second = header->updates_per_second;
+  l.player_will_drop_bomb = header->player_will_drop_bomb;
+  l.player_did_win = header->player_did_win;
+
+  for (size_t x = 0; x < num_cells; x++) {
+    l.cells[x] = cell_state(static_cast<cell_type>(cells[x].type),
+        cells[x].param);
+  }
+
+  l.pending_explosions.assign(explosions,
+      explosions + header->num_pending_explosions);
+
+  l.undo_log.clear();
+  for (uint64_t x = 0; x < header->num_undo_entries; x++) {
+    const session_undo_record& ur = undo_records[x];
+    switch (static_cast<entry_type>(ur.type)) {
+      case entry_type::FrameMarker:
+        l.undo_log.emplace_back(ur.frame);
+        break;
+      case entry_type::Cell:
+        l.undo_log.emplace_back(ur.x, ur.y, cell_state(
+            static_cast<cell_type>(ur.value), static_cast<int32_t>(ur.frame)));
+        break;
+      case entry_type::CreateExplosion:
+      case entry_type::ExecuteExplosion:
+        l.undo_log.emplace_back(static_cast<entry_type>(ur.type),
+            explosion_info(ur.frame, ur.x, ur.y, ur.value,
+              static_cast<explosion_type>(ur.explosion_type)));
+        break;
+      case entry_type::GetItem:
+      case entry_type::GetRedBomb:
+      case entry_type::DropRedBomb:
+        l.undo_log.emplace_back(static_cast<entry_type>(ur.type));
+        break;
+      default:
+        throw runtime_error("session undo log contains an unknown entry type");
+    }
+  }
+
+  action_buffer rec;
+  for (uint64_t x = 0; x < header->num_recording_frames; x++) {
+    rec.push_back(decode_action(recording_data[x]));
+  }
+  l.recompute_winnability();
+
+  // only modify the caller's state once everything has been validated
+  *level_index = header->level_index;
+  *level_hash = header->level_hash;
+  game = move(l);
+  recording = move(rec);
+}
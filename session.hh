@@ -0,0 +1,31 @@
+#ifndef __SESSION_H
+#define __SESSION_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "action_buffer.hh"
+#include "level.hh"
+
+
+// a session is everything needed to resume a game exactly where it was left:
+// the full runtime level state (including the undo log, so rewinding still
+// works after resuming), the recording so far, and which level it belongs to.
+// sessions are written to a temp file and renamed into place, so a crash
+// during a save never destroys the previous snapshot.
+//
+// level_hash is the level_template::hash of the level the game was started
+// from. the pack can be edited between saving and loading a session, so
+// callers should only resume one if that level still has the same hash.
+
+void save_session(const std::string& filename, uint64_t level_index,
+    uint64_t level_hash, const level_state& game,
+    const action_buffer& recording);
+
+// throws cannot_open_file if the file doesn't exist, or runtime_error if it's
+// corrupt or truncated
+void load_session(const std::string& filename, uint64_t* level_index,
+    uint64_t* level_hash, level_state& game, action_buffer& recording);
+
+#endif // __SESSION_H
@@ -0,0 +1,498 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <phosg/Time.hh>
+
+#include "action_buffer.hh"
+#include "level.hh"
+#include "parallel.hh"
+#include "solver.hh"
+
+using namespace std;
+
+
+solver_options::solver_options() : goal(solver_goal::Win), num_threads(0),
+    pool(NULL), max_frames(0), time_limit_usecs(0),
+    table_size(64 * 1024 * 1024), cancel(NULL) { }
+
+solver_result::solver_result() : solved(false), unsolvable(false),
+    timed_out(false), cancelled(false), bound(0), nodes_expanded(0) { }
+
+
+
+static const uint64_t NO_BOUND = 0xFFFFFFFFFFFFFFFF;
+
+// a fixed-size table of (state hash -> depth, round) that any number of threads
+// can use without locking. each entry is two words, and the first is the key
+// XORed with the second; a reader that sees half of another thread's write
+// gets a key that doesn't match, so torn entries look like empty ones.
+// entries are grouped in buckets of 4, and a new state replaces the least
+// useful entry in its bucket (from the oldest round, and deepest within it)
+class transposition_table {
+public:
+  explicit transposition_table(size_t size) {
+    size_t num_buckets = 1;
+    while (num_buckets * 2 * sizeof(bucket) <= size) {
+      num_buckets *= 2;
+    }
+    this->bucket_mask = num_buckets - 1;
+    this->buckets.reset(new bucket[num_buckets]);
+    for (size_t x = 0; x < num_buckets; x++) {
+      for (size_t y = 0; y < 4; y++) {
+        this->buckets[x].entries[y].check.store(0, memory_order_relaxed);
+        this->buckets[x].entries[y].data.store(0, memory_order_relaxed);
+      }
+    }
+  }
+
+  // records that the state was reached at this depth in this round, and
+  // returns true if it doesn't need to be searched: it was reached at a lower
+  // depth (in any round, since it will be reached there again in this round),
+  // or at the same depth earlier in this round. rounds start at 1; round 0
+  // entries are never matched at the same depth
+  bool visit(uint64_t key, uint32_t depth, uint32_t round) {
+    bucket& b = this->buckets[key & this->bucket_mask];
+    uint64_t new_data = (static_cast<uint64_t>(round) << 32) | depth;
+
+    entry* victim = NULL;
+    uint64_t victim_data = 0;
+    for (size_t x = 0; x < 4; x++) {
+      entry& e = b.entries[x];
+      uint64_t data = e.data.load(memory_order_relaxed);
+      uint64_t check = e.check.load(memory_order_relaxed);
+      if (data && ((check ^ data) == key)) {
+        uint32_t stored_depth = data & 0xFFFFFFFF;
+        uint32_t stored_round = data >> 32;
+        if ((stored_depth < depth) ||
+            ((stored_depth == depth) && (stored_round == round) && round)) {
+          return true;
+        }
+        victim = &e;
+        break;
+      }
+
+      if (!victim || !data || (data_is_less_useful(data, victim_data))) {
+        victim = &e;
+        victim_data = data;
+      }
+    }
+
+    victim->data.store(new_data, memory_order_relaxed);
+    victim->check.store(key ^ new_data, memory_order_relaxed);
+    return false;
+  }
+
+private:
+  struct entry {
+    atomic<uint64_t> check;
+    atomic<uint64_t> data;
+  };
+  struct bucket {
+    entry entries[4];
+  };
+
+  static bool data_is_less_useful(uint64_t a, uint64_t b) {
+    if (!b) {
+      return false; // empty entries are always replaced first
+    }
+    if ((a >> 32) != (b >> 32)) {
+      return (a >> 32) < (b >> 32);
+    }
+    return (a & 0xFFFFFFFF) > (b & 0xFFFFFFFF);
+  }
+
+  unique_ptr<bucket[]> buckets;
+  size_t bucket_mask;
+};
+
+
+
+struct search_node {
+  level_state state;
+  vector<player_actions> path;
+};
+
+struct solver_context {
+  const solver_options& options;
+  transposition_table table;
+  uint64_t deadline; // 0 = none
+
+  // the farthest a player can move in one frame, and where the exits were at
+  // the start. exits can be destroyed but never created or moved
+  int32_t max_step;
+  vector<pair<int32_t, int32_t>> exits;
+
+  uint32_t round;
+  uint64_t bound;
+  atomic<uint64_t> next_bound;
+  atomic<uint64_t> nodes_expanded;
+  atomic<bool> stop;
+  atomic<bool> timed_out;
+  atomic<bool> cancelled;
+
+  mutex solution_lock;
+  bool solved;
+  vector<player_actions> solution;
+
+  solver_context(const solver_options& options, const level_state& start)
+      : options(options), table(options.table_size), deadline(0), max_step(1),
+      round(0), bound(0), next_bound(NO_BOUND), nodes_expanded(0), stop(false),
+      timed_out(false), cancelled(false), solved(false) {
+    if (options.time_limit_usecs) {
+      this->deadline = now() + options.time_limit_usecs;
+    }
+
+    for (int32_t y = 0; y < static_cast<int32_t>(start.h); y++) {
+      for (int32_t x = 0; x < static_cast<int32_t>(start.w); x++) {
+        const cell_state& c = start.at(x, y);
+        if (c.type == Exit) {
+          this->exits.emplace_back(x, y);
+        } else if (c.is_jump_portal()) {
+          this->max_step = max<int32_t>(this->max_step, max(start.w, start.h));
+        } else if (c.is_any_portal()) {
+          this->max_step = max<int32_t>(this->max_step, 2);
+        }
+      }
+    }
+  }
+
+  // the level wraps around at the edges
+  static int32_t distance(const level_state& l, int32_t x, int32_t y) {
+    int32_t dx = abs(x - l.player_x);
+    int32_t dy = abs(y - l.player_y);
+    return min<int32_t>(dx, l.w - dx) + min<int32_t>(dy, l.h - dy);
+  }
+
+  uint64_t frames_to_exit(const level_state& l) const {
+    uint64_t ret = NO_BOUND;
+    for (const auto& pos : this->exits) {
+      if (l.at(pos.first, pos.second).type == Exit) {
+        int32_t d = distance(l, pos.first, pos.second);
+        ret = min<uint64_t>(ret, (d + this->max_step - 1) / this->max_step);
+      }
+    }
+    return ret;
+  }
+
+  // items can fall or roll toward the player while it moves toward them, and
+  // explosions can make new ones, so this is only an estimate
+  uint64_t frames_to_item(const level_state& l) const {
+    int32_t min_distance = -1;
+    for (int32_t y = 0; y < static_cast<int32_t>(l.h); y++) {
+      for (int32_t x = 0; x < static_cast<int32_t>(l.w); x++) {
+        if (l.at(x, y).type == Item) {
+          int32_t d = distance(l, x, y);
+          if ((min_distance < 0) || (d < min_distance)) {
+            min_distance = d;
+          }
+        }
+      }
+    }
+    if (min_distance < 0) {
+      return 1;
+    }
+    return max<uint64_t>(1, (min_distance + this->max_step) / (this->max_step + 1));
+  }
+
+  // a lower bound on the frames it takes to reach the goal from this state,
+  // or NO_BOUND if it can't be reached
+  uint64_t heuristic(const level_state& l) const {
+    if (!l.player_is_alive() || l.unwinnable) {
+      return NO_BOUND;
+    }
+
+    uint64_t exit_frames = this->frames_to_exit(l);
+    if (this->options.goal == solver_goal::Progress) {
+      uint64_t item_frames = this->frames_to_item(l);
+      return (l.num_items_remaining > 0) ? item_frames :
+          min<uint64_t>(item_frames, exit_frames);
+    }
+    if (exit_frames == NO_BOUND) {
+      return NO_BOUND;
+    }
+
+    // at most one item can be collected per frame, and the move onto the exit
+    // comes after the last one
+    uint64_t item_frames = (l.num_items_remaining > 0) ?
+        (l.num_items_remaining + 1) : 0;
+    return max<uint64_t>(exit_frames, item_frames);
+  }
+
+  // l is the state after a frame that had these events
+  bool reached_goal(const level_state& l, uint64_t events) const {
+    if (l.player_did_win) {
+      return true;
+    }
+    if ((this->options.goal != solver_goal::Progress) ||
+        !(events & ItemCollected)) {
+      return false;
+    }
+    // don't suggest taking an item that something is about to fall on
+    level_state after = l;
+    for (size_t x = 0; x < 10; x++) {
+      after.exec_frame(player_actions{None, false});
+      if (!after.player_is_alive()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void lower_next_bound(uint64_t f) {
+    uint64_t current = this->next_bound.load();
+    while ((f < current) && !this->next_bound.compare_exchange_weak(current, f));
+  }
+
+  void found_solution(const vector<player_actions>& path) {
+    lock_guard<mutex> g(this->solution_lock);
+    if (!this->solved) {
+      this->solved = true;
+      this->solution = path;
+    }
+    this->stop = true;
+  }
+
+  // checks the time limit and the cancel flag; called every thousand or so
+  // states by each thread, and between rounds
+  void check_limits() {
+    if (this->options.cancel && this->options.cancel->load()) {
+      this->cancelled = true;
+      this->stop = true;
+    }
+    if (this->deadline && (now() >= this->deadline)) {
+      this->timed_out = true;
+      this->stop = true;
+    }
+  }
+};
+
+static size_t actions_for_state(const level_state& l, player_actions* actions) {
+  static const player_impulse impulses[5] = {Up, Down, Left, Right, None};
+  size_t count = 0;
+  for (player_impulse impulse : impulses) {
+    actions[count].impulse = impulse;
+    actions[count].drop_bomb = false;
+    count++;
+  }
+  if ((l.num_red_bombs > 0) && !l.player_will_drop_bomb) {
+    for (size_t x = 0; x < 4; x++) {
+      actions[count].impulse = impulses[x];
+      actions[count].drop_bomb = true;
+      count++;
+    }
+  }
+  return count;
+}
+
+// the per-thread state of the depth-first search. states[d] holds the state at
+// depth d (relative to the frontier node being searched), so each one is
+// allocated once and reused by every later search on the thread
+struct search_thread {
+  solver_context& ctx;
+  vector<level_state> states;
+  vector<player_actions> path;
+  uint64_t nodes_since_check;
+
+  explicit search_thread(solver_context& ctx) : ctx(ctx), nodes_since_check(0) { }
+
+  void search(size_t index, uint64_t depth) {
+    // the cancel flag is checked on every state, since hints are cancelled
+    // whenever the player moves
+    if (this->ctx.options.cancel &&
+        this->ctx.options.cancel->load(memory_order_relaxed)) {
+      this->ctx.cancelled = true;
+      this->ctx.stop = true;
+    }
+    if (this->ctx.stop) {
+      return;
+    }
+    if (++this->nodes_since_check >= 0x400) {
+      this->ctx.nodes_expanded += this->nodes_since_check;
+      this->nodes_since_check = 0;
+      this->ctx.check_limits();
+    }
+
+    if (this->states.size() <= index + 1) {
+      this->states.resize(index + 2);
+    }
+
+    player_actions actions[9];
+    size_t num_actions = actions_for_state(this->states[index], actions);
+    for (size_t x = 0; (x < num_actions) && !this->ctx.stop; x++) {
+      level_state& child = this->states[index + 1];
+      child = this->states[index];
+      uint64_t events = child.exec_frame(actions[x]);
+
+      this->path.emplace_back(actions[x]);
+      if (this->ctx.reached_goal(child, events)) {
+        this->ctx.found_solution(this->path);
+        return;
+      }
+
+      uint64_t h = this->ctx.heuristic(child);
+      if (h != NO_BOUND) {
+        uint64_t f = depth + 1 + h;
+        if (f > this->ctx.bound) {
+          this->ctx.lower_next_bound(f);
+        } else if (!this->ctx.table.visit(child.gameplay_hash(), depth + 1,
+            this->ctx.round)) {
+          this->search(index + 1, depth + 1);
+        }
+      }
+      this->path.pop_back();
+    }
+  }
+};
+
+// expands the start state breadth-first until there are enough states to give
+// every thread several, and returns them. if a solution is found on the way,
+// it's the shortest one, so it's returned via ctx instead
+static vector<search_node> build_frontier(solver_context& ctx,
+    const level_state& start, size_t target_size) {
+  vector<search_node> frontier(1);
+  frontier[0].state = start;
+  frontier[0].state.set_undo_log_enabled(false);
+  ctx.table.visit(start.gameplay_hash(), 0, 0);
+
+  for (uint64_t depth = 0; (frontier.size() < target_size) && (depth < 8);
+       depth++) {
+    if (ctx.options.max_frames && (depth >= ctx.options.max_frames)) {
+      break;
+    }
+
+    vector<search_node> next;
+    for (const auto& node : frontier) {
+      player_actions actions[9];
+      size_t num_actions = actions_for_state(node.state, actions);
+      for (size_t x = 0; x < num_actions; x++) {
+        ctx.nodes_expanded++;
+        search_node child;
+        child.state = node.state;
+        uint64_t events = child.state.exec_frame(actions[x]);
+        child.path = node.path;
+        child.path.emplace_back(actions[x]);
+
+        if (ctx.reached_goal(child.state, events)) {
+          ctx.found_solution(child.path);
+          return vector<search_node>();
+        }
+        if ((ctx.heuristic(child.state) == NO_BOUND) ||
+            ctx.table.visit(child.state.gameplay_hash(), depth + 1, 0)) {
+          continue;
+        }
+        next.emplace_back(move(child));
+      }
+    }
+    frontier.swap(next);
+    if (frontier.empty()) {
+      break;
+    }
+  }
+  return frontier;
+}
+
+solver_result solve_level(const level_state& start,
+    const solver_options& options) {
+  solver_context ctx(options, start);
+  size_t num_threads = options.pool ? options.pool->size() :
+      options.num_threads ? options.num_threads : default_thread_count();
+
+  solver_result ret;
+  if (start.player_did_win) {
+    ret.solved = true;
+    return ret;
+  }
+  if (ctx.heuristic(start) == NO_BOUND) {
+    ret.unsolvable = true;
+    return ret;
+  }
+
+  vector<search_node> frontier = build_frontier(ctx, start, 16 * num_threads);
+  uint64_t frontier_depth = frontier.empty() ? 0 : frontier[0].path.size();
+
+  if (!ctx.solved && !frontier.empty()) {
+    for (const auto& node : frontier) {
+      uint64_t h = ctx.heuristic(node.state);
+      ctx.lower_next_bound(frontier_depth + h);
+    }
+
+    vector<unique_ptr<search_thread>> threads;
+    for (size_t x = 0; x < num_threads; x++) {
+      threads.emplace_back(new search_thread(ctx));
+    }
+
+    // every round is a parallel_for, and rounds can be short, so the threads
+    // are started once for the whole search
+    unique_ptr<thread_pool> own_pool;
+    thread_pool* pool = options.pool;
+    if (!pool) {
+      own_pool.reset(new thread_pool(num_threads));
+      pool = own_pool.get();
+    }
+
+    for (;;) {
+      // rounds can be shorter than the threads' checking interval
+      ctx.check_limits();
+      if (ctx.stop) {
+        break;
+      }
+      ctx.bound = ctx.next_bound;
+      if ((ctx.bound == NO_BOUND) ||
+          (options.max_frames && (ctx.bound > options.max_frames))) {
+        break;
+      }
+      ctx.next_bound = NO_BOUND;
+      ctx.round++;
+
+      pool->parallel_for(frontier.size(), [&](size_t index, size_t thread_index) {
+        search_thread& t = *threads[thread_index];
+        const search_node& node = frontier[index];
+        if (ctx.stop || (frontier_depth + ctx.heuristic(node.state) > ctx.bound)) {
+          return;
+        }
+        // the frontier states are all at the same depth and distinct, so
+        // this never prunes one; it records them for this round
+        ctx.table.visit(node.state.gameplay_hash(), frontier_depth, ctx.round);
+
+        if (t.states.empty()) {
+          t.states.resize(1);
+        }
+        t.states[0] = node.state;
+        t.path = node.path;
+        t.search(0, frontier_depth);
+      });
+
+      for (auto& t : threads) {
+        ctx.nodes_expanded += t->nodes_since_check;
+        t->nodes_since_check = 0;
+      }
+      if (options.progress && !ctx.stop) {
+        options.progress(ctx.bound, ctx.nodes_expanded);
+      }
+    }
+  }
+
+  ret.solved = ctx.solved;
+  ret.timed_out = !ctx.solved && ctx.timed_out;
+  ret.cancelled = !ctx.solved && ctx.cancelled;
+  ret.unsolvable = !ctx.solved && !ctx.timed_out && !ctx.cancelled &&
+      (frontier.empty() || (ctx.next_bound == NO_BOUND) ||
+       (options.max_frames && (ctx.bound > options.max_frames)));
+  ret.nodes_expanded = ctx.nodes_expanded;
+  if (ctx.solved) {
+    for (const auto& a : ctx.solution) {
+      ret.solution.push_back(a);
+    }
+    ret.bound = ret.solution.size();
+  } else {
+    ret.bound = ctx.bound;
+  }
+  return ret;
+}
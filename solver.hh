@@ -0,0 +1,85 @@
+#ifndef __SOLVER_H
+#define __SOLVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+
+#include "action_buffer.hh"
+#include "level.hh"
+#include "parallel.hh"
+
+
+enum class solver_goal {
+  // win the level
+  Win = 0,
+  // collect an item or win, and still be alive a moment later. this is what
+  // in-game hints look for
+  Progress,
+};
+
+struct solver_options {
+  solver_goal goal;
+  size_t num_threads; // 0 = default_thread_count()
+  // if not NULL, the search runs on this pool's threads (and num_threads is
+  // ignored) instead of starting its own for each search
+  thread_pool* pool;
+  uint64_t max_frames; // give up on solutions longer than this; 0 = no limit
+  uint64_t time_limit_usecs; // 0 = no limit
+  size_t table_size; // bytes of memory for the transposition table
+
+  // if not NULL, the search stops soon after this becomes true
+  const std::atomic<bool>* cancel;
+
+  // if set, called after each round of the search with the round's frame limit
+  // and the number of states expanded so far. called on the solving thread
+  std::function<void(uint64_t bound, uint64_t nodes_expanded)> progress;
+
+  solver_options();
+};
+
+struct solver_result {
+  bool solved;
+  action_buffer solution; // the winning actions, if solved
+
+  // true if the search ran out of states to try: the level can't be won from
+  // this state (within max_frames, if it's set)
+  bool unsolvable;
+  bool timed_out;
+  bool cancelled;
+
+  // if solved, the solution's length; otherwise, every solution is at least
+  // this many frames long
+  uint64_t bound;
+  uint64_t nodes_expanded;
+
+  solver_result();
+};
+
+// finds a winning sequence of actions with as few frames as possible, using
+// iterative-deepening A* with exec_frame as the transition function. the
+// heuristic is the larger of the items left to collect (plus one for the move
+// onto the exit) and the distance to the nearest exit, counting portals; both
+// never overestimate, so the first solution found is a shortest one.
+//
+// states are identified by level_state::gameplay_hash in a lock-free
+// transposition table shared by all the threads, so a state reached again (by
+// waiting, or by moving in a different order) is only searched from once per
+// round. the threads split the first few frames' states between them and
+// steal each other's work with parallel_for.
+//
+// states that level_state knows can't be won (see level_state::unwinnable) are
+// never searched from.
+//
+// the solver only drops red bombs the player has, and only while moving (like
+// the game's controls).
+//
+// with solver_goal::Progress, the search stops at the first item collected
+// instead. items can fall toward the player, so the heuristic for that can
+// overestimate, and the result may not be the shortest way to an item.
+solver_result solve_level(const level_state& start,
+    const solver_options& options = solver_options());
+
+#endif // __SOLVER_H